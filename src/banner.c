@@ -4,6 +4,7 @@
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdbool.h>
 #include <assert.h>
 
 #include "banner.h"
@@ -29,6 +30,7 @@ static const struct m_entry typelist[] = {
 	{ "ftp",      { 21 }, 1, 0 },
 	{ "ssh",      { 22 }, 1, 0 },
 	{ "telnet",   { 23 }, 1, 0 },
+	{ "smtp",     { 25, 587 }, 1, 0 },
 	{ "domain",   { 53 }, 1, 1 },
 	{ "http",     { 80, 8080 }, 1, 0 },
 	{ "ntp",      { 123 }, 0, 1 },
@@ -40,6 +42,7 @@ static const struct m_entry typelist[] = {
 	{ "mysql",    { 3306 }, 1, 0 },
 	{ "sip",      { 5060 }, 0, 1 },
 	{ "mdns",     { 5353 }, 0, 1 },
+	{ "redis",    { 6379 }, 1, 0 },
 	{ NULL, }
 };
 
@@ -54,6 +57,7 @@ const char *banner_service_type(uint8_t ip_type, int port)
 		CASE(21, "ftp")
 		CASE(22, "ssh")
 		CASE(23, "telnet")
+		CASE2(25, 587, "smtp")
 		CASE(53, "domain")
 		CASE2(80, 8080, "http")
 		CASE(123, "ntp")
@@ -65,6 +69,7 @@ const char *banner_service_type(uint8_t ip_type, int port)
 		CASE(3306, "mysql")
 		CASE(5060, "sip")
 		CASE(5353, "mdns")
+		CASE(6379, "redis")
 		default:
 			return NULL;
 	}
@@ -196,6 +201,9 @@ static const char *get_query_tcp(int port, u_int *len)
 		"User-Agent: fi6s/0.1\r\n"
 		"\r\n"
 	;
+	static const char redis[] =
+		"PING\r\n"
+	;
 
 
 	switch(port) {
@@ -215,6 +223,10 @@ static const char *get_query_tcp(int port, u_int *len)
 		case 1723:
 			*len = sizeof(pptp) - 1;
 			return pptp;
+		case 6379:
+			*len = sizeof(redis) - 1;
+			return redis;
+		// (53 is shared with UDP, see banner_get_query)
 		default:
 			*len = 0; // send nothing
 			return "";
@@ -341,6 +353,13 @@ static const char *get_query_udp(int port, u_int *len)
 void postprocess_tcp(int port, uchar *banner, u_int *len);
 void postprocess_udp(int port, uchar *banner, u_int *len);
 
+// cut-off points shared between postprocessing and completion detection:
+static const uchar *ssh_ident_end(const uchar *banner, u_int len);
+static const uchar *http_headers_end(const uchar *banner, u_int len);
+static int ftp_replies_complete(const uchar *banner, u_int len, int count);
+static int redis_replies(const uchar *banner, u_int len, bool *error);
+static int tls_complete(const uchar *banner, u_int len);
+
 // protocols:
 static int dns_process(u_int off, uchar *banner, u_int *len);
 static int mdns_process(uchar *banner, u_int *len);
@@ -375,10 +394,7 @@ void postprocess_tcp(int port, uchar *banner, u_int *len)
 	switch(port) {
 		case 22: {
 			// cut off after identification string or first NUL
-			uchar *end;
-			end = (uchar*) memmem(banner, *len, "\r\n", 2);
-			if(!end)
-				end = (uchar*) memchr(banner, 0, *len);
+			const uchar *end = ssh_ident_end(banner, *len);
 			if(end)
 				*len = end - banner;
 			break;
@@ -388,9 +404,7 @@ void postprocess_tcp(int port, uchar *banner, u_int *len)
 		case 554:
 		case 8080: {
 			// cut off after headers
-			uchar *end = (uchar*) memmem(banner, *len, "\r\n\r\n", 4);
-			if(!end)
-				end = (uchar*) memmem(banner, *len, "\n\n", 2);
+			const uchar *end = http_headers_end(banner, *len);
 			if(end)
 				*len = end - banner;
 			break;
@@ -415,6 +429,196 @@ void postprocess_tcp(int port, uchar *banner, u_int *len)
 	}
 }
 
+int banner_complete(uint8_t ip_type, int port, const char *_banner, u_int len)
+{
+	const uchar *banner = (const uchar*) _banner;
+	if(ip_type != IP_TYPE_TCP)
+		return 1;
+
+	switch(port) {
+		case 21: // greeting and the replies to HELP and FEAT
+			return ftp_replies_complete(banner, len, 3);
+
+		case 25:
+		case 587: // greeting and the reply to EHLO (see banner_get_followup)
+			return ftp_replies_complete(banner, len, 2);
+
+		case 22:
+			return ssh_ident_end(banner, len) != NULL;
+
+		case 53: // reply to the length prefixed query, see banner_get_query
+			return len >= 2 && len >= 2 + (banner[0] << 8 | banner[1]);
+
+		case 80:
+		case 554:
+		case 8080:
+			return http_headers_end(banner, len) != NULL;
+
+		case 1723: // pptp_process() needs no more than this
+			return len >= 156;
+
+		case 443:
+			return tls_complete(banner, len);
+
+		case 3306: // first packet, 3-byte length and sequence number
+			return len >= 4 && len >= 4 + (banner[0] | banner[1] << 8 | banner[2] << 16);
+
+		case 6379: { // replies to PING and INFO
+			bool error;
+			int n = redis_replies(banner, len, &error);
+			return n >= 2 || error;
+		}
+
+		default:
+			return 0; // no idea, wait for timeout
+	}
+}
+
+const char *banner_get_followup(uint8_t ip_type, int port, int *step, const char *_banner, u_int len, u_int *qlen)
+{
+	static const char smtp_ehlo[] =
+		"EHLO fi6s.invalid\r\n"
+	;
+	static const char redis_info[] =
+		"INFO server\r\n"
+	;
+
+	const uchar *banner = (const uchar*) _banner;
+	if(ip_type != IP_TYPE_TCP)
+		return NULL;
+
+	switch(port) {
+		case 25:
+		case 587:
+			// introduce ourselves after the greeting to see the extensions
+			if(*step == 0 && ftp_replies_complete(banner, len, 1) &&
+				banner[0] == '2') {
+				*step = 1;
+				*qlen = sizeof(smtp_ehlo) - 1;
+				return smtp_ehlo;
+			}
+			break;
+
+		case 6379: {
+			// ask for server info if PING went through (no auth required)
+			bool error;
+			if(*step == 0 && redis_replies(banner, len, &error) == 1 && !error) {
+				*step = 1;
+				*qlen = sizeof(redis_info) - 1;
+				return redis_info;
+			}
+			break;
+		}
+	}
+	return NULL;
+}
+
+static const uchar *ssh_ident_end(const uchar *banner, u_int len)
+{
+	const uchar *end = memmem(banner, len, "\r\n", 2);
+	if(!end)
+		end = memchr(banner, 0, len);
+	return end;
+}
+
+static const uchar *http_headers_end(const uchar *banner, u_int len)
+{
+	const uchar *end = memmem(banner, len, "\r\n\r\n", 4);
+	if(!end)
+		end = memmem(banner, len, "\n\n", 2);
+	return end;
+}
+
+static int ftp_replies_complete(const uchar *banner, u_int len, int count)
+{
+	// a reply ends with a line of the form "123 text"
+	u_int off = 0;
+	bool first = true;
+	while(off < len) {
+		const uchar *eol = memchr(&banner[off], '\n', len - off);
+		if(!eol)
+			break;
+		if(off + 4 <= len && banner[off+3] == ' ' &&
+			banner[off] >= '1' && banner[off] <= '5') {
+			// error as greeting: server is unavailable, nothing will follow
+			if(first && banner[off] >= '4')
+				return 1;
+			if(--count == 0)
+				return 1;
+			first = false;
+		}
+		off = eol - banner + 1;
+	}
+	return 0;
+}
+
+static int redis_replies(const uchar *banner, u_int len, bool *error)
+{
+	// counts complete simple strings, errors and bulk strings
+	u_int off = 0;
+	int n = 0;
+	*error = false;
+	while(off < len) {
+		const uchar *eol = memmem(&banner[off], len - off, "\r\n", 2);
+		if(!eol)
+			break;
+		u_int next = eol - banner + 2;
+		if(banner[off] == '-') {
+			*error = true;
+		} else if(banner[off] == '$') {
+			// length line followed by data, unless it's $-1 (null)
+			const uchar *q = &banner[off+1];
+			u_int size = 0;
+			if(q < eol && *q != '-') {
+				for(; q < eol && *q >= '0' && *q <= '9' && size < BANNER_MAX_LENGTH; q++)
+					size = size * 10 + (*q - '0');
+				next += size + 2;
+			}
+		} else if(banner[off] != '+' && banner[off] != ':') {
+			*error = true; // not redis
+		}
+		if(next > len)
+			break;
+		n++;
+		off = next;
+	}
+	return n;
+}
+
+static int tls_complete(const uchar *banner, u_int len)
+{
+	// walk the handshake messages until ServerHelloDone
+	// (messages, including their header, may be split across records)
+	u_int off = 0, msg_left = 0, hdr_have = 0;
+	uchar hdr[4];
+	while(off + 5 <= len) {
+		if(banner[off] != 22) // not a handshake record (alert, encrypted TLS 1.3 data, ...)
+			return 1;
+		u_int rend = off + 5 + (banner[off+3] << 8 | banner[off+4]);
+		u_int p = off + 5;
+		if(rend > len)
+			rend = len;
+		while(p < rend) {
+			if(msg_left > 0) {
+				u_int skip = msg_left < rend - p ? msg_left : rend - p;
+				p += skip;
+				msg_left -= skip;
+				continue;
+			}
+			while(hdr_have < 4 && p < rend)
+				hdr[hdr_have++] = banner[p++];
+			if(hdr_have < 4)
+				break;
+			hdr_have = 0;
+			if(hdr[0] == 14) // ServerHelloDone
+				return 1;
+			msg_left = hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+		}
+		off += 5 + (banner[off+3] << 8 | banner[off+4]);
+	}
+	return 0;
+}
+
 void postprocess_udp(int port, uchar *banner, u_int *len)
 {
 	switch(port) {
@@ -16,5 +16,10 @@ const char *banner_service_type(uint8_t ip_type, int port);
 const char *banner_get_query(uint8_t ip_type, int port, unsigned int *len);
 // The buffer passed into this must be writable and hold at least BANNER_MAX_LENGTH bytes
 void banner_postprocess(uint8_t ip_type, int port, char *data, unsigned int *len);
+// Whether the response is complete and no further data needs to be waited for
+int banner_complete(uint8_t ip_type, int port, const char *data, unsigned int len);
+// Follow-up query to send on the same connection once the response so far
+// calls for it. <step> starts at 0 and is advanced when a query is returned.
+const char *banner_get_followup(uint8_t ip_type, int port, int *step, const char *data, unsigned int len, unsigned int *qlen);
 
 uint8_t banner_outproto2ip_type(int output_proto); // helper used by output modules
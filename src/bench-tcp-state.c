@@ -0,0 +1,144 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+// Microbenchmark for the TCP session table.
+// Build with: make BUILD_TYPE=release BENCH=tcp-state
+
+#define _POSIX_C_SOURCE 200112L // CLOCK_MONOTONIC
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "tcp.h"
+#include "banner.h"
+#include "util.h"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void make_key(uint32_t n, uint8_t *addr, uint16_t *port)
+{
+	static const uint8_t prefix[8] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0};
+	memcpy(addr, prefix, 8);
+	memset(&addr[8], 0, 4);
+	// sequential addresses, like a scan of a contiguous range would produce
+	addr[12] = n >> 24;
+	addr[13] = n >> 16;
+	addr[14] = n >> 8;
+	addr[15] = n;
+	*port = 80 + (n & 3);
+}
+
+static int run(uint32_t sessions, uint32_t lookups)
+{
+	uint8_t addr[16];
+	uint16_t port;
+	tcp_state_ptr p;
+	uint64_t t0, t1, t2, t3;
+
+	if(tcp_state_init(BANNER_MAX_LENGTH, 0) < 0)
+		return -1;
+
+	t0 = now_ns();
+	for(uint32_t n = 0; n < sessions; n++) {
+		make_key(n, addr, &port);
+		tcp_state_create(addr, port, 0, 0, n, n, 60000);
+	}
+
+	// typical small banner, sometimes in two segments
+	char data[200] = {0};
+	uint32_t ack;
+	uint64_t tp = now_ns();
+	for(uint32_t n = 0; n < sessions; n++) {
+		make_key(n, addr, &port);
+		if(tcp_state_find(addr, port, &p)) {
+			tcp_state_push(&p, data, 100, n + 1, &ack);
+			if(n & 1)
+				tcp_state_push(&p, data, 100, n + 101, &ack);
+			tcp_state_unlock(&p);
+		}
+	}
+
+	t1 = now_ns();
+	uint32_t found = 0;
+	for(uint32_t j = 0; j < lookups; j++) {
+		make_key(rand() % sessions, addr, &port);
+		if(tcp_state_find(addr, port, &p)) {
+			found++;
+			tcp_state_add_seqnum(&p, 1);
+			tcp_state_unlock(&p);
+		}
+	}
+
+	t2 = now_ns();
+	uint32_t missed = 0;
+	for(uint32_t j = 0; j < lookups; j++) {
+		make_key(sessions + j, addr, &port);
+		if(!tcp_state_find(addr, port, &p))
+			missed++;
+		else
+			tcp_state_unlock(&p);
+	}
+
+	t3 = now_ns();
+	uint32_t deleted = 0;
+	for(uint32_t n = 0; n < sessions; n++) {
+		make_key(n, addr, &port);
+		if(tcp_state_find(addr, port, &p)) {
+			tcp_state_delete(&p);
+			deleted++;
+		}
+	}
+	uint64_t t4 = now_ns();
+
+	for(uint32_t n = 0; n < sessions; n++) {
+		make_key(n, addr, &port);
+		tcp_state_create(addr, port, 0, 0, n, n, 0);
+	}
+	uint64_t t5 = now_ns();
+	uint32_t expired = 0;
+	while(tcp_state_next_expired(&p)) {
+		tcp_state_delete(&p);
+		expired++;
+	}
+	uint64_t t6 = now_ns();
+
+	tcp_state_fini();
+
+	printf("%8" PRIu32 " sessions: insert %6.1f ns/op, push %6.1f ns/op, hit %6.1f ns/op, "
+		"miss %6.1f ns/op, delete %6.1f ns/op, expire %6.1f ns/op\n", sessions,
+		(tp - t0) * 1.0 / sessions, (t1 - tp) * 1.0 / sessions, (t2 - t1) * 1.0 / lookups,
+		(t3 - t2) * 1.0 / lookups, (t4 - t3) * 1.0 / sessions,
+		(t6 - t5) * 1.0 / sessions);
+	if(found != lookups || missed != lookups || deleted != sessions || expired != sessions) {
+		fprintf(stderr, "consistency check failed (%u %u %u %u)\n", found, missed, deleted, expired);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t max = 1000000;
+	if(argc > 1)
+		max = strtoul(argv[1], NULL, 10);
+
+	srand(1);
+	for(uint32_t n = 1000; n <= max; n *= 10) {
+		if(run(n, 2000000) < 0)
+			return 1;
+	}
+
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) == 0)
+		printf("peak RSS: %ld KB\n", ru.ru_maxrss);
+	return 0;
+}
@@ -4,7 +4,12 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "binary.h"
 #include "util.h"
@@ -38,29 +43,39 @@ int binary_read_header(struct reader *r, FILE *f)
 			log_raw("This file was created on a system of differing endianness, reading it is not (yet) supported.");
 		return -1;
 	}
-	if(h.version != 1) {
+	if(h.version < 1 || h.version > FILE_VERSION) {
 		log_error("Unsupported file version.");
 		return -1;
 	}
 
 	r->file = f;
 	r->version = h.version;
+	r->header_size = h.version == 1 ? REC_HEADER_V1_SIZE : sizeof(struct rec_header);
 	r->record_size = 0;
+	r->map = NULL;
+	r->map_size = 0;
 	return 0;
 }
 
 int binary_read_record(struct reader *r, struct rec_header *h)
 {
-	(void)fread(h, sizeof(*h), 1, r->file);
+	memset(h, 0, sizeof(*h));
+	(void)fread(h, r->header_size, 1, r->file);
 	if(feof(r->file))
 		return -2;
-	skip_align(r->file, sizeof(*h));
+	skip_align(r->file, r->header_size);
 
 	r->record_size = h->size;
-	if(h->size < sizeof(*h))
+	if(h->size < r->header_size)
 		return -1;
-	else if(h->size == sizeof(*h)) // no data follows
+	else if(h->size == r->header_size) // no data follows
 		skip_align(r->file, h->size);
+
+	if(r->version == 1) {
+		// convert to the current format
+		h->timestamp *= 1000000;
+		h->size += sizeof(*h) - REC_HEADER_V1_SIZE;
+	}
 	return 0;
 }
 
@@ -70,14 +85,352 @@ int binary_read_record_data(struct reader *r, void *data)
 	if(r->record_size == 0) {
 		log_raw("%s: reading record data not allowed now!", __func__);
 		return -1;
-	} else if(r->record_size == sizeof(struct rec_header)) {
+	} else if(r->record_size == r->header_size) {
 		log_raw("%s: trying to read record data despite no data attached!", __func__);
 		return -1;
 	}
 #endif
 
-	fread(data, r->record_size - sizeof(struct rec_header), 1, r->file);
+	fread(data, r->record_size - r->header_size, 1, r->file);
 	skip_align(r->file, r->record_size);
 	r->record_size = 0;
 	return 0;
 }
+
+#define FIRST_BLOCK ( (sizeof(struct file_header) + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1) )
+
+int binary_map(struct reader *r)
+{
+	struct stat st;
+	if(fstat(fileno(r->file), &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+	if((uint64_t) st.st_size < FIRST_BLOCK)
+		return -1;
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(r->file), 0);
+	if(p == MAP_FAILED)
+		return -1;
+	r->map = p;
+	r->map_size = st.st_size;
+	return 0;
+}
+
+void binary_unmap(struct reader *r)
+{
+	if(r->map)
+		munmap((void*) r->map, r->map_size);
+	r->map = NULL;
+}
+
+static int check_block(const struct block_header *h)
+{
+	if(h->flags & ~(BLOCK_FLAG_DELTA | BLOCK_FLAG_LZ)) {
+		log_error("Block uses unsupported features.");
+		return -1;
+	}
+	if(h->size > BLOCK_MAX_SIZE || h->size % RECORD_ALIGN != 0 ||
+		((h->flags & BLOCK_FLAG_LZ) && (h->raw_size > BLOCK_MAX_SIZE || h->raw_size % RECORD_ALIGN != 0))) {
+		log_error("Encountered invalid block header.");
+		return -1;
+	}
+	return 0;
+}
+
+static int lz_decompress(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t outlen)
+{
+	const uint8_t *ip = in, *const end = in + len;
+	uint8_t *op = out, *const oend = out + outlen;
+
+#define READ_LENGTH(var) do { \
+		uint8_t b; \
+		do { \
+			if(ip >= end) \
+				return -1; \
+			b = *ip++; \
+			var += b; \
+		} while(b == 255); \
+	} while(0)
+
+	while(ip < end) {
+		const uint8_t token = *ip++;
+		uint32_t nlit = token >> 4;
+		if(nlit == 15)
+			READ_LENGTH(nlit);
+		if(nlit > end - ip || nlit > oend - op)
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if(op == oend) // (anything after is padding)
+			return 0;
+
+		if(end - ip < 2)
+			return -1;
+		uint32_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		uint32_t mlen = token & 15;
+		if(mlen == 15)
+			READ_LENGTH(mlen);
+		mlen += 4;
+		if(offset == 0 || offset > op - out || mlen > oend - op)
+			return -1;
+		const uint8_t *ref = op - offset;
+		if(offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while(mlen--) // (overlapping)
+				*op++ = *ref++;
+		}
+	}
+#undef READ_LENGTH
+
+	return op == oend ? 0 : -1;
+}
+
+static void delta_decode(char *buf, uint32_t len)
+{
+	uint8_t prev_addr[16] = {0};
+	uint64_t prev_ts = 0;
+	for(uint64_t pos = 0; pos + sizeof(struct rec_header) <= len; ) {
+		struct rec_header h;
+		memcpy(&h, &buf[pos], sizeof(h));
+		for(int i = 0; i < 16; i++)
+			prev_addr[i] = h.addr[i] ^= prev_addr[i];
+		prev_ts = h.timestamp += prev_ts;
+		memcpy(&buf[pos], &h, sizeof(h));
+		if(h.size < sizeof(h) || h.size > len - pos)
+			break; // (invalid, reported later)
+		pos += ((uint64_t) h.size + RECORD_ALIGN - 1) & ~(uint64_t) (RECORD_ALIGN - 1);
+	}
+}
+
+// turns the stored payload into plain records
+static int unpack_block(struct block *b, const char *payload)
+{
+	if(!(b->h.flags & (BLOCK_FLAG_DELTA | BLOCK_FLAG_LZ))) {
+		b->data = payload;
+		return 0;
+	}
+
+	const uint32_t len = (b->h.flags & BLOCK_FLAG_LZ) ? b->h.raw_size : b->h.size;
+	char *buf = malloc(len ? len : 1);
+	if(!buf)
+		return -1;
+	if(b->h.flags & BLOCK_FLAG_LZ) {
+		if(lz_decompress((const uint8_t*) payload, b->h.size, (uint8_t*) buf, len) < 0) {
+			log_error("Failed to decompress block.");
+			free(buf);
+			return -1;
+		}
+	} else {
+		memcpy(buf, payload, len);
+	}
+	if(b->h.flags & BLOCK_FLAG_DELTA)
+		delta_decode(buf, len);
+
+	free(b->owned);
+	b->owned = buf;
+	b->data = buf;
+	b->h.size = len;
+	b->h.flags = 0;
+	return 0;
+}
+
+static int index_valid(const struct reader *r, const uint64_t *offsets, uint32_t count)
+{
+	uint64_t prev = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		uint64_t off;
+		memcpy(&off, &offsets[i], sizeof(off));
+		if(off < FIRST_BLOCK || off <= prev || off % RECORD_ALIGN != 0 ||
+			off + sizeof(struct block_header) > r->map_size)
+			return 0;
+		prev = off;
+	}
+	return 1;
+}
+
+int binary_read_index(struct reader *r, uint64_t **offsets, uint32_t *count)
+{
+	struct index_footer footer;
+	uint64_t *list = NULL;
+	uint32_t n = 0, size = 0;
+
+	if(r->map_size >= FIRST_BLOCK + sizeof(struct block_header) + sizeof(footer)) {
+		memcpy(&footer, &r->map[r->map_size - sizeof(footer)], sizeof(footer));
+		const uint64_t want = footer.offset + sizeof(struct block_header) +
+			(uint64_t) footer.count * sizeof(uint64_t) + sizeof(footer);
+		if(footer.magic == INDEX_MAGIC && footer.offset >= FIRST_BLOCK &&
+			footer.offset < r->map_size && want == r->map_size &&
+			index_valid(r, (const uint64_t*) &r->map[footer.offset + sizeof(struct block_header)], footer.count)) {
+			const uint64_t *stored = (const uint64_t*) &r->map[footer.offset + sizeof(struct block_header)];
+			list = malloc((footer.count ? footer.count : 1) * sizeof(uint64_t));
+			if(!list)
+				return -1;
+			memcpy(list, stored, footer.count * sizeof(uint64_t));
+			*offsets = list;
+			*count = footer.count;
+			return 0;
+		}
+	}
+
+	// no usable index, find the blocks ourselves
+	log_warning("File has no index, the scan was probably interrupted.");
+	uint64_t off = FIRST_BLOCK;
+	int truncated = 0;
+	while(off < r->map_size) {
+		struct block_header h;
+		if(off + sizeof(h) > r->map_size) {
+			truncated = 1;
+			break;
+		}
+		memcpy(&h, &r->map[off], sizeof(h));
+		if(h.count == 0)
+			break;
+		if(check_block(&h) < 0) {
+			free(list);
+			return -1;
+		}
+		if(off + sizeof(h) + h.size > r->map_size) {
+			truncated = 1;
+			break;
+		}
+		if(n == size) {
+			size = size ? size * 2 : 64;
+			uint64_t *tmp = realloc(list, size * sizeof(uint64_t));
+			if(!tmp) {
+				free(list);
+				return -1;
+			}
+			list = tmp;
+		}
+		list[n++] = off;
+		off += sizeof(h) + h.size;
+	}
+	if(truncated)
+		log_warning("File is truncated, the last block was ignored.");
+	*offsets = list;
+	*count = n;
+	return 0;
+}
+
+int binary_next_range(struct reader *r, uint64_t *cursor, struct block *b)
+{
+	if(*cursor == 0)
+		*cursor = FIRST_BLOCK;
+	uint64_t pos = *cursor;
+	bool truncated = false, invalid = false;
+
+	// (sizes are at the same place in all versions)
+	while(pos < r->map_size && pos - *cursor < BLOCK_TARGET_SIZE) {
+		uint32_t size;
+		if(pos + r->header_size > r->map_size) {
+			truncated = true;
+			break;
+		}
+		memcpy(&size, &r->map[pos + offsetof(struct rec_header, size)], sizeof(size));
+		if(size < r->header_size) {
+			invalid = true;
+			break;
+		}
+		if(pos + size > r->map_size) {
+			truncated = true;
+			break;
+		}
+		pos += ((uint64_t) size + RECORD_ALIGN - 1) & ~(uint64_t) (RECORD_ALIGN - 1);
+	}
+	if(pos > r->map_size)
+		pos = r->map_size;
+
+	if(pos == *cursor) {
+		if(invalid) {
+			log_error("Encountered invalid record header.");
+			return -1;
+		}
+		if(truncated) {
+			log_warning("File is truncated, the last record was ignored.");
+			*cursor = r->map_size;
+		}
+		return -2;
+	}
+
+	memset(b, 0, sizeof(*b));
+	b->h.size = pos - *cursor;
+	b->version = r->version;
+	b->data = (const char*) &r->map[*cursor];
+	*cursor = pos;
+	return 0;
+}
+
+int binary_block_info(struct reader *r, uint64_t offset, struct block_header *h)
+{
+	memcpy(h, &r->map[offset], sizeof(*h));
+	return check_block(h);
+}
+
+int binary_map_block(struct reader *r, uint64_t offset, struct block *b)
+{
+	memcpy(&b->h, &r->map[offset], sizeof(b->h));
+	b->version = r->version;
+	if(check_block(&b->h) < 0)
+		return -1;
+	if(offset + sizeof(b->h) + b->h.size > r->map_size) {
+		log_error("Block exceeds end of file.");
+		return -1;
+	}
+	b->pos = 0;
+	b->owned = NULL;
+	return unpack_block(b, (const char*) &r->map[offset + sizeof(b->h)]);
+}
+
+int binary_read_block(struct reader *r, struct block *b)
+{
+	memset(b, 0, sizeof(*b));
+	b->version = r->version;
+	if(fread(&b->h, sizeof(b->h), 1, r->file) != 1 || b->h.count == 0)
+		return -2; // (the index that follows is not needed)
+	if(check_block(&b->h) < 0)
+		return -1;
+	b->owned = malloc(b->h.size ? b->h.size : 1);
+	if(!b->owned)
+		return -1;
+	if(fread(b->owned, b->h.size, 1, r->file) != 1 && b->h.size > 0) {
+		log_warning("File is truncated, the last block was ignored.");
+		binary_free_block(b);
+		return -2;
+	}
+	if(unpack_block(b, b->owned) < 0) {
+		binary_free_block(b);
+		return -1;
+	}
+	return 0;
+}
+
+void binary_free_block(struct block *b)
+{
+	free(b->owned);
+	b->owned = NULL;
+	b->data = NULL;
+}
+
+int binary_block_record(struct block *b, struct rec_header *h, const char **data)
+{
+	const uint32_t header_size = b->version == 1 ? REC_HEADER_V1_SIZE : sizeof(*h);
+	if(b->pos >= b->h.size)
+		return -2;
+	if(b->pos + header_size > b->h.size)
+		return -1;
+	memset(h, 0, sizeof(*h));
+	memcpy(h, &b->data[b->pos], header_size);
+	if(h->size < header_size || h->size > b->h.size - b->pos)
+		return -1;
+	*data = &b->data[b->pos + header_size];
+	b->pos += (h->size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+
+	if(b->version == 1) {
+		// convert to the current format
+		h->timestamp *= 1000000;
+		h->size += sizeof(*h) - REC_HEADER_V1_SIZE;
+	}
+	return 0;
+}
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "binary.h"
@@ -21,7 +22,7 @@ void binary_write_header(struct obuf *o)
 {
 	struct file_header h;
 	h.magic = FILE_MAGIC;
-	h.version = 1;
+	h.version = FILE_VERSION;
 
 	obuf_write(o, &h, sizeof(h));
 	write_align(o, sizeof(h));
@@ -47,3 +48,235 @@ void binary_write_record_with_data(struct obuf *o, const struct rec_header *h, c
 	obuf_write(o, data, h->size - sizeof(*h));
 	write_align(o, h->size);
 }
+
+/*
+ * Version 3 groups records into blocks. Every block starts with a header
+ * summarizing its contents (count, address/time/port range, record kinds)
+ * so that readers can process blocks independently. An index of all block
+ * offsets is appended at the end of the file.
+ */
+
+static void block_reset(struct block_header *h)
+{
+	memset(h, 0, sizeof(*h));
+	memset(h->min_addr, 0xff, 16);
+	h->min_timestamp = UINT64_MAX;
+	h->min_port = UINT16_MAX;
+}
+
+int binary_block_writer_init(struct block_writer *w, int compress)
+{
+	memset(w, 0, sizeof(*w));
+	// (the last record may cross the target size)
+	w->buffer = malloc(BLOCK_BUFFER_SIZE);
+	if(!w->buffer)
+		return -1;
+	if(compress) {
+		w->cbuffer = malloc(LZ_BOUND(BLOCK_BUFFER_SIZE) + RECORD_ALIGN);
+		if(!w->cbuffer) {
+			free(w->buffer);
+			return -1;
+		}
+	}
+	block_reset(&w->h);
+	w->written = sizeof(struct file_header);
+	w->written += (RECORD_ALIGN - w->written % RECORD_ALIGN) % RECORD_ALIGN;
+	return 0;
+}
+
+void binary_block_writer_fini(struct block_writer *w)
+{
+	free(w->buffer);
+	free(w->cbuffer);
+	free(w->index);
+	w->buffer = NULL;
+	w->cbuffer = NULL;
+	w->index = NULL;
+}
+
+int binary_block_add(struct block_writer *w, const struct rec_header *h, const void *data)
+{
+	struct obuf o = { .buffer = w->buffer, .offset = w->used, .size = BLOCK_BUFFER_SIZE };
+	if(h->size > sizeof(*h))
+		binary_write_record_with_data(&o, h, data);
+	else
+		binary_write_record(&o, h);
+	w->used = o.offset;
+
+	struct block_header *b = &w->h;
+	b->count++;
+	if(memcmp(h->addr, b->min_addr, 16) < 0)
+		memcpy(b->min_addr, h->addr, 16);
+	if(memcmp(h->addr, b->max_addr, 16) > 0)
+		memcpy(b->max_addr, h->addr, 16);
+	if(h->timestamp < b->min_timestamp)
+		b->min_timestamp = h->timestamp;
+	if(h->timestamp > b->max_timestamp)
+		b->max_timestamp = h->timestamp;
+	if(h->port < b->min_port)
+		b->min_port = h->port;
+	if(h->port > b->max_port)
+		b->max_port = h->port;
+	const int proto = h->proto_status >> 4;
+	if(h->size > sizeof(*h))
+		b->kinds |= BLOCK_KIND_BANNER(proto);
+	else
+		b->kinds |= BLOCK_KIND_STATUS(proto, h->proto_status & 0xf);
+
+	return w->used >= BLOCK_TARGET_SIZE ? 1 : 0;
+}
+
+/*
+ * Compression: within a block addresses and timestamps of consecutive
+ * records are mostly the same, so they are replaced by the difference to
+ * the previous record (which is mostly zeroes). A simple LZ77 compressor
+ * (LZ4-like sequences of literals and matches) then takes care of that
+ * and of repetitive banner content.
+ */
+
+static void delta_encode(char *buf, uint32_t len)
+{
+	uint8_t prev_addr[16] = {0};
+	uint64_t prev_ts = 0;
+	for(uint32_t pos = 0; pos + sizeof(struct rec_header) <= len; ) {
+		struct rec_header h;
+		memcpy(&h, &buf[pos], sizeof(h));
+		for(int i = 0; i < 16; i++) {
+			uint8_t tmp = h.addr[i];
+			h.addr[i] ^= prev_addr[i];
+			prev_addr[i] = tmp;
+		}
+		uint64_t tmp = h.timestamp;
+		h.timestamp -= prev_ts;
+		prev_ts = tmp;
+		memcpy(&buf[pos], &h, sizeof(h));
+		pos += (h.size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+	}
+}
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+	return (v * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_length(uint8_t *op, uint32_t len)
+{
+	for(; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static inline uint8_t *lz_sequence(uint8_t *op, const uint8_t *lit, uint32_t nlit, uint32_t offset, uint32_t mlen)
+{
+	uint8_t *token = op++;
+	*token = (nlit >= 15 ? 15 : nlit) << 4;
+	if(nlit >= 15)
+		op = lz_length(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if(offset == 0) // last sequence has no match
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if(mlen >= 15)
+		op = lz_length(op, mlen - 15);
+	return op;
+}
+
+// returns compressed size, at most LZ_BOUND(len)
+static uint32_t lz_compress(const uint8_t *in, uint32_t len, uint8_t *out)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *ip = in, *anchor = in, *const end = in + len;
+	const uint8_t *const limit = len > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : in;
+	uint8_t *op = out;
+
+	memset(table, 0, sizeof(table));
+	while(ip < limit) {
+		uint32_t v, cand;
+		memcpy(&v, ip, 4);
+		const uint32_t hash = lz_hash(v);
+		const uint8_t *ref = in + table[hash];
+		table[hash] = ip - in;
+		memcpy(&cand, ref, 4);
+		if(ref >= ip || ip - ref > LZ_MAX_OFFSET || cand != v) {
+			// skip faster through data that doesn't compress
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		const uint8_t *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+		while(m < end && *m == *r)
+			m++, r++;
+		op = lz_sequence(op, anchor, ip - anchor, ip - ref, m - ip);
+		ip = anchor = m;
+	}
+	op = lz_sequence(op, anchor, end - anchor, 0, 0);
+	return op - out;
+}
+
+void binary_block_flush(struct block_writer *w, FILE *f)
+{
+	if(w->h.count == 0)
+		return;
+	if(w->nblocks == w->index_size) {
+		uint32_t n = w->index_size ? w->index_size * 2 : 64;
+		uint64_t *tmp = realloc(w->index, n * sizeof(uint64_t));
+		if(tmp) {
+			w->index = tmp;
+			w->index_size = n;
+		}
+	}
+	// (if this fails the index is omitted, readers can do without)
+	if(w->nblocks < w->index_size)
+		w->index[w->nblocks++] = w->written;
+	else
+		w->index_failed = 1;
+
+	const char *payload = w->buffer;
+	w->h.size = w->used;
+	if(w->cbuffer) {
+		delta_encode(w->buffer, w->used);
+		w->h.flags |= BLOCK_FLAG_DELTA;
+		uint32_t len = lz_compress((uint8_t*) w->buffer, w->used, (uint8_t*) w->cbuffer);
+		memset(&w->cbuffer[len], 0, RECORD_ALIGN);
+		len = (len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+		if(len < w->used) {
+			payload = w->cbuffer;
+			w->h.size = len;
+			w->h.flags |= BLOCK_FLAG_LZ;
+			w->h.raw_size = w->used;
+		}
+	}
+	fwrite(&w->h, sizeof(w->h), 1, f);
+	fwrite(payload, w->h.size, 1, f);
+	w->written += sizeof(w->h) + w->h.size;
+	w->used = 0;
+	block_reset(&w->h);
+}
+
+void binary_write_index(struct block_writer *w, FILE *f)
+{
+	binary_block_flush(w, f);
+	if(w->index_failed)
+		return;
+
+	// (stored like an empty block, so readers going through the blocks stop here)
+	struct block_header h;
+	memset(&h, 0, sizeof(h));
+	h.size = w->nblocks * sizeof(uint64_t);
+	struct index_footer footer;
+	footer.offset = w->written;
+	footer.count = w->nblocks;
+	footer.magic = INDEX_MAGIC;
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(w->index, sizeof(uint64_t), w->nblocks, f);
+	fwrite(&footer, sizeof(footer), 1, f);
+}
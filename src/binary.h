@@ -9,38 +9,120 @@
 
 struct rec_header;
 struct reader;
+struct block;
+struct block_header;
+struct block_writer;
 struct obuf;
 
 void binary_write_header(struct obuf *o);
 void binary_write_record(struct obuf *o, const struct rec_header *h);
 void binary_write_record_with_data(struct obuf *o, const struct rec_header *h, const void *data);
 
+// version 3+: records are collected into blocks
+int binary_block_writer_init(struct block_writer *w, int compress);
+void binary_block_writer_fini(struct block_writer *w);
+int binary_block_add(struct block_writer *w, const struct rec_header *h, const void *data); // returns 1 if block is full
+void binary_block_flush(struct block_writer *w, FILE *f);
+void binary_write_index(struct block_writer *w, FILE *f);
+
 int binary_read_header(struct reader *r, FILE *f);
+// version 1 and 2:
 int binary_read_record(struct reader *r, struct rec_header *h); // -1 = error, -2 = EOF
 int binary_read_record_data(struct reader *r, void *data);
+int binary_map(struct reader *r); // -1 if the file can't be mapped
+void binary_unmap(struct reader *r);
+// version 1 and 2 (mapped): returns the next range of records as a block
+int binary_next_range(struct reader *r, uint64_t *cursor /*start at 0*/, struct block *b); // -1 = error, -2 = EOF
+// version 3+:
+int binary_read_index(struct reader *r, uint64_t **offsets, uint32_t *count); // (mapped) block offsets
+int binary_block_info(struct reader *r, uint64_t offset, struct block_header *h); // (mapped) header only
+int binary_map_block(struct reader *r, uint64_t offset, struct block *b); // (mapped)
+int binary_read_block(struct reader *r, struct block *b); // (not mapped) -1 = error, -2 = EOF
+void binary_free_block(struct block *b);
+int binary_block_record(struct block *b, struct rec_header *h, const char **data); // -1 = error, -2 = end of block
 
 /** INTERNAL **/
 
 struct reader {
 	FILE *file;
 	uint16_t version;
+	uint32_t header_size; // size of record header in this version
 	uint32_t record_size; // from the last read record header
+	// version 3+:
+	const uint8_t *map; // whole file if mapped
+	uint64_t map_size;
 };
 
 #define FILE_MAGIC 0x4e414373
+#define FILE_VERSION 3
 #define RECORD_ALIGN 8
+#define REC_HEADER_V1_SIZE 32
+#define BLOCK_TARGET_SIZE (1 << 20) // a block is finished once its records reach this size
+#define BLOCK_BUFFER_SIZE (BLOCK_TARGET_SIZE + sizeof(struct rec_header) + UINT16_MAX + RECORD_ALIGN)
+#define BLOCK_MAX_SIZE (64 << 20) // sanity limit for reading
+#define INDEX_MAGIC 0x78646e49
+#define LZ_BOUND(n) ( (n) + (n) / 255 + 16 ) // worst case compressed size
 
 struct file_header {
 	uint32_t magic;
 	uint16_t version;
 } __attribute__(( packed, aligned(RECORD_ALIGN) ));
 
+// Version 1 files are transparently converted to this on read
 struct rec_header {
-	uint64_t timestamp;
+	uint64_t timestamp; // in us (version 1: in seconds)
 	uint32_t size; // incl. header
 	uint16_t port;
 	uint8_t ttl; // ignored for banner records
 	uint8_t proto_status; // (proto << 4) | status; status is ignored for banner records
 	uint8_t addr[16];
+	// version 2+:
+	uint32_t rtt; // in us, 0 = unknown
+	uint8_t prefix_len; // status aliased only: length of the prefix in addr (ttl is 0)
+	uint8_t reserved[3];
 	// banner data follows here
 } __attribute__(( packed, aligned(RECORD_ALIGN) ));
+
+struct block_header {
+	uint32_t size; // of the records following, incl. padding
+	uint32_t count; // number of records
+	uint8_t min_addr[16], max_addr[16];
+	uint64_t min_timestamp, max_timestamp;
+	uint16_t min_port, max_port;
+	uint32_t kinds; // which kinds of records are contained, see below
+	uint32_t flags; // see below
+	uint32_t raw_size; // size of the records after decoding (if BLOCK_FLAG_LZ)
+} __attribute__(( packed, aligned(RECORD_ALIGN) ));
+
+#define BLOCK_FLAG_DELTA 1 // record addresses are XORed and timestamps subtracted with the previous one's
+#define BLOCK_FLAG_LZ 2 // records are compressed
+
+#define BLOCK_KIND_STATUS(proto, status) ( UINT32_C(1) << ((proto) * 8 + (status)) )
+#define BLOCK_KIND_BANNER(proto) ( UINT32_C(1) << (24 + (proto)) )
+
+// the file ends with a block of count 0 containing the offsets (uint64_t)
+// of all blocks, followed by:
+struct index_footer {
+	uint64_t offset; // of the index block
+	uint32_t count;
+	uint32_t magic;
+} __attribute__(( packed, aligned(RECORD_ALIGN) ));
+
+struct block_writer {
+	struct block_header h;
+	char *buffer;
+	char *cbuffer; // for compression (if enabled)
+	uint32_t used;
+	uint64_t written; // to the file so far
+	uint64_t *index;
+	uint32_t nblocks, index_size;
+	int index_failed;
+};
+
+struct block {
+	struct block_header h;
+	uint16_t version; // of the records
+	const char *data;
+	uint32_t pos; // of the next record
+	char *owned; // != NULL if data was allocated
+};
@@ -62,6 +62,7 @@ int main(int argc, char *argv[])
 
 		memcpy(tmp, buf, len);
 
+		(void) banner_complete(ip_type, port, tmp, len);
 		unsigned int outlen = len;
 		banner_postprocess(ip_type, port, tmp, &outlen);
 	}
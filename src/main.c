@@ -28,7 +28,7 @@ static inline char *find_dot(char *str);
 enum operating_mode {
 	M_SCAN, M_PRINT_HOSTS,
 	M_READSCAN, M_PRINT_SUMMARY,
-	M_PRINT_NETWORK,
+	M_PRINT_NETWORK, M_MERGE,
 };
 
 int main(int argc, char *argv[])
@@ -39,6 +39,7 @@ int main(int argc, char *argv[])
 		{"print-summary", no_argument, 0, 1002},
 		{"list-protocols", no_argument, 0, 1003},
 		{"print-network-settings", no_argument, 0, 1004},
+		{"merge", no_argument, 0, 1005},
 
 		{"interface", required_argument, 0, 2002},
 		{"source-mac", required_argument, 0, 2003},
@@ -51,9 +52,33 @@ int main(int argc, char *argv[])
 		{"source-port", required_argument, 0, 2006},
 		{"stream-targets", no_argument, 0, 2008},
 		{"icmp", no_argument, 0, 2009},
+		{"rtt", no_argument, 0, 2010},
+		{"banner-max", required_argument, 0, 2011},
+		{"max-sessions", required_argument, 0, 2012},
+		{"mss", required_argument, 0, 2013},
+		{"retries", required_argument, 0, 2014},
+		{"retry-interval", required_argument, 0, 2015},
+		{"min-rate", required_argument, 0, 2016},
+		{"prefix-rate", required_argument, 0, 2017},
+		{"prefix-length", required_argument, 0, 2018},
+		{"detect-aliases", required_argument, 0, 2019},
+		{"prune-unroutable", required_argument, 0, 2020},
+		{"tcp-ports", required_argument, 0, 2021},
+		{"udp-ports", required_argument, 0, 2022},
+		{"icmp-sweep", no_argument, 0, 2023},
+		{"dedup", required_argument, 0, 2024},
+		{"threads", required_argument, 0, 2025},
+		{"unordered", no_argument, 0, 2026},
+		{"filter", required_argument, 0, 2027},
+		{"stats", no_argument, 0, 2028},
+		{"stats-prefix", required_argument, 0, 2029},
+		{"stats-exact", no_argument, 0, 2030},
+		{"merge-memory", required_argument, 0, 2031},
+		{"diff", required_argument, 0, 2032},
 
 		{"output-format", required_argument, 0, 3000},
 		{"show-closed", no_argument, 0, 3001},
+		{"compress", no_argument, 0, 3002},
 
 		{"help", no_argument, 0, 'h'},
 		{"ports", required_argument, 0, 'p'},
@@ -68,26 +93,39 @@ int main(int argc, char *argv[])
 		ttl = 64, max_rate = -1,
 		source_port = -1, quiet = 0,
 		show_closed = 0, banners = 0,
-		stream_targets = 0;
+		stream_targets = 0, measure_rtt = 0,
+		banner_max = BANNER_MAX_LENGTH, max_sessions = 0,
+		tcp_mss = 0, retries = 0, retry_interval = 1000,
+		min_rate = 0, prefix_rate = 0, prefix_len = 48,
+		alias_len = 0, prune_len = 0,
+		udp = 0, icmp = 0, sweep = 0,
+		compress = 0, reader_threads = 0, unordered = 0,
+		filtered = 0, stats = 0, stats_prefix = 48, stats_exact = 0,
+		merge_memory = 1024;
+	double dedup_fp = 0;
 	enum operating_mode mode;
-	uint8_t ip_type, source_mac[6], router_mac[6], source_addr[16];
+	uint8_t source_mac[6], router_mac[6], source_addr[16];
 	char *interface;
-	struct ports ports;
-	FILE *outfile, *readscan;
+	struct ports ports, tcp_ports, udp_ports;
+	FILE *outfile, *readscan, *diff;
 	const struct outputdef *outdef;
+	const char *suggest_format;
 
 	mode = M_SCAN;
-	ip_type = IP_TYPE_TCP;
 	interface = NULL; // automatically picked
 	outfile = stdout;
 	outdef = NULL;
+	suggest_format = NULL;
 
 	srand(time(NULL) - (getpid() * argc) + monotonic_ms());
 	memset(source_mac, 0xff, 6);
 	memset(router_mac, 0xff, 6);
 	memset(source_addr, 0xff, 16);
 	init_ports(&ports);
+	init_ports(&tcp_ports);
+	init_ports(&udp_ports);
 	readscan = NULL;
+	diff = NULL;
 
 	while(1) {
 		int c = getopt_long(argc, argv, "hp:o:qbu", long_options, NULL);
@@ -118,6 +156,9 @@ int main(int argc, char *argv[])
 			case 1004:
 				mode = M_PRINT_NETWORK;
 				break;
+			case 1005:
+				mode = M_MERGE;
+				break;
 
 			case 2002:
 				interface = strdup(optarg);
@@ -179,8 +220,184 @@ int main(int argc, char *argv[])
 				stream_targets = 1;
 				break;
 			case 2009:
-				ip_type = IP_TYPE_ICMPV6;
+				icmp = 1;
+				break;
+			case 2010:
+				measure_rtt = 1;
+				break;
+			case 2011: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 1 || val > BANNER_MAX_LENGTH) {
+					log_raw("Argument to --banner-max must be a number in range 1-%d", BANNER_MAX_LENGTH);
+					return 1;
+				}
+				banner_max = val;
+				break;
+			}
+			case 2012: {
+				int val = strtol_suffix(optarg);
+				if(val <= 0) {
+					log_raw("Argument to --max-sessions must be a positive number");
+					return 1;
+				}
+				max_sessions = val;
+				break;
+			}
+			case 2013: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 64 || val > 65535) {
+					log_raw("Argument to --mss must be a number in range 64-65535");
+					return 1;
+				}
+				tcp_mss = val;
+				break;
+			}
+			case 2014: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 0 || val > 10) {
+					log_raw("Argument to --retries must be a number in range 0-10");
+					return 1;
+				}
+				retries = val;
+				break;
+			}
+			case 2015: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 10 || val > 60000) {
+					log_raw("Argument to --retry-interval must be a number in range 10-60000");
+					return 1;
+				}
+				retry_interval = val;
+				break;
+			}
+			case 2016: {
+				int val = strtol_suffix(optarg);
+				if(val <= 0) {
+					log_raw("Argument to --min-rate must be a positive number");
+					return 1;
+				}
+				min_rate = val;
+				break;
+			}
+			case 2017: {
+				int val = strtol_suffix(optarg);
+				if(val <= 0) {
+					log_raw("Argument to --prefix-rate must be a positive number");
+					return 1;
+				}
+				prefix_rate = val;
+				break;
+			}
+			case 2018: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 1 || val > 128) {
+					log_raw("Argument to --prefix-length must be a number in range 1-128");
+					return 1;
+				}
+				prefix_len = val;
+				break;
+			}
+			case 2019: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 16 || val > 124 || val % 4 != 0) {
+					log_raw("Argument to --detect-aliases must be a multiple of 4 in range 16-124");
+					return 1;
+				}
+				alias_len = val;
+				break;
+			}
+			case 2020: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 1 || val > 128) {
+					log_raw("Argument to --prune-unroutable must be a number in range 1-128");
+					return 1;
+				}
+				prune_len = val;
+				break;
+			}
+			case 2021:
+				if(parse_ports(optarg, &tcp_ports) < 0) {
+					log_raw("Argument to --tcp-ports must be valid port range(s)");
+					return 1;
+				}
+				break;
+			case 2022:
+				if(parse_ports(optarg, &udp_ports) < 0) {
+					log_raw("Argument to --udp-ports must be valid port range(s)");
+					return 1;
+				}
+				break;
+			case 2023:
+				sweep = 1;
+				icmp = 1;
+				break;
+			case 2024: {
+				char *end;
+				double val = strtod(optarg, &end);
+				if(*end || !(val > 0 && val < 1)) {
+					log_raw("Argument to --dedup must be a false positive rate between 0 and 1 (e.g. 1e-6)");
+					return 1;
+				}
+				dedup_fp = val;
+				break;
+			}
+			case 2025: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 1 || val > 64) {
+					log_raw("Argument to --threads must be a number in range 1-64");
+					return 1;
+				}
+				reader_threads = val;
+				break;
+			}
+			case 2026:
+				unordered = 1;
+				break;
+			case 2027:
+				if(scan_filter_add(optarg) < 0) {
+					log_raw("Argument to --filter must be a valid filter expression, see --help");
+					return 1;
+				}
+				filtered = 1;
+				break;
+			case 2028:
+				stats = 1;
+				break;
+			case 2029: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 0 || val > 128) {
+					log_raw("Argument to --stats-prefix must be a number in range 0-128");
+					return 1;
+				}
+				stats_prefix = val;
 				break;
+			}
+			case 2030:
+				stats_exact = 1;
+				break;
+			case 2031: {
+				int val = strtol_simple(optarg, 10);
+				if(val < 1 || val > 1048576) {
+					log_raw("Argument to --merge-memory must be a number in range 1-1048576");
+					return 1;
+				}
+				merge_memory = val;
+				break;
+			}
+			case 2032: {
+				// (stdin may be needed for --readscan)
+				if(strcmp(optarg, "-") == 0) {
+					log_raw("Argument to --diff must be a file");
+					return 1;
+				}
+				FILE *f = fopen(optarg, "rb");
+				if(!f) {
+					perror("opening baseline scan file");
+					return 1;
+				}
+				diff = f;
+				break;
+			}
 
 			case 3000:
 				if(strcmp(optarg, "list") == 0) {
@@ -197,6 +414,9 @@ int main(int argc, char *argv[])
 			case 3001:
 				show_closed = 1;
 				break;
+			case 3002:
+				compress = 1;
+				break;
 
 			case 'h':
 				usage();
@@ -214,17 +434,11 @@ int main(int argc, char *argv[])
 					return 1;
 				}
 				char *dot = find_dot(optarg);
-				if(!outdef && dot) {
-					const char *suggest = NULL;
-					if(!strcmp(dot+1, "bin"))
-						suggest = "binary";
-					else if(!strcmp(dot+1, "json"))
-						suggest = "json";
-					if(suggest) {
-						log_warning("It looks like you might want a different "
-							"output format, try --output-format %s.", suggest);
-					}
-				}
+				suggest_format = NULL;
+				if(dot && !strcmp(dot+1, "bin"))
+					suggest_format = "binary";
+				else if(dot && !strcmp(dot+1, "json"))
+					suggest_format = "json";
 				outfile = f;
 				break;
 			}
@@ -235,7 +449,7 @@ int main(int argc, char *argv[])
 				banners = 1;
 				break;
 			case 'u':
-				ip_type = IP_TYPE_UDP;
+				udp = 1;
 				break;
 
 			default:
@@ -243,12 +457,69 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if(!outdef && suggest_format && mode != M_MERGE) {
+		log_warning("It looks like you might want a different "
+			"output format, try --output-format %s.", suggest_format);
+	}
 	if(!outdef)
-		outdef = &output_list;
+		outdef = mode == M_MERGE ? &output_binary : &output_list;
+	if(stats && mode != M_READSCAN) {
+		log_raw("--stats only applies to reading binary scans (--readscan).");
+		return 1;
+	}
+	if(filtered && mode != M_READSCAN && mode != M_MERGE) {
+		log_raw("--filter only applies to reading binary scans (--readscan, --merge).");
+		return 1;
+	}
+	if(diff && mode != M_SCAN && mode != M_READSCAN) {
+		log_raw("--diff only applies to scanning or reading binary scans (--readscan).");
+		return 1;
+	}
+	if(diff && stats) {
+		log_raw("--diff can't be combined with --stats.");
+		return 1;
+	}
+	if(mode == M_MERGE && outdef != &output_binary) {
+		log_raw("--merge only supports the binary output format.");
+		return 1;
+	}
+	if(compress && outdef != &output_binary) {
+		log_raw("--compress only applies to the binary output format.");
+		return 1;
+	}
+	if(outdef == &output_binary && output_binary_init(compress) < 0) {
+		log_error("Failed to allocate memory for binary output");
+		return 1;
+	}
+	if(min_rate && (max_rate == -1 || min_rate > max_rate)) {
+		log_raw("--min-rate requires a --max-rate that is at least as large.");
+		return 1;
+	}
+	// -p applies to UDP with -u and to TCP otherwise
+	if(validate_ports(&ports)) {
+		struct ports *dst = udp ? &udp_ports : &tcp_ports;
+		if(validate_ports(dst)) {
+			log_raw("-p can't be combined with --%s-ports.", udp ? "udp" : "tcp");
+			return 1;
+		}
+		memcpy(dst, &ports, sizeof(struct ports));
+	}
+	const struct ports *scan_tcp_ports = validate_ports(&tcp_ports) ? &tcp_ports : NULL,
+		*scan_udp_ports = validate_ports(&udp_ports) ? &udp_ports : NULL;
+	if(sweep && !scan_tcp_ports && !scan_udp_ports) {
+		log_raw("--icmp-sweep requires ports to scan.");
+		return 1;
+	}
 
 	int max_args = 1;
 	if(mode == M_READSCAN) {
 		max_args = 0;
+	} else if(mode == M_MERGE) {
+		if(argc - optind < 1) {
+			log_raw("No binary scan(s) given to merge.");
+			return 1;
+		}
+		max_args = argc - optind;
 	} else {
 		if(mode == M_PRINT_NETWORK && argc - optind == 0) {
 			// permitted for convenience
@@ -297,7 +568,7 @@ int main(int argc, char *argv[])
 	target_gen_set_randomized(randomize_hosts);
 
 	const char *tspec = argv[optind];
-	if(mode == M_READSCAN || mode == M_PRINT_NETWORK) {
+	if(mode == M_READSCAN || mode == M_PRINT_NETWORK || mode == M_MERGE) {
 		// no targets in this mode
 	} else {
 		if(*tspec == '@') { // load from file
@@ -319,9 +590,37 @@ int main(int argc, char *argv[])
 
 	int r;
 	if(mode == M_READSCAN) {
+		if(diff && scan_diff_init(diff, false) < 0)
+			return 1;
 		scan_reader_set_general(show_closed, banners);
+		scan_reader_set_parallel(reader_threads, unordered);
+		scan_reader_set_stats(stats ? stats_prefix : -1, stats_exact);
 		scan_reader_set_output(outfile, outdef);
 		r = scan_reader_main(readscan) < 0 ? 1 : 0;
+		if(diff)
+			scan_diff_fini();
+	} else if(mode == M_MERGE) {
+		if(scan_merge_init(merge_memory) < 0) {
+			log_error("Failed to allocate memory for merging");
+			return 1;
+		}
+		scan_reader_set_general(1, banners);
+		scan_reader_set_stats(-1, false);
+		scan_reader_set_output(outfile, scan_merge_collector());
+		r = 0;
+		for(int i = optind; i < argc && r == 0; i++) {
+			FILE *f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+			if(!f) {
+				perror("opening scan file");
+				r = 1;
+				break;
+			}
+			if(scan_reader_main(f) < 0)
+				r = 1;
+			fclose(f);
+		}
+		if(r == 0 && scan_merge_finish(outfile, outdef) < 0)
+			r = 1;
 	} else if(mode == M_PRINT_HOSTS) {
 		uint8_t addr[16];
 		char buf[IPV6_STRING_MAX];
@@ -332,16 +631,21 @@ int main(int argc, char *argv[])
 
 		r = 0;
 	} else if(mode == M_PRINT_SUMMARY) {
-		int nports = 0;
-		if(validate_ports(&ports)) {
-			struct ports_iter it;
-			for(ports_iter_begin(&ports, &it); ports_iter_next(&it); )
+		int nports = icmp ? 1 : 0;
+		struct ports_iter it;
+		if(scan_tcp_ports) {
+			for(ports_iter_begin(scan_tcp_ports, &it); ports_iter_next(&it); )
 				nports++;
-		} else {
-			nports = 1;
 		}
-		target_gen_print_summary(max_rate, nports);
-		scan_print_summary(&ports, max_rate, banners, ip_type);
+		if(scan_udp_ports) {
+			for(ports_iter_begin(scan_udp_ports, &it); ports_iter_next(&it); )
+				nports++;
+		}
+		target_gen_print_summary(max_rate, nports == 0 ? 1 : nports);
+		if(nports == 0) // no ports given, show what a scan would look like anyway
+			scan_print_summary(udp ? NULL : &tcp_ports, udp ? &udp_ports : NULL, false, max_rate, banners, measure_rtt, tcp_mss);
+		else
+			scan_print_summary(scan_tcp_ports, scan_udp_ports, icmp, max_rate, banners, measure_rtt, tcp_mss);
 
 		r = 0;
 	} else if(mode == M_PRINT_NETWORK) {
@@ -394,7 +698,7 @@ int main(int argc, char *argv[])
 				missing = "--router-mac";
 			else if(is_all_ff(source_addr, 16))
 				missing = "--source-ip";
-			else if(ip_type != IP_TYPE_ICMPV6 && !validate_ports(&ports))
+			else if(!scan_tcp_ports && !scan_udp_ports && !icmp)
 				missing = "-p";
 
 			if(missing) {
@@ -404,7 +708,7 @@ int main(int argc, char *argv[])
 		}
 
 		// Handle --source-port: auto-detection, reservation, errors
-		const bool port_mandatory = banners && ip_type == IP_TYPE_TCP;
+		const bool port_mandatory = banners && scan_tcp_ports;
 		if (r == 0 && rawsock_islocal(source_addr) == 0) {
 			// We're using an unassigned IP, pick any random port. No need to
 			// reserve it or care about the OS.
@@ -413,11 +717,12 @@ int main(int argc, char *argv[])
 				log_raw("Using random source port: %d", source_port);
 			}
 		} else if (r == 0) {
-			const bool port_useful = banners && ip_type == IP_TYPE_UDP;
+			const bool port_useful = banners && scan_udp_ports;
 			bool auto_failed = false;
 
 			if (port_mandatory || port_useful) {
-				int tmp = rawsock_reserve_port(source_addr, ip_type, source_port == -1 ? 0 : source_port);
+				int tmp = rawsock_reserve_port(source_addr, port_mandatory ? IP_TYPE_TCP : IP_TYPE_UDP,
+					source_port == -1 ? 0 : source_port);
 				if (tmp >= 0) {
 					source_port = tmp;
 					if (port_mandatory)
@@ -437,15 +742,31 @@ int main(int argc, char *argv[])
 			} else if (auto_failed) {
 				// assume the user knows what he's doing
 				log_debug("automatic port reservation failed");
+			} else if (port_mandatory && port_useful) {
+				// UDP uses the same source port in a combined scan
+				if (rawsock_reserve_port(source_addr, IP_TYPE_UDP, source_port) < 0)
+					log_debug("reserving UDP source port failed");
 			}
 		}
 
 		if (r == 0) {
 			rawsock_eth_settings(source_mac, router_mac);
 			rawsock_ip_settings(source_addr, ttl);
-			scan_set_general(&ports, max_rate, show_closed, banners);
-			scan_set_network(source_addr, source_port, ip_type);
+			scan_set_general(max_rate, show_closed, banners);
+			scan_set_network(source_addr, source_port);
+			scan_set_protocols(scan_tcp_ports, scan_udp_ports, icmp);
 			scan_set_output(outfile, outdef);
+			scan_set_rtt(measure_rtt);
+			scan_set_banner_limits(banner_max, max_sessions);
+			scan_set_tcp_mss(tcp_mss);
+			scan_set_retries(retries, retry_interval);
+			scan_set_min_rate(min_rate);
+			scan_set_prefix_limit(prefix_rate, prefix_len);
+			scan_set_alias_detection(alias_len);
+			scan_set_pruning(prune_len);
+			scan_set_sweep(sweep);
+			scan_set_dedup(dedup_fp);
+			scan_set_diff(diff);
 			r = scan_main(interface, quiet) < 0 ? 1 : 0;
 		}
 	}
@@ -456,6 +777,8 @@ int main(int argc, char *argv[])
 	fclose(outfile);
 	if(mode == M_READSCAN)
 		fclose(readscan);
+	if(diff)
+		fclose(diff);
 	return r;
 }
 
@@ -505,6 +828,14 @@ static void usage(void)
 		{"--help", "Show this text"},
 		{"--list-protocols", "List TCP/UDP protocols supported by fi6s for banner grabbing"},
 		{"--readscan <file>", "Read specified binary scan from <file> instead of performing a scan"},
+		{"--threads <n>", "Convert binary scans using <n> threads (default: one per CPU)"},
+		{"--unordered", "Output results of binary scans as they are converted, not in original order"},
+		{"--filter <key>=<value>", "Only output records of binary scans that match, can be given multiple times"},
+		{"--stats", "Output statistics about a binary scan instead of its records"},
+		{"--stats-prefix <n>", "Count results per /<n> prefix for --stats (default: 48)"},
+		{"--stats-exact", "Count unique hosts exactly for --stats instead of estimating (needs more memory)"},
+		{"--merge", "Merge the binary scans given as arguments into one sorted binary scan"},
+		{"--merge-memory <n>", "Sort up to <n> MiB in memory at once for --merge (default: 1024)"},
 		{"--print-network-settings", "Print (auto-detected) network settings and exit"},
 		{"--print-hosts", "Print all hosts to be scanned and exit (don't scan)"},
 		{"--print-summary", "Print summary of hosts to be scanned and exit"},
@@ -518,16 +849,33 @@ static void usage(void)
 		{"--stream-targets", "Read target IPs from file on demand instead of ahead-of-time"},
 		{"--randomize-hosts <0|1>", "Randomize scan order of hosts (default: 1)"},
 		{"--max-rate <n>", "Send no more than <n> packets per second (default: unlimited)"},
+		{"--min-rate <n>", "Adapt the rate between <n> and --max-rate depending on packet loss"},
+		{"--prefix-rate <n>", "Send no more than <n> packets per second to each destination prefix"},
+		{"--prefix-length <n>", "Prefix length used by --prefix-rate (default: 48)"},
+		{"--detect-aliases <n>", "Detect aliased /<n> prefixes and stop scanning them (e.g. 64)"},
+		{"--prune-unroutable <n>", "Stop scanning a /<n> prefix once a router reports no route to it"},
 		{"--source-port <port>", "Use specified source port"},
 		{"-p/--ports <ranges>", "Specify port range(s) to scan"},
+		{"--tcp-ports <ranges>", "Scan TCP port range(s), can be combined with other protocols"},
+		{"--udp-ports <ranges>", "Scan UDP port range(s), can be combined with other protocols"},
 		{"-b/--banners", "Capture banners on open TCP ports / UDP responses"},
-		{"-u/--udp", "UDP scan"},
-		{"--icmp", "ICMPv6 Echo scan"},
+		{"--banner-max <n>", "Capture at most <n> bytes per banner (default: 4096)"},
+		{"--max-sessions <n>", "Keep at most <n> TCP connections open for banners (default: unlimited)"},
+		{"-u/--udp", "UDP scan (-p refers to UDP ports)"},
+		{"--icmp", "ICMPv6 Echo scan, in addition to any ports given"},
+		{"--icmp-sweep", "Only scan ports of hosts that answer ICMPv6 Echo, as soon as they do"},
+		{"--rtt", "Measure round trip time of responses (TCP and ICMP only)"},
+		{"--mss <n>", "Announce a maximum segment size of <n> in TCP SYNs"},
+		{"--retries <n>", "Retransmit probes that got no answer up to <n> times (default: 0)"},
+		{"--retry-interval <ms>", "Wait <ms> milliseconds for an answer before retransmitting (default: 1000)"},
 		{"-q/--quiet", "Do not output status message during scan"},
 		{"Output options:", NULL},
 		{"-o <file>", "Write results to <file>"},
 		{"--output-format <fmt>", "Set output format to one of list,json,binary (default: list)"},
-		{"--show-closed", "Show closed ports (TCP)"},
+		{"--show-closed", "Show closed ports and unreachable/filtered targets"},
+		{"--compress", "Compress binary output"},
+		{"--dedup <rate>", "Drop duplicate results, losing at most <rate> of unique ones (e.g. 1e-6)"},
+		{"--diff <file>", "Only output results that changed compared to the binary scan in <file>"},
 		{NULL},
 	};
 	for(int i = 0; lines[i].l != NULL; i++) {
@@ -560,6 +908,32 @@ static void usage(void)
 		"  For example, you could perform a scan that captures banners but only extract open/closed ports:",
 		"    $ fi6s -o scan.bin --output-format binary -b 2001:db8::xx",
 		"    $ fi6s --readscan scan.bin --show-closed",
+		"  With --compress the file is compressed as it is written, which makes it several times smaller.",
+		"  Records can be selected with one or more --filter options, all of which must match:",
+		"    net=<target spec>, port=<ranges>, proto=tcp,udp,icmp, status=open,closed,...,",
+		"    time=<from>-<to> (unix time, either can be omitted), banner=<substring>",
+		"  A status filter doesn't apply to banners, but with a banner filter only banners are output.",
+		"  For example, to extract SSH banners from one network:",
+		"    $ fi6s --readscan scan.bin -b --filter net=2001:db8::/32 --filter port=22 --filter banner=SSH-",
+		"  --stats summarizes a binary scan (filters apply) in lines of the following form:",
+		"    'records <n>', 'hosts <n>' (hosts with any positive result, '~' if estimated),",
+		"    'status <proto> <status> <n>', 'banners <proto> <n>', 'service <type> <n>',",
+		"    'port <proto> <port> <n>' (open ports), 'prefix <prefix>/<len> <n>' (positive results)",
+		"  --merge combines several binary scans into one, sorted by address, protocol and port.",
+		"  Of records for the same port only the newest status and newest banner are kept.",
+		"  Banners are dropped unless -b is given, filters apply to the inputs:",
+		"    $ fi6s --merge -b -o all.bin part1.bin part2.bin part3.bin",
+		"",
+		"Comparing scans:",
+		"  With --diff <file> only changes compared to an earlier binary scan are output, either",
+		"  while scanning or when reading a binary scan. That is positive results that are new or",
+		"  whose status changed, banners that are new or different, and positive results of the",
+		"  earlier scan that weren't seen again, which are output as closed at the end.",
+		"  The earlier scan should have been made with the same options (e.g. -b).",
+		"  While scanning, removals are only output for ports (and ICMP) that are being scanned",
+		"  and not at all if the scan didn't complete. They are not limited to the targets though,",
+		"  so a baseline covering more targets than the new scan reports everything else as closed.",
+		"  Targets skipped by --detect-aliases, --prune-unroutable or --icmp-sweep are left out.",
 		"",
 		"Scan status message:",
 		"  Unless this is disabled, fi6s will output a periodic status message during scanning,",
@@ -568,7 +942,40 @@ static void usage(void)
 		"    'snt': number of packets sent.",
 		"    'rcv': number of packets received. these are not necessarily all related to the current scan.",
 		"    'tcp': number of packets sent for TCP conversations (banners). this is separate from 'snt' and not affected by --max-rate.",
+		"    'shed': number of TCP connections that were reset because --max-sessions was reached.",
+		"    'rtt': median round trip time so far, only with --rtt.",
+		"    'rate': current packet rate limit, only with --min-rate.",
+		"    'dfr': number of probes deferred because of --prefix-rate.",
+		"    'live': number of hosts that answered --icmp-sweep.",
 		"    'p': scan progress in percent.",
+		"",
+		"Round trip times:",
+		"  With --rtt fi6s adds a TCP timestamp option to SYN probes or a timestamp payload to",
+		"  ICMP echo requests and uses the echoed value to compute the RTT of each response.",
+		"  TCP hosts that don't support timestamps will not have an RTT.",
+		"  The RTT is included in json (as 'rtt_us') and binary output and a histogram is",
+		"  printed at the end of the scan.",
+		"",
+		"Aliased prefixes:",
+		"  Some networks answer on every address. With --detect-aliases <n> fi6s keeps track of",
+		"  responding hosts per /<n> prefix and once there are a few it probes 16 random addresses",
+		"  in it. If all of them answer, a single 'aliased' record for the prefix is output and the",
+		"  rest of it is skipped. Further responses from the prefix are not reported.",
+		"  The probes are retransmitted according to --retries and the check is repeated a few",
+		"  times if not all of them are answered.",
+		"",
+		"Combined scans:",
+		"  TCP, UDP and ICMP probes can be sent in a single pass over the targets, e.g.:",
+		"    $ fi6s --icmp --tcp-ports 22,80,443 --udp-ports 53 2001:db8::/64",
+		"  Every target is sent an echo request first, followed by its TCP and UDP probes.",
+		"  -p is the same as --tcp-ports, or --udp-ports if -u is given.",
+		"  With --icmp-sweep targets are only sent an echo request at first. Hosts that answer",
+		"  are queued and their ports are scanned right away, while the sweep continues.",
+		"",
+		"Adaptive rate:",
+		"  With --min-rate the scan starts at the minimum rate and speeds up towards --max-rate.",
+		"  Whenever the packet capture reports drops or the ratio of received to sent packets",
+		"  collapses the rate is reduced, so it settles near the highest rate without losses.",
 		NULL
 	};
 	for(int i = 0; lines2[i] != NULL; i++) {
@@ -4,45 +4,71 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+#include <pthread.h>
 
 #include "output.h"
 #include "binary.h"
 #include "util.h"
 
 #define OUTPUT_BUFFER 512
-#define OUTPUT_BUFFER_BIG 65535
+
+#define BLOCK_MAX_AGE 5000 // ms
+
+// records are collected into blocks, which are written once full or old enough
+// so that not too much is lost if the process is killed
+static struct block_writer writer;
+static uint64_t block_started;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int output_binary_init(int compress)
+{
+	return binary_block_writer_init(&writer, compress);
+}
 
 static void begin(FILE *f)
 {
 	DECLARE_OBUF_STACK(buf, OUTPUT_BUFFER);
 
+	assert(writer.buffer); // (output_binary_init() wasn't called)
 	binary_write_header(&buf);
 
 	obuf_flush(&buf, f);
 	fflush(f);
 }
 
-static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, int status)
+static void add(FILE *f, const struct rec_header *h, const void *data)
 {
-	DECLARE_OBUF_STACK(buf, OUTPUT_BUFFER);
+	pthread_mutex_lock(&writer_lock);
+	const uint64_t now = monotonic_ms();
+	if(writer.h.count == 0)
+		block_started = now;
+	if(binary_block_add(&writer, h, data) == 1 || now - block_started >= BLOCK_MAX_AGE)
+		binary_block_flush(&writer, f);
+	pthread_mutex_unlock(&writer_lock);
+}
 
+static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status)
+{
 	struct rec_header h;
 	h.timestamp = ts;
 	h.size = sizeof(struct rec_header);
 	h.port = port;
-	h.ttl = ttl;
+	h.ttl = status == OUTPUT_STATUS_ALIASED ? 0 : ttl;
 	h.proto_status = (proto << 4) | status;
 	memcpy(h.addr, addr, 16);
+	h.rtt = rtt;
+	// (the prefix length of aliased results gets its own field)
+	h.prefix_len = status == OUTPUT_STATUS_ALIASED ? ttl : 0;
+	memset(h.reserved, 0, sizeof(h.reserved));
 
-	binary_write_record(&buf, &h);
-	obuf_flush(&buf, f);
+	add(f, &h, NULL);
 }
 
-static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, const char *banner, uint32_t bannerlen)
+static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen)
 {
-	DECLARE_OBUF_STACK(buf, OUTPUT_BUFFER_BIG);
-
 	struct rec_header h;
 	h.timestamp = ts;
 	h.size = sizeof(struct rec_header) + bannerlen;
@@ -50,14 +76,27 @@ static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_
 	h.ttl = 0;
 	h.proto_status = (proto << 4);
 	memcpy(h.addr, addr, 16);
+	h.rtt = rtt;
+	h.prefix_len = 0;
+	memset(h.reserved, 0, sizeof(h.reserved));
 
-	binary_write_record_with_data(&buf, &h, banner);
-	obuf_flush(&buf, f);
+	add(f, &h, banner);
+}
+
+static void idle(FILE *f)
+{
+	pthread_mutex_lock(&writer_lock);
+	if(writer.h.count > 0 && monotonic_ms() - block_started >= BLOCK_MAX_AGE) {
+		binary_block_flush(&writer, f);
+		fflush(f);
+	}
+	pthread_mutex_unlock(&writer_lock);
 }
 
 static void end(FILE *f)
 {
-	(void) f;
+	binary_write_index(&writer, f);
+	binary_block_writer_fini(&writer);
 }
 
 const struct outputdef output_binary = {
@@ -65,5 +104,6 @@ const struct outputdef output_binary = {
 	.output_status = &status,
 	.output_banner = &banner,
 	.end = &end,
+	.idle = &idle,
 	.raw = 1,
 };
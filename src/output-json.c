@@ -17,17 +17,27 @@ static void begin(FILE *f)
 	fprintf(f, "[\n");
 }
 
-static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, int status)
+static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status)
 {
-	// {ip: "<ip>", timestamp: <ts>, ports: [{port: <port>, proto: "<tcp/udp>", status: "<status>", ttl: <ttl>}]},
-	char addrstr[IPV6_STRING_MAX];
+	// {ip: "<ip>", timestamp: <ts>, ports: [{port: <port>, proto: "<tcp/udp>", status: "<status>", ttl: <ttl>, rtt_us: <rtt>}]},
+	// (aliased prefixes: {"ip": "<ip>", "prefix_length": <length>, ..., "status": "aliased"})
+	char addrstr[IPV6_STRING_MAX], rttstr[32] = {0};
 
 	ipv6_string(addrstr, addr);
-	fprintf(f, "{\"ip\": \"%s\", \"timestamp\": %" PRIu64 ", \"ports\": [{\"port\": %u, \"proto\": \"%s\", \"status\": \"%s\", \"ttl\": %u}]},\n",
-		addrstr, ts, port,
-		proto == OUTPUT_PROTO_TCP ? "tcp" : (proto == OUTPUT_PROTO_UDP ? "udp" : "icmp"),
-		status == OUTPUT_STATUS_OPEN ? "open" : (status == OUTPUT_STATUS_CLOSED ? "closed" : "up"),
-		ttl
+	if(rtt > 0)
+		snprintf(rttstr, sizeof(rttstr), ", \"rtt_us\": %" PRIu32, rtt);
+	if(status == OUTPUT_STATUS_ALIASED) {
+		// (ttl holds the prefix length)
+		fprintf(f, "{\"ip\": \"%s\", \"prefix_length\": %u, \"timestamp\": %" PRIu64 ", \"ports\": [{\"port\": %u, \"proto\": \"%s\", \"status\": \"%s\"}]},\n",
+			addrstr, ttl, ts / 1000000, port,
+			output_proto_name(proto), output_status_name(status)
+		);
+		return;
+	}
+	fprintf(f, "{\"ip\": \"%s\", \"timestamp\": %" PRIu64 ", \"ports\": [{\"port\": %u, \"proto\": \"%s\", \"status\": \"%s\", \"ttl\": %u%s}]},\n",
+		addrstr, ts / 1000000, port,
+		output_proto_name(proto), output_status_name(status),
+		ttl, rttstr
 	);
 }
 
@@ -45,16 +55,18 @@ static void json_escape(struct obuf *out, const unsigned char* buf, uint32_t len
 	}
 }
 
-static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, const char *banner, uint32_t bannerlen)
+static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen)
 {
-	// {"ip": "<ip>", "timestamp": <ts>, "ports": [{"port": <port>, "proto": "<tcp/udp>", "service": {"name": "http", "banner": "......"}}]},
+	// {"ip": "<ip>", "timestamp": <ts>, "ports": [{"port": <port>, "proto": "<tcp/udp>", "rtt_us": <rtt>, "service": {"name": "http", "banner": "......"}}]},
 	DECLARE_OBUF_STACK(out, OUTPUT_BUFFER);
 
-	char addrstr[IPV6_STRING_MAX], buffer[512];
+	char addrstr[IPV6_STRING_MAX], rttstr[32] = {0}, buffer[512];
 
 	ipv6_string(addrstr, addr);
-	snprintf(buffer, sizeof(buffer), "{\"ip\": \"%s\", \"timestamp\": %" PRIu64 ", \"ports\": [{\"port\": %u, \"proto\": \"%s\", \"service\": {\"name\": ",
-		addrstr, ts, port, proto == OUTPUT_PROTO_TCP ? "tcp" : "udp"
+	if(rtt > 0)
+		snprintf(rttstr, sizeof(rttstr), ", \"rtt_us\": %" PRIu32, rtt);
+	snprintf(buffer, sizeof(buffer), "{\"ip\": \"%s\", \"timestamp\": %" PRIu64 ", \"ports\": [{\"port\": %u, \"proto\": \"%s\"%s, \"service\": {\"name\": ",
+		addrstr, ts / 1000000, port, proto == OUTPUT_PROTO_TCP ? "tcp" : "udp", rttstr
 	);
 	obuf_writestr(&out, buffer);
 
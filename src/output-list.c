@@ -17,17 +17,22 @@ static void begin(FILE *f)
 	fprintf(f, "#fi6s\n");
 }
 
-static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, int status)
+static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status)
 {
 	// <status> tcp <port> <ip> <ts>
-	char addrstr[IPV6_STRING_MAX];
+	// (aliased prefixes: <ip>/<length>)
+	char addrstr[IPV6_STRING_MAX + 4];
 
-	(void) ttl;
+	(void) rtt;
 	ipv6_string(addrstr, addr);
+	if(status == OUTPUT_STATUS_ALIASED) {
+		// (ttl holds the prefix length)
+		int l = strlen(addrstr);
+		snprintf(&addrstr[l], sizeof(addrstr) - l, "/%u", ttl);
+	}
 	fprintf(f, "%s %s %u %s %" PRIu64 "\n",
-		proto == OUTPUT_PROTO_TCP ? "tcp" : (proto == OUTPUT_PROTO_UDP ? "udp" : "icmp"),
-		status == OUTPUT_STATUS_OPEN ? "open" : (status == OUTPUT_STATUS_CLOSED ? "closed" : "up"),
-		port, addrstr, ts
+		output_proto_name(proto), output_status_name(status),
+		port, addrstr, ts / 1000000
 	);
 }
 
@@ -45,7 +50,7 @@ static void escaped(struct obuf *out, const unsigned char* buf, uint32_t len)
 	}
 }
 
-static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, const char *banner, uint32_t bannerlen)
+static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen)
 {
 	// banner tcp <port> <ip> <ts> <proto> <banner>
 	DECLARE_OBUF_STACK(out, OUTPUT_BUFFER);
@@ -53,11 +58,12 @@ static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_
 	char addrstr[IPV6_STRING_MAX], buffer[256];
 	const char *svc;
 
+	(void) rtt;
 	ipv6_string(addrstr, addr);
 	svc = banner_service_type(banner_outproto2ip_type(proto), port);
 	snprintf(buffer, sizeof(buffer), "banner %s %u %s %" PRIu64 " %s ",
 		proto == OUTPUT_PROTO_TCP ? "tcp" : "udp",
-		port, addrstr, ts,
+		port, addrstr, ts / 1000000,
 		svc ? svc : "?"
 	);
 	obuf_writestr(&out, buffer);
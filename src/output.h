@@ -10,6 +10,9 @@ enum {
 	OUTPUT_STATUS_OPEN = 0,
 	OUTPUT_STATUS_CLOSED,
 	OUTPUT_STATUS_UP,
+	OUTPUT_STATUS_ALIASED, // addr is a prefix, see below for its length
+	OUTPUT_STATUS_UNREACHABLE, // ICMPv6 error from the network
+	OUTPUT_STATUS_FILTERED, // ICMPv6 error: administratively prohibited
 };
 
 enum {
@@ -18,14 +21,37 @@ enum {
 	OUTPUT_PROTO_ICMP,
 };
 
+static inline const char *output_proto_name(int proto)
+{
+	return proto == OUTPUT_PROTO_TCP ? "tcp" : (proto == OUTPUT_PROTO_UDP ? "udp" : "icmp");
+}
+
+static inline const char *output_status_name(int status)
+{
+	static const char *const names[] = { "open", "closed", "up", "aliased", "unreachable", "filtered" };
+	return status >= 0 && status <= OUTPUT_STATUS_FILTERED ? names[status] : "?";
+}
+
+// negative results are only shown with --show-closed
+static inline int output_status_negative(int status)
+{
+	return status == OUTPUT_STATUS_CLOSED || status == OUTPUT_STATUS_UNREACHABLE ||
+		status == OUTPUT_STATUS_FILTERED;
+}
+
 struct outputdef {
 	void (*begin)(FILE *);
-	void (*output_status)(FILE *, uint64_t /*ts*/, const uint8_t * /*addr*/, int /*proto*/, uint16_t /*port*/, uint8_t /*ttl*/, int /*status*/);
-	void (*output_banner)(FILE *, uint64_t /*ts*/, const uint8_t * /*addr*/, int /*proto*/, uint16_t /*port*/, const char * /*banner*/, uint32_t /*bannerlen*/);
+	// timestamps are in microseconds, rtt in microseconds (0 = unknown)
+	// for OUTPUT_STATUS_ALIASED there is no ttl, the prefix length is passed in its place
+	void (*output_status)(FILE *, uint64_t /*ts*/, const uint8_t * /*addr*/, int /*proto*/, uint16_t /*port*/, uint8_t /*ttl*/, uint32_t /*rtt*/, int /*status*/);
+	void (*output_banner)(FILE *, uint64_t /*ts*/, const uint8_t * /*addr*/, int /*proto*/, uint16_t /*port*/, uint32_t /*rtt*/, const char * /*banner*/, uint32_t /*bannerlen*/);
 	void (*end)(FILE *);
+	void (*idle)(FILE *); // optional, called periodically when no results are coming in
 	unsigned raw : 1;
 };
 
 extern const struct outputdef output_list;
 extern const struct outputdef output_json;
 extern const struct outputdef output_binary;
+
+int output_binary_init(int compress); // before using output_binary
@@ -65,34 +65,51 @@ int rawsock_has_ethernet_headers(void)
 		snprintf(&(buffer)[__sl], sizeof(buffer) - __sl - 1, format, __VA_ARGS__); \
 	} while(0)
 
-int rawsock_setfilter(int flags, uint8_t iptype, const uint8_t *dstaddr, int dstport)
+int rawsock_setfilter(int flags, const uint8_t *iptypes, const uint8_t *dstaddr, int dstport)
 {
-	char fstr[128];
+	char fstr[256], pstr[128] = {0};
 	struct bpf_program fp;
 
 	strncpy(fstr, "ip6", sizeof(fstr));
-	if(flags & RAWSOCK_FILTER_IPTYPE) {
-		char *tmp;
-		if(iptype == IP_TYPE_TCP)
-			tmp = "tcp";
-		else if(iptype == IP_TYPE_UDP)
-			tmp = "udp";
-		else if(iptype == IP_TYPE_ICMPV6)
-			tmp = "icmp6";
-		else
-			return -1;
-		snprintf_append(fstr, " and %s", tmp);
-	}
 	if(flags & RAWSOCK_FILTER_DSTADDR) {
 		char tmp[IPV6_STRING_MAX];
 		assert(dstaddr);
 		ipv6_string(tmp, dstaddr);
 		snprintf_append(fstr, " and dst %s", tmp);
 	}
-	if(flags & RAWSOCK_FILTER_DSTPORT) {
+	if(flags & RAWSOCK_FILTER_DSTPORT)
 		assert(dstport > 0);
-		snprintf_append(fstr, " and dst port %d", dstport);
+	if(flags & RAWSOCK_FILTER_IPTYPE) {
+		bool has_icmp = false;
+		assert(iptypes && iptypes[0]);
+		for(int i = 0; iptypes[i]; i++) {
+			char *tmp;
+			if(iptypes[i] == IP_TYPE_TCP)
+				tmp = "tcp";
+			else if(iptypes[i] == IP_TYPE_UDP)
+				tmp = "udp";
+			else if(iptypes[i] == IP_TYPE_ICMPV6) {
+				tmp = "icmp6";
+				has_icmp = true;
+			} else
+				return -1;
+			if(i > 0)
+				snprintf_append(pstr, "%s", " or ");
+			if((flags & RAWSOCK_FILTER_DSTPORT) && iptypes[i] != IP_TYPE_ICMPV6)
+				snprintf_append(pstr, "(%s and dst port %d)", tmp, dstport);
+			else
+				snprintf_append(pstr, "%s", tmp);
+		}
+		// ICMPv6 Destination Unreachable (type 1). Like the rest of the receive path
+		// this assumes no extension headers; icmp6[icmp6type] isn't used as it
+		// needs a recent libpcap and doesn't chase the header chain either.
+		if((flags & RAWSOCK_FILTER_ICMPERR) && !has_icmp)
+			snprintf_append(pstr, "%s", " or (icmp6 and ip6[40] == 1)");
+	} else if(flags & RAWSOCK_FILTER_DSTPORT) {
+		snprintf_append(pstr, "dst port %d", dstport);
 	}
+	if(pstr[0])
+		snprintf_append(fstr, " and (%s)", pstr);
 
 	log_debug("pcap filter: \"%s\"", fstr);
 	if(pcap_compile(handle, &fp, fstr, 0, PCAP_NETMASK_UNKNOWN) == -1) {
@@ -125,7 +142,7 @@ int rawsock_sniff(uint64_t *ts, int *length, const uint8_t **pkt)
 		return 0;
 	if(hdr->caplen < hdr->len) // truncated packet
 		return -1;
-	*ts = hdr->ts.tv_sec;
+	*ts = hdr->ts.tv_sec * UINT64_C(1000000) + hdr->ts.tv_usec;
 	*length = hdr->caplen;
 	return 1;
 }
@@ -190,6 +207,19 @@ int rawsock_send(const uint8_t *pkt, unsigned int size)
 	return r;
 }
 
+int rawsock_stats(unsigned int *dropped)
+{
+	struct pcap_stat st;
+	if(dumper) {
+		*dropped = 0;
+		return 0;
+	}
+	if(pcap_stats(handle, &st) != 0)
+		return -1;
+	*dropped = st.ps_drop + st.ps_ifdrop;
+	return 0;
+}
+
 void rawsock_close(void)
 {
 	if(dumper)
@@ -202,5 +232,6 @@ static void callback_fwd(u_char *user, const struct pcap_pkthdr *hdr, const u_ch
 {
 	if(hdr->caplen < hdr->len) // truncated
 		return;
-	((rawsock_callback) (intptr_t) user)(hdr->ts.tv_sec, hdr->caplen, pkt);
+	uint64_t ts = hdr->ts.tv_sec * UINT64_C(1000000) + hdr->ts.tv_usec;
+	((rawsock_callback) (intptr_t) user)(ts, hdr->caplen, pkt);
 }
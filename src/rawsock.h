@@ -15,6 +15,7 @@ enum {
 	RAWSOCK_FILTER_IPTYPE  = (1 << 0),
 	RAWSOCK_FILTER_DSTADDR = (1 << 1),
 	RAWSOCK_FILTER_DSTPORT = (1 << 2),
+	RAWSOCK_FILTER_ICMPERR = (1 << 3), // also let ICMPv6 Destination Unreachable through
 };
 
 #define FRAME_ETH_SIZE 14
@@ -50,16 +51,17 @@ struct pseudo_header {
 	uint8_t ipproto;
 } __attribute__((packed));
 
-typedef void (*rawsock_callback)(uint64_t /* timestamp */, int /* length */, const uint8_t* /* packet */);
+typedef void (*rawsock_callback)(uint64_t /* timestamp (us) */, int /* length */, const uint8_t* /* packet */);
 
 int rawsock_open(const char *dev, int buffersize);
 int rawsock_has_ethernet_headers(void);
-int rawsock_setfilter(int flags, uint8_t iptype, const uint8_t *dstaddr, int dstport);
+int rawsock_setfilter(int flags, const uint8_t *iptypes, const uint8_t *dstaddr, int dstport); // iptypes is zero-terminated
 // For testing only, normally you use rawsock_loop.
 int rawsock_sniff(uint64_t *ts, int *length, const uint8_t **pkt);
 int rawsock_loop(rawsock_callback func);
 void rawsock_breakloop(void);
 int rawsock_send(const uint8_t *pkt, unsigned int size);
+int rawsock_stats(unsigned int *dropped); // packets dropped during capture so far
 void rawsock_close(void);
 
 void rawsock_eth_settings(const uint8_t *src, const uint8_t *dst);
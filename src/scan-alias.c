@@ -0,0 +1,269 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "scan.h"
+#include "util.h"
+
+/*
+ * Responding hosts are counted per prefix, in a small bitmap indexed by a
+ * hash of the address. Once enough different hosts of a prefix answered it
+ * is verified by probing one random address in each of the 16 subprefixes
+ * directly below it (first nibble after the prefix).
+ * If all of them answer the prefix is considered aliased: its remaining
+ * targets are skipped and its responses are no longer reported.
+ * If not all of them answer in time the prefix starts over and is verified
+ * again later, up to ALIAS_VERIFY_ATTEMPTS times, after which it is known
+ * not to be aliased.
+ * The verification addresses are derived from a keyed hash so that the
+ * receive side can recognize them without having to store them.
+ *
+ * The table is only written by the receive thread, except for the time
+ * verification started, which the send thread sets.
+ */
+
+enum {
+	STATE_NONE = 0,
+	STATE_VERIFYING,
+	STATE_ALIASED,
+	STATE_CLEAN, // verified to not be aliased
+};
+
+#define STATE(info) ((info) & 3)
+#define ATTEMPTS(info) (((info) >> 2) & 3)
+#define VERIFIED(info) ((info) >> 16)
+#define MAKE_INFO(state, attempts, verified) ((state) | ((attempts) << 2) | ((verified) << 16))
+
+struct alias_entry {
+	_Atomic uint64_t key; // 0 = unused
+	atomic_uint info;
+	uint32_t hosts; // bitmap of responding hosts
+	atomic_uint since; // ms, when verification probes started to be sent (0 = not yet)
+};
+
+static int prefix_len;
+static uint32_t verify_wait;
+static uint8_t prefix_mask[16];
+static uint64_t hash_seed;
+static struct alias_entry *table;
+
+// prefixes waiting for verification (receive -> send thread)
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	uint8_t prefix[16];
+	uint32_t probe;
+} queue[ALIAS_QUEUE_SIZE];
+static unsigned int queue_head, queue_tail;
+
+// only accessed by the send thread
+static struct {
+	uint8_t prefix[16];
+	uint32_t probe;
+	int next; // index of next verification probe
+} cur = { .next = ALIAS_PROBES };
+
+static atomic_uint skipped;
+
+#define TABLE_BITS 16
+
+static inline uint64_t prefix_key(const uint8_t *addr, uint8_t *prefix)
+{
+	uint64_t a, b, m;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	memcpy(&m, prefix_mask, 8);
+	a &= m;
+	memcpy(&m, &prefix_mask[8], 8);
+	b &= m;
+	if(prefix) {
+		memcpy(prefix, &a, 8);
+		memcpy(&prefix[8], &b, 8);
+	}
+	uint64_t h = hash_seed ^ a;
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h ^= b;
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	h ^= h >> 33;
+	return h ? h : 1;
+}
+
+static inline struct alias_entry *lookup(uint64_t key)
+{
+	return &table[key & ((1 << TABLE_BITS) - 1)];
+}
+
+static inline uint32_t host_bit(const uint8_t *addr)
+{
+	uint64_t a, b;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	uint64_t h = (hash_seed + b) * UINT64_C(0x9e3779b97f4a7c15);
+	h = (h ^ (h >> 29) ^ a) * UINT64_C(0xbf58476d1ce4e5b9);
+	return UINT32_C(1) << (h >> 59);
+}
+
+static inline bool verify_expired(struct alias_entry *e, uint32_t now)
+{
+	uint32_t since = atomic_load(&e->since);
+	return since != 0 && now - since >= verify_wait;
+}
+
+// i-th verification address of the prefix
+static void verify_addr(const uint8_t *prefix, uint64_t key, int i, uint8_t *dst)
+{
+	memcpy(dst, prefix, 16);
+	// set the nibble right after the prefix
+	dst[prefix_len / 8] |= i << (4 - prefix_len % 8); // (length is a multiple of 4)
+	// and fill the rest with pseudo-random bits
+	uint64_t r = key ^ (i * UINT64_C(0x9e3779b97f4a7c15));
+	for(int bit = prefix_len + 4; bit < 128; bit++) {
+		if(bit == prefix_len + 4 || bit % 64 == 0)
+			r = (r ^ (r >> 29)) * UINT64_C(0xbf58476d1ce4e5b9);
+		if((r >> (bit % 64)) & 1)
+			dst[bit / 8] |= 0x80 >> (bit % 8);
+	}
+}
+
+int scan_alias_init(int _prefix_len, unsigned int verify_wait_ms)
+{
+	prefix_len = _prefix_len;
+	verify_wait = verify_wait_ms;
+	memset(prefix_mask, 0, 16);
+	for(int i = 0; i < prefix_len; i++)
+		prefix_mask[i / 8] |= 0x80 >> (i % 8);
+	hash_seed = rand64();
+
+	table = calloc(1 << TABLE_BITS, sizeof(struct alias_entry));
+	if(!table)
+		return -1;
+	queue_head = queue_tail = 0;
+	cur.next = ALIAS_PROBES;
+	atomic_store(&skipped, 0);
+	return 0;
+}
+
+void scan_alias_fini(void)
+{
+	free(table);
+	table = NULL;
+}
+
+int scan_alias_response(const uint8_t *addr, uint32_t probe, uint8_t *prefix)
+{
+	uint8_t tmp[16];
+	uint64_t key = prefix_key(addr, tmp);
+	struct alias_entry *e = lookup(key);
+	unsigned int info = atomic_load(&e->info);
+	const uint32_t now = monotonic_ms();
+
+	if(atomic_load(&e->key) != key) {
+		// only take over slots that aren't interesting
+		if(atomic_load(&e->key) != 0 && STATE(info) != STATE_NONE && STATE(info) != STATE_CLEAN &&
+			!(STATE(info) == STATE_VERIFYING && verify_expired(e, now)))
+			return ALIAS_NONE;
+		atomic_store(&e->key, key);
+		info = MAKE_INFO(STATE_NONE, 0, 0);
+		atomic_store(&e->info, info);
+		e->hosts = 0;
+	} else if(STATE(info) == STATE_VERIFYING && verify_expired(e, now)) {
+		// not every verification probe was answered
+		unsigned int attempts = ATTEMPTS(info) + 1;
+		if(attempts < ALIAS_VERIFY_ATTEMPTS)
+			info = MAKE_INFO(STATE_NONE, attempts, 0);
+		else
+			info = MAKE_INFO(STATE_CLEAN, 0, 0);
+		atomic_store(&e->info, info);
+		e->hosts = 0;
+	}
+
+	switch(STATE(info)) {
+		case STATE_NONE: {
+			e->hosts |= host_bit(addr);
+			if(__builtin_popcount(e->hosts) < ALIAS_SUSPECT_HOSTS)
+				break;
+			pthread_mutex_lock(&queue_lock);
+			if(queue_tail - queue_head < ALIAS_QUEUE_SIZE) {
+				unsigned int i = queue_tail++ % ALIAS_QUEUE_SIZE;
+				memcpy(queue[i].prefix, tmp, 16);
+				queue[i].probe = probe;
+				atomic_store(&e->since, 0);
+				atomic_store(&e->info, MAKE_INFO(STATE_VERIFYING, ATTEMPTS(info), 0));
+			}
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		case STATE_VERIFYING: {
+			int i = (addr[prefix_len / 8] >> (4 - prefix_len % 8)) & 0xf;
+			uint8_t expect[16];
+			verify_addr(tmp, key, i, expect);
+			if(memcmp(addr, expect, 16) != 0)
+				break;
+			unsigned int verified = VERIFIED(info) | (1 << i);
+			if(verified != (1 << ALIAS_PROBES) - 1) {
+				atomic_store(&e->info, MAKE_INFO(STATE_VERIFYING, ATTEMPTS(info), verified));
+				return ALIAS_SUPPRESS;
+			}
+			atomic_store(&e->info, MAKE_INFO(STATE_ALIASED, 0, 0));
+			memcpy(prefix, tmp, 16);
+			return ALIAS_DETECTED;
+		}
+		case STATE_ALIASED:
+			return ALIAS_SUPPRESS;
+		case STATE_CLEAN:
+			break;
+	}
+	return ALIAS_NONE;
+}
+
+bool scan_alias_contains(const uint8_t *addr)
+{
+	uint64_t key = prefix_key(addr, NULL);
+	struct alias_entry *e = lookup(key);
+	return atomic_load(&e->key) == key && STATE(atomic_load(&e->info)) == STATE_ALIASED;
+}
+
+bool scan_alias_pruned(const uint8_t *addr)
+{
+	if(!scan_alias_contains(addr))
+		return false;
+	atomic_fetch_add(&skipped, 1);
+	return true;
+}
+
+int scan_alias_next(uint8_t *addr, uint32_t *probe)
+{
+	if(cur.next == ALIAS_PROBES) {
+		bool got = false;
+		pthread_mutex_lock(&queue_lock);
+		if(queue_head != queue_tail) {
+			unsigned int i = queue_head++ % ALIAS_QUEUE_SIZE;
+			memcpy(cur.prefix, queue[i].prefix, 16);
+			cur.probe = queue[i].probe;
+			cur.next = 0;
+			got = true;
+		}
+		pthread_mutex_unlock(&queue_lock);
+		if(!got)
+			return 0;
+
+		// the wait for replies starts now
+		struct alias_entry *e = lookup(prefix_key(cur.prefix, NULL));
+		uint32_t now = monotonic_ms();
+		atomic_store(&e->since, now ? now : 1);
+	}
+
+	verify_addr(cur.prefix, prefix_key(cur.prefix, NULL), cur.next, addr);
+	*probe = cur.probe;
+	cur.next++;
+	return 1;
+}
+
+unsigned int scan_alias_stats(void)
+{
+	return atomic_load(&skipped);
+}
@@ -0,0 +1,109 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "scan.h"
+#include "util.h"
+
+/*
+ * Results that were already output are remembered in a blocked Bloom filter:
+ * all bits of one key live in the same 512-bit block, so a lookup touches a
+ * single cache line. Bits are set with atomic OR, the key was seen before if
+ * none of them changed. Two threads outputting the same result at the same
+ * time may both get through, which is harmless.
+ * A false positive drops a genuine result, so the filter is sized for the
+ * requested false positive rate at the expected number of results.
+ */
+
+#define BLOCK_WORDS 8 // 512 bits
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+#define LN2 0.69314718055994530942
+#define BLOCKING_OVERHEAD 1.3
+
+static _Atomic uint64_t *filter;
+static uint64_t block_mask;
+static int nhashes;
+static uint64_t hash_seed;
+
+static atomic_uint suppressed;
+
+int scan_dedup_init(uint64_t entries, double fp_rate)
+{
+	// k = -log2(fp rate)
+	nhashes = 1;
+	for(double p = 0.5; p > fp_rate && nhashes < DEDUP_MAX_HASHES; p /= 2)
+		nhashes++;
+
+	// optimal size is k / ln(2) bits per entry, blocking needs a bit more
+	double want = (double) entries * nhashes / LN2 * BLOCKING_OVERHEAD;
+	int bits = DEDUP_MIN_BITS;
+	while(bits < DEDUP_MAX_BITS && (double) (UINT64_C(1) << bits) < want)
+		bits++;
+	if((double) (UINT64_C(1) << bits) < want) {
+		log_warning("Duplicate filter is limited to %d MiB, more than %" PRIu64 " results "
+			"will exceed the false positive rate.", 1 << (bits - 23),
+			(uint64_t) ((UINT64_C(1) << bits) * LN2 / nhashes / BLOCKING_OVERHEAD));
+	}
+	log_debug("dedup filter: 2^%d bits, %d hashes", bits, nhashes);
+
+	// (pages are only touched once results land in them)
+	filter = calloc(UINT64_C(1) << (bits - 6), sizeof(uint64_t));
+	if(!filter)
+		return -1;
+	block_mask = (UINT64_C(1) << (bits - 9)) - 1;
+	hash_seed = rand64();
+	atomic_store(&suppressed, 0);
+	return 0;
+}
+
+void scan_dedup_fini(void)
+{
+	free((void*) filter);
+	filter = NULL;
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	return h ^ (h >> 33);
+}
+
+bool scan_dedup_seen(const uint8_t *addr, uint32_t key)
+{
+	if(!filter)
+		return false;
+
+	uint64_t a, b;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	uint64_t h1 = mix(hash_seed ^ a);
+	h1 = mix(h1 ^ b);
+	h1 = mix(h1 ^ key);
+	_Atomic uint64_t *block = &filter[(h1 & block_mask) * BLOCK_WORDS];
+	bool seen = true;
+	uint64_t h2 = h1;
+	for(int i = 0; i < nhashes; i++) {
+		// seven 9-bit positions per hash (BLOCK_BITS == 2^9)
+		if(i % 7 == 0)
+			h2 = mix(h2 + UINT64_C(0x9e3779b97f4a7c15));
+		unsigned int bit = (h2 >> (i % 7 * 9)) & (BLOCK_BITS - 1);
+		uint64_t m = UINT64_C(1) << (bit % 64);
+		if(!(atomic_fetch_or(&block[bit / 64], m) & m))
+			seen = false;
+	}
+
+	if(seen)
+		atomic_fetch_add(&suppressed, 1);
+	return seen;
+}
+
+unsigned int scan_dedup_stats(void)
+{
+	return atomic_load(&suppressed);
+}
@@ -0,0 +1,264 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "scan.h"
+#include "util.h"
+#include "output.h"
+#include "banner.h"
+#include "rawsock.h" // IP_TYPE_{TCP,UDP}
+
+/*
+ * Comparing results against a baseline scan: the positive results and banner
+ * hashes of the baseline are kept in an open addressing table, which is only
+ * written to while loading. Afterwards a result is passed through if it
+ * differs from the baseline. Positive results mark their entry as seen, at the
+ * end every baseline result that wasn't seen again is reported as closed.
+ */
+
+#define MIN_BITS 16
+#define BANNER_BUFFER_SIZE 65536
+
+enum {
+	F_USED = 1 << 0,
+	F_OPEN = 1 << 1, // positive status in baseline
+	F_BANNER = 1 << 2,
+	F_SEEN = 1 << 3, // (set concurrently)
+};
+
+struct entry {
+	uint8_t addr[16];
+	uint32_t banner; // hash
+	uint16_t port;
+	uint8_t proto;
+	uint8_t status; // if F_OPEN
+	_Atomic uint8_t flags;
+};
+
+static struct entry *table;
+static uint64_t mask, used;
+static bool enabled, postprocess, failed;
+static char *banner_buf;
+static atomic_uint suppressed;
+
+static inline uint64_t mix(uint64_t h)
+{
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	return h ^ (h >> 33);
+}
+
+static uint64_t key_hash(const uint8_t *addr, int proto, uint16_t port)
+{
+	uint64_t a, b;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	return mix(mix(mix(a) ^ b) ^ PROBE_ID(proto, port));
+}
+
+static uint32_t banner_hash(const char *data, uint32_t len)
+{
+	// FNV-1a
+	uint32_t h = UINT32_C(2166136261);
+	for(uint32_t i = 0; i < len; i++)
+		h = (h ^ (uint8_t) data[i]) * UINT32_C(16777619);
+	return h;
+}
+
+static struct entry *lookup(const uint8_t *addr, int proto, uint16_t port)
+{
+	if(!table)
+		return NULL;
+	for(uint64_t i = key_hash(addr, proto, port); ; i++) {
+		struct entry *e = &table[i & mask];
+		if(!(atomic_load_explicit(&e->flags, memory_order_relaxed) & F_USED))
+			return NULL;
+		if(e->port == port && e->proto == proto && !memcmp(e->addr, addr, 16))
+			return e;
+	}
+}
+
+static int grow(void)
+{
+	const uint64_t size = table ? (mask + 1) * 2 : UINT64_C(1) << MIN_BITS;
+	struct entry *n = calloc(size, sizeof(struct entry));
+	if(!n)
+		return -1;
+	for(uint64_t j = 0; table && j <= mask; j++) {
+		struct entry *e = &table[j];
+		if(!(e->flags & F_USED))
+			continue;
+		uint64_t i = key_hash(e->addr, e->proto, e->port);
+		while(n[i & (size - 1)].flags & F_USED)
+			i++;
+		memcpy(&n[i & (size - 1)], e, sizeof(*e));
+	}
+	free(table);
+	table = n;
+	mask = size - 1;
+	return 0;
+}
+
+static struct entry *insert(const uint8_t *addr, int proto, uint16_t port)
+{
+	struct entry *e = lookup(addr, proto, port);
+	if(e)
+		return e;
+	// keep the load factor below 1/2
+	if((used + 1) * 2 > (table ? mask + 1 : 0) && grow() < 0)
+		return NULL;
+	uint64_t i = key_hash(addr, proto, port);
+	while(table[i & mask].flags & F_USED)
+		i++;
+	e = &table[i & mask];
+	memcpy(e->addr, addr, 16);
+	e->port = port;
+	e->proto = proto;
+	e->flags = F_USED;
+	used++;
+	return e;
+}
+
+static void begin(FILE *f)
+{
+	(void) f;
+}
+
+static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status)
+{
+	(void) f; (void) ts; (void) ttl; (void) rtt;
+	if(failed || output_status_negative(status))
+		return;
+	struct entry *e = insert(addr, proto, port);
+	if(!e) {
+		failed = true;
+		return;
+	}
+	e->flags |= F_OPEN;
+	e->status = status;
+}
+
+static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen)
+{
+	(void) f; (void) ts; (void) rtt;
+	if(failed)
+		return;
+	struct entry *e = insert(addr, proto, port);
+	if(!e) {
+		failed = true;
+		return;
+	}
+	if(postprocess && bannerlen < BANNER_BUFFER_SIZE) {
+		// compare to banners as they will be output
+		unsigned int len = bannerlen;
+		memcpy(banner_buf, banner, len);
+		banner_postprocess(proto == OUTPUT_PROTO_TCP ? IP_TYPE_TCP : IP_TYPE_UDP, port, banner_buf, &len);
+		banner = banner_buf;
+		bannerlen = len;
+	}
+	e->flags |= F_BANNER;
+	e->banner = banner_hash(banner, bannerlen);
+}
+
+static void end(FILE *f)
+{
+	(void) f;
+}
+
+static const struct outputdef collector = {
+	.begin = &begin,
+	.output_status = &status,
+	.output_banner = &banner,
+	.end = &end,
+	.raw = 1,
+};
+
+int scan_diff_init(FILE *baseline, bool _postprocess)
+{
+	postprocess = _postprocess;
+	failed = false;
+	used = 0;
+	banner_buf = malloc(BANNER_BUFFER_SIZE);
+	if(!banner_buf)
+		return -1;
+	atomic_store(&suppressed, 0);
+
+	scan_reader_set_general(1, 1);
+	scan_reader_set_stats(-1, false);
+	scan_reader_set_output(NULL, &collector);
+	int ret = scan_reader_main(baseline);
+	free(banner_buf);
+	banner_buf = NULL;
+	if(ret < 0)
+		return -1;
+	if(failed) {
+		log_error("Failed to allocate memory for baseline.");
+		return -1;
+	}
+	log_debug("diff baseline: %" PRIu64 " entries", used);
+
+	enabled = true;
+	return 0;
+}
+
+void scan_diff_fini(void)
+{
+	free(table);
+	table = NULL;
+	enabled = false;
+}
+
+bool scan_diff_status(const uint8_t *addr, int proto, uint16_t port, int status)
+{
+	if(!enabled)
+		return true;
+
+	struct entry *e = lookup(addr, proto, port);
+	const uint8_t flags = e ? atomic_load(&e->flags) : 0;
+	bool changed;
+	if(output_status_negative(status)) {
+		// only a removal if it wasn't reported already
+		changed = (flags & F_OPEN) && !(atomic_fetch_or(&e->flags, F_SEEN) & F_SEEN);
+	} else {
+		changed = !(flags & F_OPEN) || e->status != status;
+		if(e)
+			atomic_fetch_or(&e->flags, F_SEEN);
+	}
+
+	if(!changed)
+		atomic_fetch_add(&suppressed, 1);
+	return changed;
+}
+
+bool scan_diff_banner(const uint8_t *addr, int proto, uint16_t port, const char *banner, uint32_t bannerlen)
+{
+	if(!enabled)
+		return true;
+
+	struct entry *e = lookup(addr, proto, port);
+	bool changed = !e || !(atomic_load(&e->flags) & F_BANNER) ||
+		e->banner != banner_hash(banner, bannerlen);
+
+	if(!changed)
+		atomic_fetch_add(&suppressed, 1);
+	return changed;
+}
+
+void scan_diff_removed(void (*cb)(const uint8_t *addr, int proto, uint16_t port))
+{
+	for(uint64_t i = 0; enabled && table && i <= mask; i++) {
+		struct entry *e = &table[i];
+		if((atomic_load(&e->flags) & (F_OPEN | F_SEEN)) == F_OPEN)
+			cb(e->addr, e->proto, e->port);
+	}
+}
+
+unsigned int scan_diff_stats(void)
+{
+	return atomic_load(&suppressed);
+}
@@ -0,0 +1,182 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#define _GNU_SOURCE // memmem()
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "scan.h"
+#include "util.h"
+#include "output.h"
+#include "binary.h"
+#include "target.h"
+
+/*
+ * Filters for reading binary scans. A record has to match every filter that
+ * was given. They are checked against the raw record, before any banner
+ * processing or formatting happens. Blocks carry the range of their contents,
+ * so blocks that can't contain any match are skipped without decoding.
+ */
+
+#define PROTO_ANY ( (1 << OUTPUT_PROTO_TCP) | (1 << OUTPUT_PROTO_UDP) | (1 << OUTPUT_PROTO_ICMP) )
+
+static struct {
+	bool net, port, time;
+	struct targetspec spec;
+	uint8_t lo[16], hi[16]; // range of addresses matching spec
+	struct ports ports;
+	uint64_t ts_min, ts_max;
+	unsigned int protos; // bitmask of OUTPUT_PROTO_*
+	unsigned int statuses; // bitmask of OUTPUT_STATUS_*, 0 = any
+	char *banner;
+	size_t banner_len;
+} filter = {
+	.protos = PROTO_ANY,
+};
+
+static int parse_names(char *str, unsigned int *mask, const char *(*name)(int), int max)
+{
+	*mask = 0;
+	for(char *tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		int i;
+		for(i = 0; i <= max; i++) {
+			if(!strcmp(tok, name(i)))
+				break;
+		}
+		if(i > max)
+			return -1;
+		*mask |= 1 << i;
+	}
+	return *mask ? 0 : -1;
+}
+
+static int parse_time(const char *str, uint64_t *min, uint64_t *max)
+{
+	// <from>-<to> in seconds, either may be omitted
+	char *end;
+	*min = 0;
+	*max = UINT64_MAX;
+	if(*str != '-') {
+		*min = strtoull(str, &end, 10) * 1000000;
+		if(end == str)
+			return -1;
+		str = end;
+	}
+	if(*str++ != '-')
+		return -1;
+	if(*str) {
+		*max = strtoull(str, &end, 10) * 1000000 + 999999;
+		if(*end)
+			return -1;
+	}
+	return *min <= *max ? 0 : -1;
+}
+
+int scan_filter_add(const char *expr)
+{
+	const char *eq = strchr(expr, '=');
+	if(!eq || !eq[1])
+		return -1;
+	const size_t keylen = eq - expr;
+	char *value = strdup(eq + 1);
+	if(!value)
+		return -1;
+
+	int ret = -1;
+#define KEY(s) ( keylen == strlen(s) && !strncmp(expr, s, keylen) )
+	if(KEY("net")) {
+		ret = target_parse(value, &filter.spec);
+		for(int i = 0; i < 16; i++) {
+			filter.lo[i] = filter.spec.addr[i] & filter.spec.mask[i];
+			filter.hi[i] = filter.spec.addr[i] | ~filter.spec.mask[i];
+		}
+		filter.net = true;
+	} else if(KEY("port")) {
+		ret = parse_ports(value, &filter.ports);
+		filter.port = true;
+	} else if(KEY("proto")) {
+		ret = parse_names(value, &filter.protos, output_proto_name, OUTPUT_PROTO_ICMP);
+	} else if(KEY("status")) {
+		ret = parse_names(value, &filter.statuses, output_status_name, OUTPUT_STATUS_FILTERED);
+	} else if(KEY("time")) {
+		ret = parse_time(value, &filter.ts_min, &filter.ts_max);
+		filter.time = true;
+	} else if(KEY("banner")) {
+		free(filter.banner);
+		filter.banner = strdup(value);
+		filter.banner_len = strlen(value);
+		ret = filter.banner ? 0 : -1;
+	}
+#undef KEY
+
+	free(value);
+	return ret;
+}
+
+static bool port_matches(uint16_t lo, uint16_t hi)
+{
+	for(int i = 0; i < PORTS_MAX_RANGES; i++) {
+		if(filter.ports.r[i].begin > filter.ports.r[i].end)
+			break;
+		if(filter.ports.r[i].begin <= hi && filter.ports.r[i].end >= lo)
+			return true;
+	}
+	return false;
+}
+
+bool scan_filter_record(const struct rec_header *h, const char *data)
+{
+	const int proto = h->proto_status >> 4, status = h->proto_status & 0xf;
+	const bool is_banner = h->size > sizeof(*h);
+
+	if(!(filter.protos & (1 << proto)))
+		return false;
+	// (status records of ICMP carry no port)
+	if(filter.port && (proto == OUTPUT_PROTO_ICMP || !port_matches(h->port, h->port)))
+		return false;
+	if(filter.time && (h->timestamp < filter.ts_min || h->timestamp > filter.ts_max))
+		return false;
+	if(filter.net) {
+		for(int i = 0; i < 16; i++) {
+			if((h->addr[i] & filter.spec.mask[i]) != filter.lo[i])
+				return false;
+		}
+	}
+	// banners have no status, the status filter only applies to status records
+	if(filter.statuses && !is_banner && !(filter.statuses & (1 << status)))
+		return false;
+	// and only banner records can match a banner filter
+	if(filter.banner && (!is_banner ||
+		!memmem(data, h->size - sizeof(*h), filter.banner, filter.banner_len)))
+		return false;
+	return true;
+}
+
+bool scan_filter_block(const struct block_header *h)
+{
+	uint32_t kinds = 0;
+	for(int proto = 0; proto <= OUTPUT_PROTO_ICMP; proto++) {
+		if(!(filter.protos & (1 << proto)))
+			continue;
+		if(!filter.banner) {
+			for(int status = 0; status <= OUTPUT_STATUS_FILTERED; status++) {
+				if(!filter.statuses || (filter.statuses & (1 << status)))
+					kinds |= BLOCK_KIND_STATUS(proto, status);
+			}
+		}
+		kinds |= BLOCK_KIND_BANNER(proto);
+	}
+	if(!(h->kinds & kinds))
+		return false;
+
+	// (ICMP records never match a port filter, so ignoring them is fine)
+	if(filter.port && !port_matches(h->min_port, h->max_port))
+		return false;
+	if(filter.time && (h->max_timestamp < filter.ts_min || h->min_timestamp > filter.ts_max))
+		return false;
+	if(filter.net && (memcmp(h->max_addr, filter.lo, 16) < 0 || memcmp(h->min_addr, filter.hi, 16) > 0))
+		return false;
+	return true;
+}
@@ -0,0 +1,179 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "scan.h"
+#include "util.h"
+
+/*
+ * Each destination prefix is limited with GCRA (the "virtual scheduling"
+ * form of a token bucket), so a bucket is just its theoretical arrival time.
+ * Prefixes are hashed into a fixed table, a collision makes two prefixes
+ * share a limit which only ever errs on the safe side.
+ * A probe that exceeds its limit reserves the next free slot of its bucket
+ * and waits in a min-heap ordered by that time.
+ */
+
+struct deferred {
+	uint64_t when; // us
+	uint8_t addr[16];
+	uint32_t probe;
+	bool first;
+};
+
+static uint64_t *buckets; // theoretical arrival time (us)
+static uint8_t prefix_mask[16];
+static uint64_t interval, tolerance; // us
+static uint64_t hash_seed;
+
+// only accessed by the send thread
+static struct deferred *heap;
+static unsigned int heap_used, heap_size;
+
+static atomic_uint deferrals;
+
+#define BUCKET_BITS 20
+#define DEFER_MAX (1 << 18) // stop generating new probes beyond this
+#define BURST_DIV 10 // allow bursts of 1/n second worth of probes
+
+static inline uint32_t prefix_hash(const uint8_t *addr)
+{
+	uint64_t a, b, m;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	memcpy(&m, prefix_mask, 8);
+	a &= m;
+	memcpy(&m, &prefix_mask[8], 8);
+	b &= m;
+	uint64_t h = hash_seed ^ a;
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h ^= b;
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	return (h ^ (h >> 33)) & ((1 << BUCKET_BITS) - 1);
+}
+
+int scan_limit_init(unsigned int rate, int prefix_len)
+{
+	memset(prefix_mask, 0, 16);
+	for(int i = 0; i < prefix_len; i++)
+		prefix_mask[i / 8] |= 0x80 >> (i % 8);
+	interval = 1000000 / rate;
+	if(interval == 0)
+		interval = 1;
+	unsigned int burst = rate / BURST_DIV;
+	tolerance = burst > 1 ? interval * (burst - 1) : 0;
+
+	buckets = calloc(1 << BUCKET_BITS, sizeof(uint64_t));
+	if(!buckets)
+		return -1;
+	heap_size = 1024;
+	heap_used = 0;
+	heap = malloc(heap_size * sizeof(struct deferred));
+	if(!heap) {
+		free(buckets);
+		return -1;
+	}
+
+	hash_seed = rand64();
+	atomic_store(&deferrals, 0);
+	return 0;
+}
+
+void scan_limit_fini(void)
+{
+	free(buckets);
+	free(heap);
+	buckets = NULL;
+	heap = NULL;
+}
+
+static int heap_push(const struct deferred *d)
+{
+	if(heap_used == heap_size) {
+		struct deferred *n = realloc(heap, heap_size * 2 * sizeof(struct deferred));
+		if(!n)
+			return -1;
+		heap = n;
+		heap_size *= 2;
+	}
+	unsigned int i = heap_used++;
+	while(i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if(heap[parent].when <= d->when)
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = *d;
+	return 0;
+}
+
+static void heap_pop(void)
+{
+	const struct deferred last = heap[--heap_used];
+	unsigned int i = 0;
+	while(1) {
+		unsigned int c = 2 * i + 1;
+		if(c >= heap_used)
+			break;
+		if(c + 1 < heap_used && heap[c + 1].when < heap[c].when)
+			c++;
+		if(last.when <= heap[c].when)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+}
+
+int scan_limit_admit(const uint8_t *addr, uint32_t probe, bool first)
+{
+	uint64_t now = monotonic_us();
+	uint64_t *tat = &buckets[prefix_hash(addr)];
+	if(*tat <= now + tolerance) {
+		*tat = (*tat > now ? *tat : now) + interval;
+		return 1;
+	}
+
+	// reserve the next slot and wait for it
+	struct deferred d;
+	d.when = *tat - tolerance;
+	memcpy(d.addr, addr, 16);
+	d.probe = probe;
+	d.first = first;
+	if(heap_push(&d) < 0)
+		return -1;
+	*tat += interval;
+	atomic_fetch_add(&deferrals, 1);
+	return 0;
+}
+
+int scan_limit_next(uint8_t *addr, uint32_t *probe, bool *first)
+{
+	if(heap_used == 0 || heap[0].when > monotonic_us())
+		return 0;
+	memcpy(addr, heap[0].addr, 16);
+	*probe = heap[0].probe;
+	*first = heap[0].first;
+	heap_pop();
+	return 1;
+}
+
+bool scan_limit_full(void)
+{
+	return heap_used >= DEFER_MAX;
+}
+
+bool scan_limit_pending(void)
+{
+	return heap_used > 0;
+}
+
+unsigned int scan_limit_stats(void)
+{
+	return atomic_load(&deferrals);
+}
@@ -0,0 +1,332 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "scan.h"
+#include "util.h"
+#include "output.h"
+#include "binary.h"
+
+/*
+ * Merging binary scans: all records are collected in memory up to a limit,
+ * sorted and written to a temporary file as one run. At the end the runs
+ * are merged with a heap. Of several records for the same address, proto
+ * and port only the newest status record and newest banner are kept.
+ */
+
+#define ALIGN8(x) ( ((x) + 7) & ~(size_t)7 )
+#define RECORD_MAX_SIZE (sizeof(struct rec_header) + UINT16_MAX)
+
+struct source {
+	FILE *file; // NULL = the in-memory run
+	struct reader r;
+	size_t next; // in-memory run: index of next record
+	struct rec_header h;
+	char *data;
+};
+
+static size_t memory_limit;
+static char *arena;
+static size_t arena_used;
+static uint64_t *records; // offsets into arena
+static size_t nrecords, records_size;
+
+static FILE **runs;
+static int nruns;
+static bool failed;
+static uint64_t total, dropped;
+
+int scan_merge_init(unsigned int memory_mb)
+{
+	memory_limit = (size_t) memory_mb << 20;
+	arena = malloc(memory_limit + RECORD_MAX_SIZE);
+	if(!arena)
+		return -1;
+	arena_used = 0;
+	nrecords = 0;
+	nruns = 0;
+	failed = false;
+	total = dropped = 0;
+	return 0;
+}
+
+static int record_cmp(const struct rec_header *a, const struct rec_header *b)
+{
+	int r = memcmp(a->addr, b->addr, 16);
+	if(r != 0)
+		return r;
+	const int pa = a->proto_status >> 4, pb = b->proto_status >> 4;
+	if(pa != pb)
+		return pa - pb;
+	if(a->port != b->port)
+		return (int) a->port - (int) b->port;
+	// status before banner
+	const bool ba = a->size > sizeof(*a), bb = b->size > sizeof(*b);
+	if(ba != bb)
+		return ba ? 1 : -1;
+	// newest first
+	if(a->timestamp != b->timestamp)
+		return a->timestamp > b->timestamp ? -1 : 1;
+	return 0;
+}
+
+static int offset_cmp(const void *a, const void *b)
+{
+	return record_cmp((const struct rec_header*) &arena[*(const uint64_t*) a],
+		(const struct rec_header*) &arena[*(const uint64_t*) b]);
+}
+
+static int spill(void)
+{
+	qsort(records, nrecords, sizeof(uint64_t), offset_cmp);
+
+	FILE **tmp = realloc(runs, (nruns + 1) * sizeof(FILE*));
+	if(!tmp)
+		return -1;
+	runs = tmp;
+	FILE *f = tmpfile();
+	if(!f) {
+		perror("tmpfile");
+		return -1;
+	}
+	runs[nruns++] = f;
+
+	for(size_t i = 0; i < nrecords; i++) {
+		const struct rec_header *h = (const struct rec_header*) &arena[records[i]];
+		fwrite(h, ALIGN8(h->size), 1, f);
+	}
+	if(fflush(f) != 0 || ferror(f)) {
+		log_error("Failed to write temporary file");
+		return -1;
+	}
+	rewind(f);
+
+	arena_used = 0;
+	nrecords = 0;
+	return 0;
+}
+
+static void add(const struct rec_header *h, const void *data)
+{
+	if(failed)
+		return;
+	if(nrecords == records_size) {
+		size_t n = records_size ? records_size * 2 : 65536;
+		uint64_t *tmp = realloc(records, n * sizeof(uint64_t));
+		if(!tmp) {
+			failed = true;
+			return;
+		}
+		records = tmp;
+		records_size = n;
+	}
+
+	char *p = &arena[arena_used];
+	memcpy(p, h, sizeof(*h));
+	if(h->size > sizeof(*h))
+		memcpy(&p[sizeof(*h)], data, h->size - sizeof(*h));
+	memset(&p[h->size], 0, ALIGN8(h->size) - h->size);
+	records[nrecords++] = arena_used;
+	arena_used += ALIGN8(h->size);
+	total++;
+
+	if(arena_used >= memory_limit && spill() < 0)
+		failed = true;
+}
+
+static void begin(FILE *f)
+{
+	(void) f;
+}
+
+static void status(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status)
+{
+	struct rec_header h;
+	(void) f;
+	memset(&h, 0, sizeof(h));
+	h.timestamp = ts;
+	h.size = sizeof(h);
+	h.port = port;
+	if(status == OUTPUT_STATUS_ALIASED)
+		h.prefix_len = ttl;
+	else
+		h.ttl = ttl;
+	h.proto_status = (proto << 4) | status;
+	memcpy(h.addr, addr, 16);
+	h.rtt = rtt;
+	add(&h, NULL);
+}
+
+static void banner(FILE *f, uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen)
+{
+	struct rec_header h;
+	(void) f;
+	memset(&h, 0, sizeof(h));
+	h.timestamp = ts;
+	h.size = sizeof(h) + bannerlen;
+	h.port = port;
+	h.proto_status = proto << 4;
+	memcpy(h.addr, addr, 16);
+	h.rtt = rtt;
+	add(&h, banner);
+}
+
+static void end(FILE *f)
+{
+	(void) f;
+}
+
+static const struct outputdef collector = {
+	.begin = &begin,
+	.output_status = &status,
+	.output_banner = &banner,
+	.end = &end,
+	.raw = 1,
+};
+
+const struct outputdef *scan_merge_collector(void)
+{
+	return &collector;
+}
+
+// returns 0 if a record was read, -2 if the source is exhausted
+static int source_next(struct source *s)
+{
+	if(!s->file) {
+		if(s->next == nrecords)
+			return -2;
+		const char *p = &arena[records[s->next++]];
+		memcpy(&s->h, p, sizeof(s->h));
+		memcpy(s->data, &p[sizeof(s->h)], s->h.size - sizeof(s->h));
+		return 0;
+	}
+
+	int ret = binary_read_record(&s->r, &s->h);
+	if(ret == 0 && s->h.size > sizeof(s->h))
+		ret = binary_read_record_data(&s->r, s->data);
+	return ret;
+}
+
+static inline bool heap_less(struct source **heap, int a, int b)
+{
+	return record_cmp(&heap[a]->h, &heap[b]->h) < 0;
+}
+
+static void heap_down(struct source **heap, int n, int i)
+{
+	while(1) {
+		int m = i, l = 2 * i + 1, r = 2 * i + 2;
+		if(l < n && heap_less(heap, l, m))
+			m = l;
+		if(r < n && heap_less(heap, r, m))
+			m = r;
+		if(m == i)
+			break;
+		struct source *tmp = heap[i];
+		heap[i] = heap[m];
+		heap[m] = tmp;
+		i = m;
+	}
+}
+
+static bool same_key(const struct rec_header *a, const struct rec_header *b)
+{
+	return !memcmp(a->addr, b->addr, 16) && a->proto_status >> 4 == b->proto_status >> 4 &&
+		a->port == b->port && (a->size > sizeof(*a)) == (b->size > sizeof(*b));
+}
+
+int scan_merge_finish(FILE *outfile, const struct outputdef *outdef)
+{
+	int ret = failed ? -1 : 0;
+	const int nsources = nruns + 1;
+	struct source *sources = calloc(nsources, sizeof(struct source));
+	struct source **heap = calloc(nsources, sizeof(struct source*));
+	if(!sources || !heap)
+		ret = -1;
+
+	// the last run doesn't need to be written out
+	if(ret == 0)
+		qsort(records, nrecords, sizeof(uint64_t), offset_cmp);
+
+	int n = 0;
+	for(int i = 0; i < nsources && ret == 0; i++) {
+		struct source *s = &sources[i];
+		s->data = malloc(UINT16_MAX);
+		if(!s->data) {
+			ret = -1;
+			break;
+		}
+		if(i < nruns) {
+			s->file = runs[i];
+			s->r.file = runs[i];
+			s->r.version = FILE_VERSION;
+			s->r.header_size = sizeof(struct rec_header);
+		}
+		int r = source_next(s);
+		if(r == 0)
+			heap[n++] = s;
+		else if(r == -1)
+			ret = -1;
+	}
+	for(int i = n / 2 - 1; i >= 0; i--)
+		heap_down(heap, n, i);
+
+	if(ret == 0)
+		outdef->begin(outfile);
+	struct rec_header last;
+	bool have_last = false;
+	while(n > 0 && ret == 0) {
+		struct source *s = heap[0];
+		if(have_last && same_key(&s->h, &last)) {
+			dropped++;
+		} else {
+			const int proto = s->h.proto_status >> 4;
+			if(s->h.size > sizeof(s->h)) {
+				outdef->output_banner(outfile, s->h.timestamp, s->h.addr, proto, s->h.port,
+					s->h.rtt, s->data, s->h.size - sizeof(s->h));
+			} else {
+				const int status = s->h.proto_status & 0xf;
+				outdef->output_status(outfile, s->h.timestamp, s->h.addr, proto, s->h.port,
+					status == OUTPUT_STATUS_ALIASED ? s->h.prefix_len : s->h.ttl, s->h.rtt, status);
+			}
+			last = s->h;
+			have_last = true;
+		}
+
+		int r = source_next(s);
+		if(r == -1) {
+			log_error("Failed to read temporary file");
+			ret = -1;
+		} else if(r == -2) {
+			heap[0] = heap[--n];
+		}
+		heap_down(heap, n, 0);
+	}
+	if(ret == 0) {
+		outdef->end(outfile);
+		log_raw("Merged %" PRIu64 " records using %d run(s), dropped %" PRIu64 " duplicates.",
+			total, nsources, dropped);
+	}
+
+	for(int i = 0; i < nruns; i++)
+		fclose(runs[i]);
+	if(sources) {
+		for(int i = 0; i < nsources; i++)
+			free(sources[i].data);
+	}
+	free(sources);
+	free(heap);
+	free(runs);
+	free(records);
+	free(arena);
+	runs = NULL;
+	records = NULL;
+	arena = NULL;
+	records_size = 0;
+	return ret;
+}
@@ -0,0 +1,287 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // usleep()
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "scan.h"
+#include "output.h"
+#include "util.h"
+
+/*
+ * Results are not written by the threads that produce them. Every producer
+ * thread gets its own single-producer ring buffer which the writer thread
+ * drains, so neither side ever takes a lock. The writer formats the records
+ * into a large stdio buffer, meaning the file sees few big write() calls
+ * under load. When idle the output is flushed so it still shows up promptly.
+ * Threads that don't get their own ring share one, guarded by a mutex.
+ */
+
+struct record {
+	uint32_t size; // incl. data and padding, 0 = continue at start of ring
+	uint8_t type;
+	uint8_t proto;
+	uint8_t ttl;
+	uint8_t status;
+	uint64_t ts;
+	uint8_t addr[16];
+	uint32_t rtt;
+	uint16_t port;
+	uint32_t len; // of banner following the record
+};
+
+enum {
+	RECORD_STATUS = 0,
+	RECORD_BANNER,
+};
+
+struct ring {
+	_Atomic size_t head; // only written by the writer thread
+	_Atomic size_t tail; // only written by the owning producer
+	char *buf;
+};
+
+#define RING_SIZE (1 << 22) // per producer
+#define MAX_PRODUCERS 8
+#define ALIGN8(x) ( ((x) + 7) & ~(size_t)7 )
+
+static FILE *outfile;
+static const struct outputdef *outdef;
+static char file_buffer[OUTPUT_BATCH_SIZE];
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings[MAX_PRODUCERS]; // [0] is the shared ring
+static atomic_int nrings;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct ring *own_ring;
+static _Thread_local bool own_ring_failed;
+
+static pthread_t writer;
+static atomic_bool stopping;
+static atomic_uint stalls;
+
+static void *writer_thread(void *unused);
+
+static struct ring *alloc_ring(void)
+{
+	struct ring *r = calloc(1, sizeof(struct ring));
+	if(r)
+		r->buf = malloc(RING_SIZE);
+	if(!r || !r->buf) {
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+int scan_output_init(FILE *_outfile, const struct outputdef *_outdef)
+{
+	outfile = _outfile;
+	outdef = _outdef;
+	// (only possible before anything was written, failure is harmless)
+	setvbuf(outfile, file_buffer, _IOFBF, sizeof(file_buffer));
+
+	rings[0] = alloc_ring();
+	if(!rings[0])
+		return -1;
+	atomic_store(&nrings, 1);
+	atomic_store(&stopping, false);
+	atomic_store(&stalls, 0);
+	if(pthread_create(&writer, NULL, writer_thread, NULL) < 0)
+		return -1;
+	return 0;
+}
+
+void scan_output_fini(void)
+{
+	atomic_store(&stopping, true);
+	pthread_join(writer, NULL);
+
+	for(int i = 0; i < atomic_load(&nrings); i++) {
+		free(rings[i]->buf);
+		free(rings[i]);
+		rings[i] = NULL;
+	}
+	atomic_store(&nrings, 0);
+
+	unsigned int n = atomic_load(&stalls);
+	if(n > 0)
+		log_warning("Output could not keep up, results were held back %u times", n);
+}
+
+static struct ring *get_ring(void)
+{
+	if(own_ring || own_ring_failed)
+		return own_ring;
+
+	struct ring *r = alloc_ring();
+	pthread_mutex_lock(&rings_lock);
+	int n = atomic_load(&nrings);
+	if(r && n < MAX_PRODUCERS) {
+		rings[n] = r;
+		atomic_store(&nrings, n + 1);
+	} else if(r) {
+		free(r->buf);
+		free(r);
+		r = NULL;
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	own_ring = r;
+	own_ring_failed = !r;
+	if(!r)
+		log_warning("Output buffer unavailable, using the shared one.");
+	return r;
+}
+
+static void push(struct ring *r, const struct record *rec, const void *data)
+{
+	const size_t need = ALIGN8(sizeof(struct record) + rec->len);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t off = tail & (RING_SIZE - 1);
+	size_t pad = off + need > RING_SIZE ? RING_SIZE - off : 0;
+
+	if(tail + pad + need - atomic_load_explicit(&r->head, memory_order_acquire) > RING_SIZE) {
+		// the writer can't keep up, nothing to do but wait
+		atomic_fetch_add(&stalls, 1);
+		do
+			usleep(100);
+		while(tail + pad + need - atomic_load_explicit(&r->head, memory_order_acquire) > RING_SIZE);
+	}
+
+	if(pad) {
+		const uint32_t wrap = 0;
+		memcpy(&r->buf[off], &wrap, sizeof(wrap));
+		tail += pad;
+		off = 0;
+	}
+	struct record tmp = *rec;
+	tmp.size = need;
+	memcpy(&r->buf[off], &tmp, sizeof(tmp));
+	if(rec->len > 0)
+		memcpy(&r->buf[off + sizeof(tmp)], data, rec->len);
+	atomic_store_explicit(&r->tail, tail + need, memory_order_release);
+}
+
+static void emit(const struct record *rec, const void *data)
+{
+	if(rec->type == RECORD_STATUS) {
+		outdef->output_status(outfile, rec->ts, rec->addr, rec->proto, rec->port,
+			rec->ttl, rec->rtt, rec->status);
+	} else {
+		outdef->output_banner(outfile, rec->ts, rec->addr, rec->proto, rec->port,
+			rec->rtt, data, rec->len);
+	}
+}
+
+static void submit(const struct record *rec, const void *data)
+{
+	struct ring *r = get_ring();
+	if(r) {
+		push(r, rec, data);
+	} else {
+		pthread_mutex_lock(&shared_lock);
+		push(rings[0], rec, data);
+		pthread_mutex_unlock(&shared_lock);
+	}
+}
+
+void scan_output_status(uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status)
+{
+	if(scan_dedup_seen(addr, PROBE_ID(proto, port) | (uint32_t) status << 24))
+		return;
+	if(!scan_diff_status(addr, proto, port, status))
+		return;
+	struct record rec = {
+		.type = RECORD_STATUS,
+		.proto = proto,
+		.ttl = ttl,
+		.status = status,
+		.ts = ts,
+		.rtt = rtt,
+		.port = port,
+		.len = 0,
+	};
+	memcpy(rec.addr, addr, 16);
+	submit(&rec, NULL);
+}
+
+void scan_output_banner(uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen)
+{
+	if(scan_dedup_seen(addr, PROBE_ID(proto, port) | UINT32_C(0xff) << 24))
+		return;
+	if(!scan_diff_banner(addr, proto, port, banner, bannerlen))
+		return;
+	struct record rec = {
+		.type = RECORD_BANNER,
+		.proto = proto,
+		.ts = ts,
+		.rtt = rtt,
+		.port = port,
+		.len = bannerlen,
+	};
+	memcpy(rec.addr, addr, 16);
+	submit(&rec, banner);
+}
+
+// returns number of records written
+static unsigned int drain(struct ring *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	unsigned int n = 0;
+
+	while(head != tail) {
+		size_t off = head & (RING_SIZE - 1);
+		struct record rec;
+		memcpy(&rec.size, &r->buf[off], sizeof(rec.size));
+		if(rec.size == 0) {
+			head += RING_SIZE - off;
+			continue;
+		}
+		memcpy(&rec, &r->buf[off], sizeof(rec));
+		emit(&rec, &r->buf[off + sizeof(rec)]);
+		head += rec.size;
+		atomic_store_explicit(&r->head, head, memory_order_release);
+		n++;
+	}
+	atomic_store_explicit(&r->head, head, memory_order_release);
+	return n;
+}
+
+static void *writer_thread(void *unused)
+{
+	bool dirty = false;
+
+	(void) unused;
+	set_thread_name("output");
+
+	while(1) {
+		// (producers are done before this is set, so one more pass suffices)
+		const bool stop = atomic_load(&stopping);
+		unsigned int n = 0;
+		for(int i = 0; i < atomic_load(&nrings); i++)
+			n += drain(rings[i]);
+		if(n > 0) {
+			dirty = true;
+			continue;
+		}
+
+		if(dirty) {
+			fflush(outfile);
+			dirty = false;
+		}
+		if(outdef->idle)
+			outdef->idle(outfile);
+		if(stop)
+			break;
+		usleep(1000);
+	}
+	return NULL;
+}
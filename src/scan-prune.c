@@ -0,0 +1,108 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "scan.h"
+#include "util.h"
+
+/*
+ * Set of prefixes that reported "no route" for one of our probes.
+ * Open addressing with linear probing, only the receive thread inserts.
+ * If the table fills up further prefixes are simply not remembered.
+ */
+
+static int prefix_len;
+static uint8_t prefix_mask[16];
+static uint64_t hash_seed;
+static _Atomic uint64_t *table; // 0 = unused
+
+static atomic_uint skipped, prefixes;
+
+#define TABLE_BITS 16
+#define MAX_PROBE 16
+
+static inline uint64_t prefix_key(const uint8_t *addr)
+{
+	uint64_t a, b, m;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	memcpy(&m, prefix_mask, 8);
+	a &= m;
+	memcpy(&m, &prefix_mask[8], 8);
+	b &= m;
+	uint64_t h = hash_seed ^ a;
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h ^= b;
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	h ^= h >> 33;
+	return h ? h : 1;
+}
+
+int scan_prune_init(int _prefix_len)
+{
+	prefix_len = _prefix_len;
+	memset(prefix_mask, 0, 16);
+	for(int i = 0; i < prefix_len; i++)
+		prefix_mask[i / 8] |= 0x80 >> (i % 8);
+	hash_seed = rand64();
+
+	table = calloc(1 << TABLE_BITS, sizeof(*table));
+	if(!table)
+		return -1;
+	atomic_store(&skipped, 0);
+	atomic_store(&prefixes, 0);
+	return 0;
+}
+
+void scan_prune_fini(void)
+{
+	free((void*) table);
+	table = NULL;
+}
+
+void scan_prune_add(const uint8_t *addr)
+{
+	uint64_t key = prefix_key(addr);
+	for(int i = 0; i < MAX_PROBE; i++) {
+		_Atomic uint64_t *slot = &table[(key + i) & ((1 << TABLE_BITS) - 1)];
+		uint64_t cur = atomic_load(slot);
+		if(cur == key)
+			return;
+		if(cur == 0) {
+			atomic_store(slot, key);
+			atomic_fetch_add(&prefixes, 1);
+			return;
+		}
+	}
+}
+
+bool scan_prune_contains(const uint8_t *addr)
+{
+	uint64_t key = prefix_key(addr);
+	for(int i = 0; i < MAX_PROBE; i++) {
+		uint64_t cur = atomic_load(&table[(key + i) & ((1 << TABLE_BITS) - 1)]);
+		if(cur == key)
+			return true;
+		if(cur == 0)
+			break;
+	}
+	return false;
+}
+
+bool scan_prune_check(const uint8_t *addr)
+{
+	if(!scan_prune_contains(addr))
+		return false;
+	atomic_fetch_add(&skipped, 1);
+	return true;
+}
+
+unsigned int scan_prune_stats(unsigned int *nprefixes)
+{
+	*nprefixes = atomic_load(&prefixes);
+	return atomic_load(&skipped);
+}
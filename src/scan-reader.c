@@ -2,9 +2,14 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // Copyright (C) 2016 sfan5 <sfan5@live.de>
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h> // sysconf()
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "scan.h"
 #include "util.h"
@@ -14,11 +19,21 @@
 #include "rawsock.h" // IP_TYPE_{TCP,UDP}
 
 static int show_closed, banners;
+static int threads, unordered;
+static int stats_prefix = -1;
+static bool stats_exact;
 //
 static FILE *outfile;
 static struct outputdef outdef;
 
 #define RECORD_MAX_DATA 65535 // must be >= BANNER_MAX_LENGTH
+#define MAX_THREADS 64
+#define UNITS_AHEAD 4 // per thread
+
+static int read_stream(struct reader *r);
+static int read_blocks(struct reader *r);
+static int read_mapped(struct reader *r);
+static void output_removed(const uint8_t *addr, int proto, uint16_t port);
 
 void scan_reader_set_general(int _show_closed, int _banners)
 {
@@ -26,6 +41,18 @@ void scan_reader_set_general(int _show_closed, int _banners)
 	banners = _banners;
 }
 
+void scan_reader_set_parallel(int _threads, int _unordered)
+{
+	threads = _threads;
+	unordered = _unordered;
+}
+
+void scan_reader_set_stats(int prefix_len, bool exact)
+{
+	stats_prefix = prefix_len;
+	stats_exact = exact;
+}
+
 void scan_reader_set_output(FILE *_outfile, const struct outputdef *_outdef)
 {
 	outfile = _outfile;
@@ -38,10 +65,80 @@ int scan_reader_main(FILE *infile)
 	if(binary_read_header(&r, infile) < 0)
 		return -1;
 
-	outdef.begin(outfile);
+	if(stats_prefix >= 0)
+		scan_stats_init(stats_prefix, stats_exact);
+	else
+		outdef.begin(outfile);
+	int ret;
+	if(binary_map(&r) == 0) {
+		ret = read_mapped(&r);
+		binary_unmap(&r);
+	} else {
+		ret = r.version < 3 ? read_stream(&r) : read_blocks(&r);
+	}
+	if(stats_prefix >= 0) {
+		if(ret == 0)
+			ret = scan_stats_print(outfile);
+		scan_stats_fini();
+	}
+	if(ret < 0)
+		return -1;
+	if(stats_prefix < 0) {
+		scan_diff_removed(&output_removed);
+		outdef.end(outfile);
+	}
+	return 0;
+}
+
+static void output_removed(const uint8_t *addr, int proto, uint16_t port)
+{
+	outdef.output_status(outfile, realtime_us(), addr, proto, port, 0, 0, OUTPUT_STATUS_CLOSED);
+}
+
+static int handle_record(FILE *f, const struct rec_header *h, const char *data)
+{
+	int proto = h->proto_status >> 4, status = h->proto_status & 0xf;
+
+	if(!scan_filter_record(h, data))
+		return 0;
+	if(stats_prefix >= 0)
+		return scan_stats_record(h);
+
+	if(h->size > sizeof(*h)) {
+		uint32_t data_length = h->size - sizeof(*h);
+		if(data_length > RECORD_MAX_DATA) {
+			log_error("Record has too much data (%" PRIu32 " > %d)", data_length, RECORD_MAX_DATA);
+			return -1;
+		}
+
+		if(!banners)
+			return 0;
+		if(!scan_diff_banner(h->addr, proto, h->port, data, data_length))
+			return 0;
+		if(!outdef.raw) {
+			// (data may be read-only)
+			char copy[RECORD_MAX_DATA];
+			memcpy(copy, data, data_length);
+			uint8_t ip_type = proto == OUTPUT_PROTO_TCP ? IP_TYPE_TCP : IP_TYPE_UDP;
+			banner_postprocess(ip_type, h->port, copy, &data_length);
+			outdef.output_banner(f, h->timestamp, h->addr, proto, h->port, h->rtt, copy, data_length);
+		} else {
+			outdef.output_banner(f, h->timestamp, h->addr, proto, h->port, h->rtt, data, data_length);
+		}
+	} else {
+		if((outdef.raw || show_closed || !output_status_negative(status)) &&
+			scan_diff_status(h->addr, proto, h->port, status))
+			outdef.output_status(f, h->timestamp, h->addr, proto, h->port,
+				status == OUTPUT_STATUS_ALIASED ? h->prefix_len : h->ttl, h->rtt, status);
+	}
+	return 0;
+}
+
+static int read_stream(struct reader *r)
+{
 	while(1) {
 		struct rec_header h;
-		int ret = binary_read_record(&r, &h);
+		int ret = binary_read_record(r, &h);
 		if(ret == -2)
 			break;
 		if(ret == -1) {
@@ -49,33 +146,303 @@ int scan_reader_main(FILE *infile)
 			return -1;
 		}
 
-		int proto = h.proto_status >> 4, status = h.proto_status & 0xf;
-
-		int has_data = h.size > sizeof(h);
-		if(has_data) {
-			uint32_t data_length = h.size - sizeof(h);
-			if(data_length > RECORD_MAX_DATA) {
-				log_error("Record has too much data (%" PRIu32 " > %d)", data_length, RECORD_MAX_DATA);
+		char data[RECORD_MAX_DATA];
+		if(h.size > sizeof(h)) {
+			if(h.size - sizeof(h) > RECORD_MAX_DATA) {
+				log_error("Record has too much data (%" PRIu32 " > %d)",
+					(uint32_t) (h.size - sizeof(h)), RECORD_MAX_DATA);
 				return -1;
 			}
-
-			char data[RECORD_MAX_DATA];
-			ret = binary_read_record_data(&r, data);
-			if(ret == -1)
+			if(binary_read_record_data(r, data) < 0)
 				return -1;
+		}
+		if(handle_record(outfile, &h, data) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// can the block contain anything that would be output?
+static bool wanted_block(const struct block_header *h)
+{
+	uint32_t kinds = 0;
+	for(int proto = 0; proto <= OUTPUT_PROTO_ICMP; proto++) {
+		for(int status = 0; status <= OUTPUT_STATUS_FILTERED; status++) {
+			if(outdef.raw || show_closed || stats_prefix >= 0 || !output_status_negative(status))
+				kinds |= BLOCK_KIND_STATUS(proto, status);
+		}
+		if(banners || stats_prefix >= 0)
+			kinds |= BLOCK_KIND_BANNER(proto);
+	}
+	return (h->kinds & kinds) && scan_filter_block(h);
+}
+
+static int handle_block(FILE *f, struct block *b)
+{
+	while(1) {
+		struct rec_header h;
+		const char *data;
+		int ret = binary_block_record(b, &h, &data);
+		if(ret == -2)
+			break;
+		if(ret == -1) {
+			log_error("Encountered invalid record header.");
+			return -1;
+		}
+		if(handle_record(f, &h, data) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * The input is split into units that are converted independently: blocks
+ * in version 3, ranges of about the same size in older versions. Several
+ * threads each format a unit into memory, the main thread writes the
+ * results out either in the original order or as they become ready.
+ * Threads can't run further ahead than a few units, which bounds memory use.
+ */
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_BUSY,
+	SLOT_DONE,
+	SLOT_FAILED,
+};
 
-			if(!banners)
-				continue;
-			if(!outdef.raw) {
-				uint8_t ip_type = proto == OUTPUT_PROTO_TCP ? IP_TYPE_TCP : IP_TYPE_UDP;
-				banner_postprocess(ip_type, h.port, data, &data_length);
+struct slot {
+	int state;
+	char *buf;
+	size_t len;
+};
+
+static struct {
+	struct reader *r;
+	const uint64_t *offsets; // version 3 only
+	uint32_t count, index; // version 3 only
+	uint64_t cursor; // version 1 and 2 only
+	uint32_t next; // units handed out so far
+	bool exhausted, failed, stop;
+	uint32_t window;
+	struct slot *slots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} work;
+
+// returns 0 if a unit was taken, -1 = error, -2 = none left
+static int take_unit(struct block *b, uint64_t *offset)
+{
+	if(work.exhausted)
+		return -2;
+	int ret;
+	if(work.offsets) {
+		ret = -2;
+		for(; work.index < work.count; work.index++) {
+			struct block_header h;
+			if(binary_block_info(work.r, work.offsets[work.index], &h) < 0) {
+				ret = -1;
+				break;
 			}
-			outdef.output_banner(outfile, h.timestamp, h.addr, proto, h.port, data, data_length);
+			if(wanted_block(&h)) {
+				*offset = work.offsets[work.index++];
+				ret = 0;
+				break;
+			}
+		}
+	} else {
+		ret = binary_next_range(work.r, &work.cursor, b);
+	}
+	if(ret == 0) {
+		work.next++;
+	} else {
+		work.exhausted = true;
+		work.failed |= ret == -1;
+	}
+	return ret;
+}
+
+static int convert_unit(FILE *f, struct block *b, uint64_t offset)
+{
+	int ret = 0;
+	if(work.offsets)
+		ret = binary_map_block(work.r, offset, b);
+	if(ret == 0)
+		ret = handle_block(f, b);
+	binary_free_block(b);
+	return ret;
+}
+
+static void *worker_thread(void *unused)
+{
+	(void) unused;
+	set_thread_name("reader");
+
+	while(1) {
+		struct block b = {0};
+		uint64_t offset = 0;
+
+		pthread_mutex_lock(&work.lock);
+		if(work.stop || take_unit(&b, &offset) < 0) {
+			pthread_cond_broadcast(&work.cond);
+			pthread_mutex_unlock(&work.lock);
+			break;
+		}
+		struct slot *s = &work.slots[(work.next - 1) % work.window];
+		while(s->state != SLOT_FREE && !work.stop)
+			pthread_cond_wait(&work.cond, &work.lock);
+		if(work.stop) {
+			pthread_mutex_unlock(&work.lock);
+			break;
+		}
+		s->state = SLOT_BUSY;
+		pthread_mutex_unlock(&work.lock);
+
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&buf, &len);
+		int ret = f ? convert_unit(f, &b, offset) : -1;
+		if(f)
+			fclose(f);
+
+		pthread_mutex_lock(&work.lock);
+		s->state = ret < 0 ? SLOT_FAILED : SLOT_DONE;
+		s->buf = buf;
+		s->len = len;
+		pthread_cond_broadcast(&work.cond);
+		pthread_mutex_unlock(&work.lock);
+	}
+	return NULL;
+}
+
+// (called with lock held) returns slot to write next or NULL if finished
+static struct slot *wait_result(uint32_t written)
+{
+	while(1) {
+		if(!unordered) {
+			struct slot *s = &work.slots[written % work.window];
+			if(s->state >= SLOT_DONE)
+				return s;
 		} else {
-			if(outdef.raw || show_closed || status != OUTPUT_STATUS_CLOSED)
-				outdef.output_status(outfile, h.timestamp, h.addr, proto, h.port, h.ttl, status);
+			for(uint32_t i = 0; i < work.window; i++) {
+				if(work.slots[i].state >= SLOT_DONE)
+					return &work.slots[i];
+			}
 		}
+		if(work.exhausted && written == work.next)
+			return NULL;
+		pthread_cond_wait(&work.cond, &work.lock);
 	}
-	outdef.end(outfile);
-	return 0;
+}
+
+static int convert_parallel(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	int ret = 0;
+
+	work.window = nthreads * UNITS_AHEAD;
+	work.slots = calloc(work.window, sizeof(struct slot));
+	if(!work.slots)
+		return -1;
+	pthread_mutex_init(&work.lock, NULL);
+	pthread_cond_init(&work.cond, NULL);
+
+	int started = 0;
+	for(; started < nthreads; started++) {
+		if(pthread_create(&threads[started], NULL, worker_thread, NULL) != 0)
+			break;
+	}
+	if(started == 0)
+		ret = -1;
+
+	for(uint32_t written = 0; ret == 0; written++) {
+		pthread_mutex_lock(&work.lock);
+		struct slot *s = wait_result(written);
+		struct slot done;
+		if(s) {
+			done = *s;
+			memset(s, 0, sizeof(*s));
+			pthread_cond_broadcast(&work.cond);
+		}
+		pthread_mutex_unlock(&work.lock);
+		if(!s)
+			break;
+
+		if(done.state == SLOT_FAILED)
+			ret = -1;
+		else
+			fwrite(done.buf, done.len, 1, outfile);
+		free(done.buf);
+	}
+
+	pthread_mutex_lock(&work.lock);
+	work.stop = true;
+	pthread_cond_broadcast(&work.cond);
+	pthread_mutex_unlock(&work.lock);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for(uint32_t i = 0; i < work.window; i++)
+		free(work.slots[i].buf);
+	free(work.slots);
+	pthread_mutex_destroy(&work.lock);
+	pthread_cond_destroy(&work.cond);
+	return ret;
+}
+
+static int convert_sequential(void)
+{
+	while(1) {
+		struct block b = {0};
+		uint64_t offset = 0;
+		int ret = take_unit(&b, &offset);
+		if(ret == -2)
+			return 0;
+		if(ret == 0)
+			ret = convert_unit(outfile, &b, offset);
+		if(ret < 0)
+			return -1;
+	}
+}
+
+static int read_mapped(struct reader *r)
+{
+	memset(&work, 0, sizeof(work));
+	work.r = r;
+	if(r->version >= 3) {
+		uint64_t *offsets;
+		if(binary_read_index(r, &offsets, &work.count) < 0)
+			return -1;
+		work.offsets = offsets;
+	}
+
+	long nthreads = threads > 0 ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if(work.offsets && nthreads > work.count)
+		nthreads = work.count;
+	// (binary output keeps state between records, so can't be split)
+	int ret;
+	if(nthreads > 1 && (!outdef.raw || stats_prefix >= 0))
+		ret = convert_parallel(nthreads);
+	else
+		ret = convert_sequential();
+	if(work.failed)
+		ret = -1;
+
+	free((void*) work.offsets);
+	return ret;
+}
+
+static int read_blocks(struct reader *r)
+{
+	// not a regular file, go through it sequentially
+	struct block b;
+	int ret;
+	while((ret = binary_read_block(r, &b)) == 0) {
+		ret = wanted_block(&b.h) ? handle_block(outfile, &b) : 0;
+		binary_free_block(&b);
+		if(ret < 0)
+			break;
+	}
+	return ret == -2 ? 0 : -1;
 }
@@ -9,6 +9,9 @@
 #include <unistd.h> // usleep()
 #include <stdatomic.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 
 #include "scan.h"
 #include "rawsock.h"
@@ -24,21 +27,30 @@ enum {
 
 static struct {
 	/* TODO: better sharing of these vars with scan.c */
-	FILE *outfile;
 	const struct outputdef *outdef;
 	uint16_t source_port;
 	uint32_t scan_randomness;
+	unsigned int banner_max, max_sessions;
+	bool throttled; // only touched by send thread
 
-	uint8_t _Alignas(uint32_t) buffer[TCP_SZ + BANNER_QUERY_MAX_LENGTH];
+	uint8_t _Alignas(uint32_t) buffer[TCP_SZ + TCP_OPTION_TIMESTAMP_SIZE + BANNER_QUERY_MAX_LENGTH];
 
 	pthread_t tcp_thread;
 	atomic_bool tcp_thread_exit;
 	atomic_uint pkts_sent;
+	atomic_uint sessions_shed, sessions_shed_total;
 } responder;
 
 static void *tcp_thread(void *unused);
-
-int scan_responder_init(FILE *outfile, const struct outputdef *outdef, uint16_t source_port, uint32_t scan_randomness)
+static int tick_init(int interval_ms);
+static void tick_wait(int fd, int interval_ms);
+static bool decode_timestamp(const uint8_t *rpacket, int len, uint32_t *tsval, uint32_t *tsecr);
+static unsigned int set_options(uint8_t *spacket, bool have_ts, uint64_t ts, uint32_t tsval);
+static void set_window(uint8_t *spacket, uint32_t have);
+static void send_delayed_ack(tcp_state_ptr *p, uint8_t *packet);
+static void cancel_delayed_ack(tcp_state_ptr *p);
+
+int scan_responder_init(const struct outputdef *outdef, uint16_t source_port, uint32_t scan_randomness, unsigned int banner_max, unsigned int max_sessions)
 {
 	uint8_t *spacket = responder.buffer;
 
@@ -46,16 +58,20 @@ int scan_responder_init(FILE *outfile, const struct outputdef *outdef, uint16_t
 	rawsock_ip_prepare(IP_FRAME(spacket), IP_TYPE_TCP);
 	tcp_prepare(TCP_HEADER(spacket));
 
-	responder.outfile = outfile;
 	responder.outdef = outdef;
 	responder.source_port = source_port;
 	responder.scan_randomness = scan_randomness;
+	responder.banner_max = banner_max;
+	responder.max_sessions = max_sessions;
+	responder.throttled = false;
 
-	if(tcp_state_init() < 0)
+	if(tcp_state_init(banner_max, max_sessions) < 0)
 		return -1;
 
 	atomic_store(&responder.tcp_thread_exit, false);
 	atomic_store(&responder.pkts_sent, 0);
+	atomic_store(&responder.sessions_shed, 0);
+	atomic_store(&responder.sessions_shed_total, 0);
 	if(pthread_create(&responder.tcp_thread, NULL, tcp_thread, NULL) < 0)
 		return -1;
 
@@ -68,10 +84,10 @@ int scan_responder_init(FILE *outfile, const struct outputdef *outdef, uint16_t
 #define tcp_debug(...) do {} while(0)
 #endif
 
-// plen: bytes after TCP header
+// plen: bytes after TCP header and options
 #define SEND_PKT(packet_, plen) do { \
 	tcp_checksum(IP_FRAME(packet_), TCP_HEADER(packet_), plen); \
-	rawsock_send(packet_, TCP_SZ + plen); \
+	rawsock_send(packet_, IP_SZ + (TCP_HEADER(packet_)->offset << 2) + plen); \
 	atomic_fetch_add(&responder.pkts_sent, 1); \
 	} while(0)
 
@@ -81,10 +97,13 @@ void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket)
 	const uint8_t *rsrcaddr;
 	int rport;
 	uint32_t rseqnum, acknum;
+	uint32_t tsval, tsecr;
 	tcp_state_ptr p;
 
 	rawsock_ip_decode(IP_FRAME(rpacket), NULL, NULL, NULL, &rsrcaddr, NULL);
 	tcp_decode(TCP_HEADER(rpacket), &rport, NULL);
+	// if the remote uses timestamps we need to include them too
+	const bool have_ts = decode_timestamp(rpacket, len, &tsval, &tsecr);
 
 	unsigned int data_offset;
 	tcp_decode_header(TCP_HEADER(rpacket), &data_offset);
@@ -99,23 +118,75 @@ void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket)
 			goto send_rst;
 
 		// push data into session buffer
-		tcp_state_push(&p, TCP_DATA(rpacket, data_offset), plen, rseqnum);
+		uint32_t ack;
+		uint32_t have = tcp_state_push(&p, TCP_DATA(rpacket, data_offset), plen, rseqnum, &ack);
 
-		const int x = TCP_HEADER(rpacket)->f_fin ? 1 : 0; // TODO: read RFC to find out what's up with this
+		// the FIN can only be accepted once everything before it has arrived
+		const int x = (TCP_HEADER(rpacket)->f_fin && ack == rseqnum + plen) ? 1 : 0;
 		uint32_t lseqnum = tcp_state_add_seqnum(&p, x);
 		if(x)
 			tcp_state_set_fin(&p);
 
+		// if the response is complete let the tcp thread handle it right away
+		uint32_t total;
+		const char *buf = tcp_state_get_buffer(&p, &total);
+
+		// some services need another query before they reveal anything useful
+		if(!x && ack == rseqnum + plen) {
+			int step = tcp_state_get_step(&p);
+			unsigned int qlen;
+			const char *query = banner_get_followup(IP_TYPE_TCP, rport, &step,
+				buf, have, &qlen);
+			if(query) {
+				tcp_state_set_step(&p, step);
+				tcp_state_add_seqnum(&p, qlen);
+				cancel_delayed_ack(&p);
+				tcp_state_unlock(&p);
+
+				unsigned int optlen = set_options(spacket, have_ts, ts, tsval);
+				rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE + optlen + qlen, rsrcaddr);
+				tcp_make_ack(TCP_HEADER(spacket), lseqnum, ack);
+				set_window(spacket, have);
+				TCP_HEADER(spacket)->f_psh = 1;
+				tcp_modify(TCP_HEADER(spacket), responder.source_port, rport);
+				memcpy(TCP_DATA(spacket, TCP_HEADER_SIZE + optlen), query, qlen);
+
+				SEND_PKT(spacket, qlen);
+				tcp_debug("> ack+psh seq=%08x ack=%08x (step %d)", lseqnum, ack, step);
+				return;
+			}
+		}
+
+		const bool complete = x || have >= responder.banner_max ||
+			banner_complete(IP_TYPE_TCP, rport, buf, have);
+		if(complete)
+			tcp_state_set_timeout(&p, 0);
+
+		// ACK right away if something is missing (so the remote retransmits)
+		// or with a FIN, otherwise ACK every few segments or after a delay.
+		// A complete response isn't acknowledged since it's about to be reset.
+		bool send_now = x || ack != rseqnum + plen;
+		if(!send_now && !complete) {
+			int segments = tcp_state_delay_ack(&p, ack, have_ts, tsval, BANNER_ACK_DELAY);
+			send_now = segments >= BANNER_ACK_EVERY;
+		}
+		if(send_now || complete)
+			cancel_delayed_ack(&p);
+
 		tcp_state_unlock(&p);
+		if(!send_now)
+			return;
 
-		// send ack(+fin)
-		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE, rsrcaddr);
-		tcp_make_ack(TCP_HEADER(spacket), lseqnum, rseqnum + plen + x);
-		TCP_HEADER(spacket)->f_fin = TCP_HEADER(rpacket)->f_fin;
+		// send ack(+fin), cumulative so that the remote retransmits what's missing
+		unsigned int optlen = set_options(spacket, have_ts, ts, tsval);
+		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE + optlen, rsrcaddr);
+		tcp_make_ack(TCP_HEADER(spacket), lseqnum, ack + x);
+		set_window(spacket, have);
+		TCP_HEADER(spacket)->f_fin = x;
 		tcp_modify(TCP_HEADER(spacket), responder.source_port, rport);
 
 		tcp_debug("> ack%s seq=%08x ack=%08x",
-			TCP_HEADER(spacket)->f_fin?"+fin":"", lseqnum, rseqnum + plen + x);
+			TCP_HEADER(spacket)->f_fin?"+fin":"", lseqnum, ack + x);
 		SEND_PKT(spacket, 0);
 	// FIN packet (no data)
 	} else if(TCP_HEADER(rpacket)->f_fin) {
@@ -125,20 +196,30 @@ void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket)
 		if(!tcp_state_find(rsrcaddr, rport, &p))
 			goto send_rst;
 
-		const int x = 1; // TODO: read RFC to find out what's up with this
+		uint32_t ack;
+		uint32_t have = tcp_state_push(&p, NULL, 0, rseqnum, &ack);
+		cancel_delayed_ack(&p);
+		// the FIN can only be accepted once everything before it has arrived
+		const int x = (ack == rseqnum) ? 1 : 0;
 		uint32_t lseqnum = tcp_state_add_seqnum(&p, x);
-		tcp_state_set_fin(&p);
+		if(x) {
+			tcp_state_set_fin(&p);
+			// the remote won't send anything more
+			tcp_state_set_timeout(&p, 0);
+		}
 
 		tcp_state_unlock(&p);
 
 		// send ack+fin
-		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE, rsrcaddr);
-		tcp_make_ack(TCP_HEADER(spacket), lseqnum, rseqnum + x);
-		TCP_HEADER(spacket)->f_fin = 1;
+		unsigned int optlen = set_options(spacket, have_ts, ts, tsval);
+		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE + optlen, rsrcaddr);
+		tcp_make_ack(TCP_HEADER(spacket), lseqnum, ack + x);
+		set_window(spacket, have);
+		TCP_HEADER(spacket)->f_fin = x;
 		tcp_modify(TCP_HEADER(spacket), responder.source_port, rport);
 
-		tcp_debug("> ack+fin seq=%08x ack=%08x",
-			lseqnum, rseqnum + x);
+		tcp_debug("> ack%s seq=%08x ack=%08x",
+			x?"+fin":"", lseqnum, ack + x);
 		SEND_PKT(spacket, 0);
 	// ACK packet (no data)
 	} else if(TCP_HEADER(rpacket)->f_ack) {
@@ -157,8 +238,18 @@ void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket)
 
 		unsigned int plen;
 		const char *payload = banner_get_query(IP_TYPE_TCP, rport, &plen);
+		// register as new tcp session
+		if(payload) {
+			uint32_t rtt = have_ts ? scan_rtt(ts, tsecr) : 0;
+			if(tcp_state_create(rsrcaddr, rport, ts, rtt, lseqnum + plen, rseqnum - 1, BANNER_TIMEOUT) < 0) {
+				atomic_fetch_add(&responder.sessions_shed, 1);
+				atomic_fetch_add(&responder.sessions_shed_total, 1);
+				payload = NULL; // table is full
+			}
+		}
 		if(!payload) {
-			// we don't actually want to grab a banner, send an RST
+			// we don't actually want to (or can't) grab a banner, send an RST
+			set_options(spacket, false, 0, 0);
 			rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE, rsrcaddr);
 			tcp_make_ack(TCP_HEADER(spacket), lseqnum, rseqnum);
 			TCP_HEADER(spacket)->f_rst = 1;
@@ -170,19 +261,17 @@ void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket)
 		}
 
 		// send ack(+psh) with banner query
-		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE + plen, rsrcaddr);
+		unsigned int optlen = set_options(spacket, have_ts, ts, tsval);
+		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE + optlen + plen, rsrcaddr);
 		tcp_make_ack(TCP_HEADER(spacket), lseqnum, rseqnum);
+		set_window(spacket, 0);
 		TCP_HEADER(spacket)->f_psh = (plen > 0);
 		tcp_modify(TCP_HEADER(spacket), responder.source_port, rport);
-		memcpy(TCP_DATA(spacket, TCP_HEADER_SIZE), payload, plen);
+		memcpy(TCP_DATA(spacket, TCP_HEADER_SIZE + optlen), payload, plen);
 
 		SEND_PKT(spacket, plen);
 		tcp_debug("> ack%s seq=%08x ack=%08x",
 			TCP_HEADER(spacket)->f_psh?"+psh":"", lseqnum, rseqnum);
-
-		// register as new tcp session
-		lseqnum += plen;
-		tcp_state_create(rsrcaddr, rport, ts, lseqnum, rseqnum - 1);
 	}
 
 	return;
@@ -192,6 +281,7 @@ void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket)
 		uint32_t lseqnum = acknum;
 
 		// send rst
+		set_options(spacket, false, 0, 0);
 		rawsock_ip_modify(IP_FRAME(spacket), TCP_HEADER_SIZE, rsrcaddr);
 		tcp_make_ack(TCP_HEADER(spacket), lseqnum, rseqnum);
 		TCP_HEADER(spacket)->f_rst = 1;
@@ -210,28 +300,42 @@ static void *tcp_thread(void *unused)
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	set_thread_name("tcp");
 
-	uint8_t _Alignas(uint32_t) packet[TCP_SZ];
+	uint8_t _Alignas(uint32_t) packet[TCP_SZ + TCP_OPTION_TIMESTAMP_SIZE];
 	// Copy the prepared structure from the "global" packet buffer
 	memcpy(packet, responder.buffer, TCP_SZ);
+	// postprocessing needs a full size buffer
+	char temp[BANNER_MAX_LENGTH];
 
+	int tfd = tick_init(BANNER_TICK);
 	do {
-		usleep(BANNER_TIMEOUT * 1000 / 2);
+		tick_wait(tfd, BANNER_TICK);
 
 		tcp_state_ptr p;
-		while(tcp_state_next_expired(BANNER_TIMEOUT, &p)) {
+		int r;
+		while((r = tcp_state_next_expired(&p))) {
+			if(r == TCP_STATE_ACK_DUE) {
+				send_delayed_ack(&p, packet);
+				tcp_state_unlock(&p);
+				continue;
+			}
+
 			uint32_t len;
-			void *buf = tcp_state_get_buffer(&p, &len);
+			const void *buf = tcp_state_get_buffer(&p, &len);
 			uint64_t ts;
+			uint32_t rtt;
 			int have_fin;
-			tcp_state_get_misc(&p, &ts, &have_fin);
+			tcp_state_get_misc(&p, &ts, &rtt, &have_fin);
 			uint16_t srcport;
 			const uint8_t *srcaddr = tcp_state_get_remote(&p, &srcport);
 
 			if(len > 0) {
 				// output banner to file
-				if(!responder.outdef->raw)
-					banner_postprocess(IP_TYPE_TCP, srcport, buf, &len);
-				responder.outdef->output_banner(responder.outfile, ts, srcaddr, OUTPUT_PROTO_TCP, srcport, buf, len);
+				if(!responder.outdef->raw) {
+					memcpy(temp, buf, len);
+					banner_postprocess(IP_TYPE_TCP, srcport, temp, &len);
+					buf = temp;
+				}
+				scan_output_banner(ts, srcaddr, OUTPUT_PROTO_TCP, srcport, rtt, buf, len);
 			}
 
 			// terminate connection if needed
@@ -239,6 +343,7 @@ static void *tcp_thread(void *unused)
 				uint32_t lseqnum = tcp_state_add_seqnum(&p, 0);
 
 				// send rst
+				set_options(packet, false, 0, 0);
 				rawsock_ip_modify(IP_FRAME(packet), TCP_HEADER_SIZE, srcaddr);
 				tcp_make_rst(TCP_HEADER(packet), lseqnum);
 				tcp_modify(TCP_HEADER(packet), responder.source_port, srcport);
@@ -251,12 +356,115 @@ static void *tcp_thread(void *unused)
 			tcp_state_delete(&p);
 		}
 	} while(!atomic_load(&responder.tcp_thread_exit));
+	if(tfd != -1)
+		close(tfd);
 	return NULL;
 }
 
-void scan_responder_stats(unsigned int *pkts_sent)
+static void send_delayed_ack(tcp_state_ptr *p, uint8_t *packet)
+{
+	uint32_t acknum, tsval;
+	int have_ts;
+	if(!tcp_state_take_ack(p, &acknum, &have_ts, &tsval))
+		return;
+	uint32_t lseqnum = tcp_state_add_seqnum(p, 0);
+	uint32_t have;
+	tcp_state_get_buffer(p, &have);
+	uint16_t srcport;
+	const uint8_t *srcaddr = tcp_state_get_remote(p, &srcport);
+
+	unsigned int optlen = set_options(packet, have_ts, realtime_us(), tsval);
+	rawsock_ip_modify(IP_FRAME(packet), TCP_HEADER_SIZE + optlen, srcaddr);
+	tcp_make_ack(TCP_HEADER(packet), lseqnum, acknum);
+	set_window(packet, have);
+	tcp_modify(TCP_HEADER(packet), responder.source_port, srcport);
+
+	SEND_PKT(packet, 0);
+	tcp_debug("> delayed ack seq=%08x ack=%08x", lseqnum, acknum);
+}
+
+static void cancel_delayed_ack(tcp_state_ptr *p)
+{
+	uint32_t acknum, tsval;
+	int have_ts;
+	tcp_state_take_ack(p, &acknum, &have_ts, &tsval);
+}
+
+static int tick_init(int interval_ms)
+{
+#ifdef __linux__
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(fd == -1)
+		return -1;
+	struct itimerspec its = {0};
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(fd, 0, &its, NULL) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	(void) interval_ms;
+	return -1;
+#endif
+}
+
+static void tick_wait(int fd, int interval_ms)
+{
+	uint64_t expirations;
+	// a timerfd doesn't drift like repeated sleeps do
+	if(fd == -1 || read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		usleep(interval_ms * 1000);
+}
+
+static bool decode_timestamp(const uint8_t *rpacket, int len, uint32_t *tsval, uint32_t *tsecr)
+{
+	unsigned int data_offset;
+	tcp_decode_header(TCP_HEADER(rpacket), &data_offset);
+	if(len < IP_SZ + data_offset)
+		return false;
+	return tcp_decode_timestamp(TCP_HEADER(rpacket), tsval, tsecr) == 1;
+}
+
+// advertise the space left in the banner buffer
+static void set_window(uint8_t *spacket, uint32_t have)
+{
+	tcp_set_window(TCP_HEADER(spacket), have < responder.banner_max ? responder.banner_max - have : 0);
+}
+
+// returns length of options written
+static unsigned int set_options(uint8_t *spacket, bool have_ts, uint64_t ts, uint32_t tsval)
+{
+	if(!have_ts) {
+		tcp_set_options(TCP_HEADER(spacket), 0);
+		return 0;
+	}
+	// our clock is the capture timestamp, same as in the initial SYN
+	tcp_option_timestamp(TCP_HEADER(spacket), 0, (uint32_t) ts, tsval);
+	tcp_set_options(TCP_HEADER(spacket), TCP_OPTION_TIMESTAMP_SIZE);
+	return TCP_OPTION_TIMESTAMP_SIZE;
+}
+
+void scan_responder_stats(unsigned int *pkts_sent, unsigned int *sessions_shed)
 {
 	*pkts_sent = atomic_exchange(&responder.pkts_sent, 0);
+	*sessions_shed = atomic_exchange(&responder.sessions_shed, 0);
+}
+
+bool scan_responder_throttle(void)
+{
+	if(!responder.max_sessions)
+		return false;
+	// hysteresis so that the sender doesn't flap
+	const unsigned int count = tcp_state_count();
+	const unsigned int max = responder.max_sessions;
+	if(!responder.throttled && count >= max - max / 10)
+		responder.throttled = true;
+	else if(responder.throttled && count < max - max / 4)
+		responder.throttled = false;
+	return responder.throttled;
 }
 
 void scan_responder_finish()
@@ -264,5 +472,8 @@ void scan_responder_finish()
 	atomic_store(&responder.tcp_thread_exit, true);
 	pthread_join(responder.tcp_thread, NULL);
 
+	unsigned int shed = atomic_load(&responder.sessions_shed_total);
+	if(shed > 0)
+		log_warning("%u TCP sessions were dropped because the session table was full", shed);
 	tcp_state_fini();
 }
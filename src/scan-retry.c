@@ -0,0 +1,172 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "scan.h"
+#include "util.h"
+
+/*
+ * Probes are kept in a FIFO ordered by their retransmission deadline. Since
+ * every probe waits the same interval, appending keeps the queue sorted, so
+ * it serves as a timing wheel with a single spoke.
+ * Replies are recorded in a hashed bitmap: the bit of a probe is cleared when
+ * it is first sent and set by the receive thread when an answer arrives.
+ * A collision can cause a lost probe not to be retried (or an answered one
+ * to be retried), the bitmap is sized so that this stays rare.
+ */
+
+struct retry_entry {
+	uint8_t addr[16];
+	uint32_t probe;
+	uint8_t tries;
+	uint32_t deadline; // ms
+};
+
+static unsigned int retries, interval;
+
+// only accessed by the send thread
+static struct retry_entry *queue;
+static size_t queue_size, queue_head, queue_tail; // size is a power of two
+
+static atomic_uint *answered;
+static uint32_t answered_mask; // in bits
+static uint64_t hash_seed;
+
+static atomic_uint retransmitted;
+
+#define BITMAP_MIN_BITS 16
+#define BITMAP_MAX_BITS 30
+#define BITMAP_DEFAULT_BITS 27 // for unlimited rate
+#define BITMAP_OVERSIZE 64 // bits per outstanding probe
+
+static inline uint32_t probe_hash(const uint8_t *addr, uint32_t probe)
+{
+	uint64_t a, b;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	uint64_t h = hash_seed ^ a;
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h ^= b + probe;
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	return (h ^ (h >> 33)) & answered_mask;
+}
+
+static inline bool deadline_passed(uint32_t deadline, uint32_t now)
+{
+	return (int32_t)(now - deadline) >= 0;
+}
+
+int scan_retry_init(unsigned int _retries, unsigned int interval_ms, unsigned int max_rate)
+{
+	retries = _retries;
+	interval = interval_ms;
+
+	int bits = BITMAP_DEFAULT_BITS;
+	if(max_rate != 0) {
+		uint64_t outstanding = (uint64_t)max_rate * interval_ms / 1000 * (retries + 1);
+		bits = BITMAP_MIN_BITS;
+		while(bits < BITMAP_MAX_BITS && (UINT64_C(1) << bits) < outstanding * BITMAP_OVERSIZE)
+			bits++;
+	}
+	answered_mask = (UINT32_C(1) << bits) - 1;
+	answered = calloc(UINT64_C(1) << (bits - 5), sizeof(atomic_uint));
+	if(!answered)
+		return -1;
+	log_debug("retry bitmap: 2^%d bits", bits);
+
+	queue_size = 4096;
+	queue_head = queue_tail = 0;
+	queue = malloc(queue_size * sizeof(struct retry_entry));
+	if(!queue) {
+		free(answered);
+		return -1;
+	}
+
+	hash_seed = rand64();
+	atomic_store(&retransmitted, 0);
+	return 0;
+}
+
+void scan_retry_fini(void)
+{
+	free(queue);
+	free((void*) answered);
+	queue = NULL;
+	answered = NULL;
+}
+
+static int queue_push(const uint8_t *addr, uint32_t probe, uint8_t tries, uint32_t deadline)
+{
+	if(queue_tail - queue_head == queue_size) {
+		struct retry_entry *n = malloc(queue_size * 2 * sizeof(struct retry_entry));
+		if(!n)
+			return -1;
+		for(size_t i = queue_head; i != queue_tail; i++)
+			n[i - queue_head] = queue[i & (queue_size - 1)];
+		free(queue);
+		queue = n;
+		queue_tail -= queue_head;
+		queue_head = 0;
+		queue_size *= 2;
+	}
+
+	struct retry_entry *e = &queue[queue_tail & (queue_size - 1)];
+	memcpy(e->addr, addr, 16);
+	e->probe = probe;
+	e->tries = tries;
+	e->deadline = deadline;
+	queue_tail++;
+	return 0;
+}
+
+int scan_retry_add(const uint8_t *addr, uint32_t probe)
+{
+	uint32_t h = probe_hash(addr, probe);
+	atomic_fetch_and(&answered[h >> 5], ~(1U << (h & 31)));
+	return queue_push(addr, probe, 0, (uint32_t) monotonic_ms() + interval);
+}
+
+bool scan_retry_answered(const uint8_t *addr, uint32_t probe)
+{
+	uint32_t h = probe_hash(addr, probe);
+	return !(atomic_fetch_or(&answered[h >> 5], 1U << (h & 31)) & (1U << (h & 31)));
+}
+
+int scan_retry_next(uint8_t *addr, uint32_t *probe)
+{
+	uint32_t now = monotonic_ms();
+	while(queue_head != queue_tail) {
+		struct retry_entry *e = &queue[queue_head & (queue_size - 1)];
+		if(!deadline_passed(e->deadline, now))
+			return 0;
+
+		queue_head++;
+		uint32_t h = probe_hash(e->addr, e->probe);
+		if(atomic_load(&answered[h >> 5]) & (1U << (h & 31)))
+			continue;
+
+		memcpy(addr, e->addr, 16);
+		*probe = e->probe;
+		if(e->tries + 1 < retries) {
+			// can't fail: an entry was just removed
+			queue_push(addr, *probe, e->tries + 1, now + interval);
+		}
+		atomic_fetch_add(&retransmitted, 1);
+		return 1;
+	}
+	return 0;
+}
+
+bool scan_retry_pending(void)
+{
+	return queue_head != queue_tail;
+}
+
+unsigned int scan_retry_stats(void)
+{
+	return atomic_load(&retransmitted);
+}
@@ -0,0 +1,378 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "scan.h"
+#include "util.h"
+#include "output.h"
+#include "binary.h"
+#include "banner.h"
+
+/*
+ * Aggregate statistics over a binary scan, computed straight from the record
+ * headers. Every thread counts into its own set of tables, these are merged
+ * once at the end.
+ * Unique hosts are either counted exactly with a hash set, or estimated
+ * with a HyperLogLog sketch that takes a fixed 16 KiB per thread.
+ */
+
+#define NPROTOS (OUTPUT_PROTO_ICMP + 1)
+#define NSTATUSES (OUTPUT_STATUS_FILTERED + 1)
+#define MAX_SERVICES 64
+#define HLL_BITS 14
+#define HLL_SIZE (1 << HLL_BITS)
+
+// open addressing, keys are addresses
+struct addr_table {
+	uint8_t (*keys)[16];
+	uint64_t *values;
+	uint8_t *used;
+	size_t size, count; // size is a power of two
+};
+
+struct stats {
+	struct stats *next;
+	uint64_t records;
+	uint64_t status[NPROTOS][NSTATUSES];
+	uint64_t banners[NPROTOS];
+	uint64_t ports[2][65536]; // open, TCP and UDP only
+	struct addr_table prefixes; // positive results per prefix
+	struct addr_table hosts; // exact mode
+	uint8_t hll[HLL_SIZE]; // estimate mode
+	struct { const char *name; uint64_t count; } services[MAX_SERVICES];
+	int nservices;
+};
+
+static int prefix_len;
+static uint8_t prefix_mask[16];
+static bool exact;
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats *list;
+static _Thread_local struct stats *own;
+static _Thread_local bool own_failed;
+
+static inline uint64_t mix(uint64_t h)
+{
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	return h ^ (h >> 33);
+}
+
+static inline uint64_t addr_hash(const uint8_t *addr)
+{
+	uint64_t a, b;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	return mix(mix(a) ^ b);
+}
+
+static int table_grow(struct addr_table *t)
+{
+	struct addr_table n;
+	n.size = t->size ? t->size * 2 : 1024;
+	n.count = 0;
+	n.keys = malloc(n.size * 16);
+	n.values = malloc(n.size * sizeof(uint64_t));
+	n.used = calloc(n.size, 1);
+	if(!n.keys || !n.values || !n.used) {
+		free(n.keys);
+		free(n.values);
+		free(n.used);
+		return -1;
+	}
+	for(size_t i = 0; i < t->size; i++) {
+		if(!t->used[i])
+			continue;
+		size_t j = addr_hash(t->keys[i]) & (n.size - 1);
+		while(n.used[j])
+			j = (j + 1) & (n.size - 1);
+		memcpy(n.keys[j], t->keys[i], 16);
+		n.values[j] = t->values[i];
+		n.used[j] = 1;
+		n.count++;
+	}
+	free(t->keys);
+	free(t->values);
+	free(t->used);
+	*t = n;
+	return 0;
+}
+
+static int table_add(struct addr_table *t, const uint8_t *key, uint64_t value)
+{
+	if(t->count >= t->size / 2 && table_grow(t) < 0)
+		return -1;
+	size_t j = addr_hash(key) & (t->size - 1);
+	while(t->used[j]) {
+		if(!memcmp(t->keys[j], key, 16)) {
+			t->values[j] += value;
+			return 0;
+		}
+		j = (j + 1) & (t->size - 1);
+	}
+	memcpy(t->keys[j], key, 16);
+	t->values[j] = value;
+	t->used[j] = 1;
+	t->count++;
+	return 0;
+}
+
+static void table_free(struct addr_table *t)
+{
+	free(t->keys);
+	free(t->values);
+	free(t->used);
+	memset(t, 0, sizeof(*t));
+}
+
+void scan_stats_init(int _prefix_len, bool _exact)
+{
+	prefix_len = _prefix_len;
+	memset(prefix_mask, 0, 16);
+	for(int i = 0; i < prefix_len; i++)
+		prefix_mask[i / 8] |= 0x80 >> (i % 8);
+	exact = _exact;
+}
+
+static struct stats *get_stats(void)
+{
+	if(own || own_failed)
+		return own;
+	own = calloc(1, sizeof(struct stats));
+	if(!own) {
+		own_failed = true;
+		return NULL;
+	}
+	pthread_mutex_lock(&list_lock);
+	own->next = list;
+	list = own;
+	pthread_mutex_unlock(&list_lock);
+	return own;
+}
+
+int scan_stats_record(const struct rec_header *h)
+{
+	struct stats *s = get_stats();
+	if(!s)
+		return -1;
+	const int proto = h->proto_status >> 4, status = h->proto_status & 0xf;
+	if(proto >= NPROTOS || status >= NSTATUSES)
+		return 0;
+
+	s->records++;
+	if(h->size > sizeof(*h)) {
+		s->banners[proto]++;
+		const char *name = proto == OUTPUT_PROTO_ICMP ? NULL :
+			banner_service_type(banner_outproto2ip_type(proto), h->port);
+		int i;
+		for(i = 0; i < s->nservices; i++) {
+			if(s->services[i].name == name)
+				break;
+		}
+		if(i == s->nservices && i < MAX_SERVICES) {
+			s->services[i].name = name;
+			s->services[i].count = 0;
+			s->nservices++;
+		}
+		if(i < MAX_SERVICES)
+			s->services[i].count++;
+		return 0;
+	}
+
+	s->status[proto][status]++;
+	if(output_status_negative(status))
+		return 0;
+	if(status == OUTPUT_STATUS_OPEN && proto != OUTPUT_PROTO_ICMP)
+		s->ports[proto][h->port]++;
+
+	uint8_t prefix[16];
+	for(int i = 0; i < 16; i++)
+		prefix[i] = h->addr[i] & prefix_mask[i];
+	if(table_add(&s->prefixes, prefix, 1) < 0)
+		return -1;
+
+	// (aliased prefixes are not a host)
+	if(status == OUTPUT_STATUS_ALIASED)
+		return 0;
+	if(exact)
+		return table_add(&s->hosts, h->addr, 0);
+	const uint64_t hash = addr_hash(h->addr);
+	const uint64_t rest = hash << HLL_BITS;
+	const uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+	uint8_t *reg = &s->hll[hash >> (64 - HLL_BITS)];
+	if(rank > *reg)
+		*reg = rank;
+	return 0;
+}
+
+static uint64_t hll_estimate(const uint8_t *reg)
+{
+	const double m = HLL_SIZE, alpha = 0.7213 / (1 + 1.079 / m);
+	double sum = 0;
+	unsigned int zeros = 0;
+	for(int i = 0; i < HLL_SIZE; i++) {
+		sum += 1.0 / (double) (UINT64_C(1) << reg[i]);
+		zeros += reg[i] == 0;
+	}
+	double e = alpha * m * m / sum;
+	if(e <= 2.5 * m && zeros > 0)
+		e = m * log(m / zeros); // linear counting for small numbers
+	return (uint64_t) (e + 0.5);
+}
+
+struct entry {
+	uint64_t count;
+	int proto;
+	uint16_t port;
+	const uint8_t *addr;
+};
+
+static int entry_cmp(const void *_a, const void *_b)
+{
+	const struct entry *a = _a, *b = _b;
+	if(a->count != b->count)
+		return a->count < b->count ? 1 : -1;
+	if(a->addr)
+		return memcmp(a->addr, b->addr, 16);
+	if(a->proto != b->proto)
+		return a->proto - b->proto;
+	return (int) a->port - (int) b->port;
+}
+
+int scan_stats_print(FILE *f)
+{
+	struct stats *total = list;
+	if(!total) {
+		// nothing was counted, possibly because the file is empty
+		total = get_stats();
+		if(!total)
+			return -1;
+	}
+
+	// merge everything into the first one
+	for(struct stats *s = total->next; s; s = s->next) {
+		total->records += s->records;
+		for(int p = 0; p < NPROTOS; p++) {
+			for(int i = 0; i < NSTATUSES; i++)
+				total->status[p][i] += s->status[p][i];
+			total->banners[p] += s->banners[p];
+		}
+		for(int p = 0; p < 2; p++) {
+			for(int i = 0; i < 65536; i++)
+				total->ports[p][i] += s->ports[p][i];
+		}
+		for(size_t i = 0; i < s->prefixes.size; i++) {
+			if(s->prefixes.used[i] && table_add(&total->prefixes, s->prefixes.keys[i], s->prefixes.values[i]) < 0)
+				return -1;
+		}
+		for(size_t i = 0; i < s->hosts.size; i++) {
+			if(s->hosts.used[i] && table_add(&total->hosts, s->hosts.keys[i], 0) < 0)
+				return -1;
+		}
+		for(int i = 0; i < HLL_SIZE; i++) {
+			if(s->hll[i] > total->hll[i])
+				total->hll[i] = s->hll[i];
+		}
+		for(int i = 0; i < s->nservices; i++) {
+			int j;
+			for(j = 0; j < total->nservices; j++) {
+				if(total->services[j].name == s->services[i].name)
+					break;
+			}
+			if(j == total->nservices && j < MAX_SERVICES) {
+				total->services[j].name = s->services[i].name;
+				total->services[j].count = 0;
+				total->nservices++;
+			}
+			if(j < MAX_SERVICES)
+				total->services[j].count += s->services[i].count;
+		}
+	}
+
+	fprintf(f, "# fi6s stats\n");
+	fprintf(f, "records %" PRIu64 "\n", total->records);
+	if(exact)
+		fprintf(f, "hosts %zu\n", total->hosts.count);
+	else
+		fprintf(f, "hosts ~%" PRIu64 "\n", hll_estimate(total->hll));
+	for(int p = 0; p < NPROTOS; p++) {
+		for(int i = 0; i < NSTATUSES; i++) {
+			if(total->status[p][i] > 0) {
+				fprintf(f, "status %s %s %" PRIu64 "\n", output_proto_name(p),
+					output_status_name(i), total->status[p][i]);
+			}
+		}
+		if(total->banners[p] > 0)
+			fprintf(f, "banners %s %" PRIu64 "\n", output_proto_name(p), total->banners[p]);
+	}
+
+	// everything else is sorted by count
+	size_t n = 0, size = total->nservices;
+	for(int p = 0; p < 2; p++) {
+		for(int i = 0; i < 65536; i++)
+			n += total->ports[p][i] > 0;
+	}
+	if(n > size)
+		size = n;
+	if(total->prefixes.count > size)
+		size = total->prefixes.count;
+	struct entry *entries = malloc((size ? size : 1) * sizeof(struct entry));
+	if(!entries)
+		return -1;
+
+	n = 0;
+	for(int i = 0; i < total->nservices; i++)
+		entries[n++] = (struct entry) { .count = total->services[i].count, .proto = i };
+	qsort(entries, n, sizeof(struct entry), entry_cmp);
+	for(size_t i = 0; i < n; i++) {
+		const char *name = total->services[entries[i].proto].name;
+		fprintf(f, "service %s %" PRIu64 "\n", name ? name : "?", entries[i].count);
+	}
+
+	n = 0;
+	for(int p = 0; p < 2; p++) {
+		for(int i = 0; i < 65536; i++) {
+			if(total->ports[p][i] > 0)
+				entries[n++] = (struct entry) { .count = total->ports[p][i], .proto = p, .port = i };
+		}
+	}
+	qsort(entries, n, sizeof(struct entry), entry_cmp);
+	for(size_t i = 0; i < n; i++) {
+		fprintf(f, "port %s %u %" PRIu64 "\n", output_proto_name(entries[i].proto),
+			entries[i].port, entries[i].count);
+	}
+
+	n = 0;
+	for(size_t i = 0; i < total->prefixes.size; i++) {
+		if(total->prefixes.used[i])
+			entries[n++] = (struct entry) { .count = total->prefixes.values[i], .addr = total->prefixes.keys[i] };
+	}
+	qsort(entries, n, sizeof(struct entry), entry_cmp);
+	for(size_t i = 0; i < n; i++) {
+		char buf[IPV6_STRING_MAX];
+		ipv6_string(buf, entries[i].addr);
+		fprintf(f, "prefix %s/%d %" PRIu64 "\n", buf, prefix_len, entries[i].count);
+	}
+	free(entries);
+
+	return 0;
+}
+
+void scan_stats_fini(void)
+{
+	while(list) {
+		struct stats *next = list->next;
+		table_free(&list->prefixes);
+		table_free(&list->hosts);
+		free(list);
+		list = next;
+	}
+	own = NULL;
+}
@@ -0,0 +1,163 @@
+// fi6s
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (C) 2016 sfan5 <sfan5@live.de>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "scan.h"
+
+/*
+ * Hosts that answered the ICMP sweep, waiting to be port scanned.
+ * The receive thread appends, the send thread takes them off the front.
+ * The queue grows as needed, but since the sender prefers these hosts
+ * over sweeping further it normally stays short.
+ * Every host is only queued once, even if it answers more than once (e.g.
+ * retransmissions or duplicate targets). Hosts that were queued are kept in
+ * a hash set, whose size grows with the number of live hosts.
+ */
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t (*queue)[16];
+static size_t queue_size, queue_head, queue_tail; // size is a power of two
+
+static uint8_t (*seen)[16]; // all-zero = empty slot
+static size_t seen_size, seen_used; // size is a power of two
+
+static atomic_uint live;
+
+#define SEEN_MIN_SIZE 4096
+
+int scan_sweep_init(void)
+{
+	queue_size = 1024;
+	queue_head = queue_tail = 0;
+	queue = malloc(queue_size * 16);
+	seen_size = SEEN_MIN_SIZE;
+	seen_used = 0;
+	seen = calloc(seen_size, 16);
+	if(!queue || !seen)
+		return -1;
+	atomic_store(&live, 0);
+	return 0;
+}
+
+void scan_sweep_fini(void)
+{
+	free(queue);
+	queue = NULL;
+	free(seen);
+	seen = NULL;
+}
+
+static inline size_t addr_hash(const uint8_t *addr)
+{
+	uint64_t a, b;
+	memcpy(&a, addr, 8);
+	memcpy(&b, &addr[8], 8);
+	uint64_t h = a;
+	h = (h ^ (h >> 31)) * UINT64_C(0x7fb5d329728ea185);
+	h ^= b;
+	h = (h ^ (h >> 27)) * UINT64_C(0x81dadef4bc2dd44d);
+	return h ^ (h >> 33);
+}
+
+static inline bool is_zero(const uint8_t *addr)
+{
+	static const uint8_t zero[16] = {0};
+	return !memcmp(addr, zero, 16);
+}
+
+// returns the slot of addr, or the empty slot it belongs in
+static uint8_t *seen_slot(uint8_t (*set)[16], size_t size, const uint8_t *addr)
+{
+	for(size_t i = addr_hash(addr); ; i++) {
+		uint8_t *slot = set[i & (size - 1)];
+		if(is_zero(slot) || !memcmp(slot, addr, 16))
+			return slot;
+	}
+}
+
+// returns 1 if addr was added, 0 if it was already there (lock must be held)
+static int seen_add(const uint8_t *addr)
+{
+	if(is_zero(addr))
+		return 0;
+	uint8_t *slot = seen_slot(seen, seen_size, addr);
+	if(!is_zero(slot))
+		return 0;
+	// keep the load factor below 1/2
+	if((seen_used + 1) * 2 > seen_size) {
+		uint8_t (*n)[16] = calloc(seen_size * 2, 16);
+		if(!n)
+			return -1;
+		for(size_t i = 0; i < seen_size; i++) {
+			if(!is_zero(seen[i]))
+				memcpy(seen_slot(n, seen_size * 2, seen[i]), seen[i], 16);
+		}
+		free(seen);
+		seen = n;
+		seen_size *= 2;
+		slot = seen_slot(seen, seen_size, addr);
+	}
+	memcpy(slot, addr, 16);
+	seen_used++;
+	return 1;
+}
+
+int scan_sweep_add(const uint8_t *addr)
+{
+	pthread_mutex_lock(&queue_lock);
+	int ret = seen_add(addr);
+	if(ret <= 0)
+		goto out;
+	ret = 0;
+	if(queue_tail - queue_head == queue_size) {
+		uint8_t (*n)[16] = malloc(queue_size * 2 * 16);
+		if(!n) {
+			ret = -1;
+			goto out;
+		}
+		for(size_t i = queue_head; i != queue_tail; i++)
+			memcpy(n[i - queue_head], queue[i & (queue_size - 1)], 16);
+		free(queue);
+		queue = n;
+		queue_tail -= queue_head;
+		queue_head = 0;
+		queue_size *= 2;
+	}
+	memcpy(queue[queue_tail & (queue_size - 1)], addr, 16);
+	queue_tail++;
+	atomic_fetch_add(&live, 1);
+out:
+	pthread_mutex_unlock(&queue_lock);
+	return ret;
+}
+
+int scan_sweep_next(uint8_t *addr)
+{
+	int ret = 0;
+	pthread_mutex_lock(&queue_lock);
+	if(queue_head != queue_tail) {
+		memcpy(addr, queue[queue_head & (queue_size - 1)], 16);
+		queue_head++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return ret;
+}
+
+bool scan_sweep_contains(const uint8_t *addr)
+{
+	pthread_mutex_lock(&queue_lock);
+	bool ret = !is_zero(addr) && !is_zero(seen_slot(seen, seen_size, addr));
+	pthread_mutex_unlock(&queue_lock);
+	return ret;
+}
+
+unsigned int scan_sweep_stats(void)
+{
+	return atomic_load(&live);
+}
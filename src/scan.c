@@ -32,10 +32,22 @@ enum {
 static uint8_t source_addr[16];
 static int source_port;
 //
-static struct ports ports;
-static unsigned int max_rate;
+static struct ports tcp_ports, udp_ports;
+static bool scan_tcp, scan_udp, scan_icmp;
+static atomic_uint max_rate; // changes with adaptive rate control
+static unsigned int min_rate; // 0 = fixed rate
 static int show_closed, banners;
-static uint8_t ip_type;
+static unsigned int banner_max = BANNER_MAX_LENGTH, max_sessions;
+static int measure_rtt;
+static unsigned int tcp_mss;
+static unsigned int retries, retry_interval;
+static unsigned int prefix_rate;
+static int prefix_len;
+static int alias_len;
+static int prune_len;
+static int sweep;
+static double dedup_fp;
+static FILE *diff_baseline;
 //
 static FILE *outfile;
 static struct outputdef outdef;
@@ -44,42 +56,64 @@ static uint32_t scan_randomness;
 static atomic_uint pkts_sent, pkts_recv;
 static atomic_uchar status_bits;
 
+#define RTT_HIST_BUCKETS 32 // log2 of microseconds
+static atomic_uint rtt_hist[RTT_HIST_BUCKETS];
+
 static inline int source_port_rand(void);
-static void *send_thread_tcp(void *unused);
-static void *send_thread_udp(void *unused);
-static void *send_thread_icmp(void *unused);
+static inline int source_port_udp(const uint8_t *dstaddr, int dstport);
+static void *send_thread(void *unused);
 
 static void *recv_thread(void *unused);
 static void recv_handler(uint64_t ts, int len, const uint8_t *packet);
 static void recv_handler_tcp(uint64_t ts, int len, const uint8_t *packet, const uint8_t *csrcaddr);
 static void recv_handler_udp(uint64_t ts, int len, const uint8_t *packet, const uint8_t *csrcaddr);
 static void recv_handler_icmp(uint64_t ts, int len, const uint8_t *packet, const uint8_t *csrcaddr);
+static void recv_handler_icmp_error(uint64_t ts, int len, const uint8_t *packet);
+static bool check_alias(uint64_t ts, const uint8_t *addr, int proto, int port);
+static void output_removed(const uint8_t *addr, int proto, uint16_t port);
+
+static void rate_init(void);
+static void rate_adjust(unsigned int sent, unsigned int recv);
+
+static void rtt_record(uint32_t rtt);
+static void rtt_snapshot(unsigned int *hist);
+static uint32_t rtt_percentile(const unsigned int *hist, int percent);
+static void rtt_print_histogram(void);
 
 #if ATOMIC_INT_LOCK_FREE != 2
 #warning Non lock-free atomic types will severely affect performance.
 #endif
 
 #define RATE_CONTROL() do { \
-	if(atomic_fetch_add(&pkts_sent, 1) >= max_rate) { \
+	if(atomic_fetch_add(&pkts_sent, 1) >= atomic_load(&max_rate)) { \
 		do usleep(1000); while(atomic_load(&pkts_sent) != 0); \
 	} \
 	} while(0)
 
 /****/
 
-void scan_set_general(const struct ports *_ports, int _max_rate, int _show_closed, int _banners)
+void scan_set_general(int _max_rate, int _show_closed, int _banners)
 {
-	memcpy(&ports, _ports, sizeof(struct ports));
-	max_rate = _max_rate < 0 ? UINT_MAX : _max_rate - 1;
+	atomic_store(&max_rate, _max_rate < 0 ? UINT_MAX : _max_rate - 1);
 	show_closed = _show_closed;
 	banners = _banners;
 }
 
-void scan_set_network(const uint8_t *_source_addr, int _source_port, uint8_t _ip_type)
+void scan_set_network(const uint8_t *_source_addr, int _source_port)
 {
 	memcpy(source_addr, _source_addr, 16);
 	source_port = _source_port;
-	ip_type = _ip_type;
+}
+
+void scan_set_protocols(const struct ports *_tcp_ports, const struct ports *_udp_ports, bool icmp)
+{
+	scan_tcp = _tcp_ports != NULL;
+	if(scan_tcp)
+		memcpy(&tcp_ports, _tcp_ports, sizeof(struct ports));
+	scan_udp = _udp_ports != NULL;
+	if(scan_udp)
+		memcpy(&udp_ports, _udp_ports, sizeof(struct ports));
+	scan_icmp = icmp;
 }
 
 void scan_set_output(FILE *_outfile, const struct outputdef *_outdef)
@@ -88,6 +122,79 @@ void scan_set_output(FILE *_outfile, const struct outputdef *_outdef)
 	memcpy(&outdef, _outdef, sizeof(struct outputdef));
 }
 
+void scan_set_rtt(int _measure_rtt)
+{
+	measure_rtt = _measure_rtt;
+}
+
+void scan_set_tcp_mss(unsigned int _tcp_mss)
+{
+	tcp_mss = _tcp_mss;
+}
+
+void scan_set_banner_limits(unsigned int _banner_max, unsigned int _max_sessions)
+{
+	banner_max = _banner_max;
+	max_sessions = _max_sessions;
+}
+
+void scan_set_min_rate(unsigned int _min_rate)
+{
+	min_rate = _min_rate;
+}
+
+void scan_set_retries(unsigned int _retries, unsigned int interval_ms)
+{
+	retries = _retries;
+	retry_interval = interval_ms;
+}
+
+void scan_set_prefix_limit(unsigned int rate, int _prefix_len)
+{
+	prefix_rate = rate;
+	prefix_len = _prefix_len;
+}
+
+void scan_set_alias_detection(int prefix_len)
+{
+	alias_len = prefix_len;
+}
+
+void scan_set_pruning(int prefix_len)
+{
+	prune_len = prefix_len;
+}
+
+void scan_set_sweep(int _sweep)
+{
+	sweep = _sweep;
+}
+
+void scan_set_dedup(double fp_rate)
+{
+	dedup_fp = fp_rate;
+}
+
+void scan_set_diff(FILE *baseline)
+{
+	diff_baseline = baseline;
+}
+
+static uint64_t count_probes(void)
+{
+	uint64_t n = scan_icmp ? 1 : 0;
+	struct ports_iter it;
+	if(scan_tcp) {
+		for(ports_iter_begin(&tcp_ports, &it); ports_iter_next(&it); )
+			n++;
+	}
+	if(scan_udp) {
+		for(ports_iter_begin(&udp_ports, &it); ports_iter_next(&it); )
+			n++;
+	}
+	return n;
+}
+
 int scan_main(const char *interface, int quiet)
 {
 	if(rawsock_open(interface, 65535) < 0)
@@ -96,41 +203,82 @@ int scan_main(const char *interface, int quiet)
 	atomic_store(&pkts_sent, 0);
 	atomic_store(&pkts_recv, 0);
 	atomic_store(&status_bits, 0);
-	if(banners && ip_type == IP_TYPE_TCP) {
-		if(scan_responder_init(outfile, &outdef, source_port, scan_randomness) < 0)
+	for(int i = 0; i < RTT_HIST_BUCKETS; i++)
+		atomic_store(&rtt_hist[i], 0);
+	if(retries) {
+		unsigned int rate = atomic_load(&max_rate);
+		if(scan_retry_init(retries, retry_interval, rate == UINT_MAX ? 0 : rate + 1) < 0)
+			goto err;
+	}
+	if(prefix_rate) {
+		if(scan_limit_init(prefix_rate, prefix_len) < 0)
+			goto err;
+	}
+	if(alias_len) {
+		if(scan_alias_init(alias_len, ALIAS_VERIFY_WAIT + retries * retry_interval) < 0)
+			goto err;
+	}
+	if(prune_len) {
+		if(scan_prune_init(prune_len) < 0)
+			goto err;
+	}
+	if(sweep) {
+		if(scan_sweep_init() < 0)
+			goto err;
+	}
+	if(dedup_fp > 0) {
+		// every probe might be answered (and banners are extra)
+		uint64_t targets = target_gen_count(), per = count_probes() * (banners ? 2 : 1);
+		uint64_t entries = targets > UINT64_MAX / per ? UINT64_MAX : targets * per;
+		if(scan_dedup_init(entries, dedup_fp) < 0)
+			goto err;
+	}
+	if(diff_baseline) {
+		if(scan_diff_init(diff_baseline, !outdef.raw) < 0)
+			goto err;
+	}
+	if(min_rate)
+		rate_init();
+	if(banners && scan_tcp) {
+		if(scan_responder_init(&outdef, source_port, scan_randomness, banner_max, max_sessions) < 0)
 			goto err;
 	}
-	if(!banners && ip_type == IP_TYPE_UDP)
+	if(!banners && scan_udp)
 		log_warning("UDP scans don't make sense without banners enabled.");
-	if(banners && ip_type == IP_TYPE_ICMPV6)
+	if(banners && !scan_tcp && !scan_udp)
 		log_warning("Enabling banners is a no-op for ICMP scans.");
+	if(measure_rtt && scan_udp)
+		log_warning("RTT can't be measured for UDP scans.");
 
 	// Set capture filters
-	int fflags = RAWSOCK_FILTER_IPTYPE | RAWSOCK_FILTER_DSTADDR;
-	if(source_port != -1 && ip_type != IP_TYPE_ICMPV6)
+	// (errors caused by our probes are interesting too)
+	uint8_t iptypes[4] = {0};
+	do {
+		int n = 0;
+		if(scan_tcp)
+			iptypes[n++] = IP_TYPE_TCP;
+		if(scan_udp)
+			iptypes[n++] = IP_TYPE_UDP;
+		if(scan_icmp)
+			iptypes[n++] = IP_TYPE_ICMPV6;
+	} while(0);
+	int fflags = RAWSOCK_FILTER_IPTYPE | RAWSOCK_FILTER_DSTADDR | RAWSOCK_FILTER_ICMPERR;
+	if(source_port != -1 && (scan_tcp || scan_udp))
 		fflags |= RAWSOCK_FILTER_DSTPORT;
-	if(rawsock_setfilter(fflags, ip_type, source_addr, source_port) < 0)
+	if(rawsock_setfilter(fflags, iptypes, source_addr, source_port) < 0)
 		goto err;
 
 	// Write output file header
+	if(scan_output_init(outfile, &outdef) < 0)
+		goto err;
 	outdef.begin(outfile);
 
 	// Start threads
 	pthread_t tr, ts;
 	if(pthread_create(&tr, NULL, recv_thread, NULL) < 0)
 		goto err;
-	pthread_detach(tr);
-	do {
-		int r;
-		if(ip_type == IP_TYPE_TCP)
-			r = pthread_create(&ts, NULL, send_thread_tcp, NULL);
-		else if(ip_type == IP_TYPE_UDP)
-			r = pthread_create(&ts, NULL, send_thread_udp, NULL);
-		else // IP_TYPE_ICMPV6
-			r = pthread_create(&ts, NULL, send_thread_icmp, NULL);
-		if(r < 0)
-			goto err;
-	} while(0);
+	if(pthread_create(&ts, NULL, send_thread, NULL) < 0)
+		goto err;
 	pthread_detach(ts);
 
 	// Stats & progress watching
@@ -140,17 +288,43 @@ int scan_main(const char *interface, int quiet)
 		// (used for rate control)
 		cur_sent = atomic_exchange(&pkts_sent, 0);
 		cur_recv = atomic_exchange(&pkts_recv, 0);
+		if(min_rate && !(atomic_load(&status_bits) & SEND_FINISHED))
+			rate_adjust(cur_sent, cur_recv);
 		if(!quiet) {
 			float progress = target_gen_progress();
-			unsigned int tcp_sent = 0;
-			char tmp[10] = {'?', '?', '?', 0};
+			unsigned int tcp_sent = 0, tcp_shed = 0;
+			char tmp[10] = {'?', '?', '?', 0}, tmp2[64] = {0};
 			if(progress >= 0.0f)
 				snprintf(tmp, sizeof(tmp), "%3d", (int) (progress*100));
-			if(banners && ip_type == IP_TYPE_TCP) {
-				scan_responder_stats(&tcp_sent);
-				fprintf(stderr, "snt:%5u rcv:%5u tcp:%5u p:%s%% \r", cur_sent, cur_recv, tcp_sent, tmp);
+			if(measure_rtt) {
+				unsigned int hist[RTT_HIST_BUCKETS];
+				rtt_snapshot(hist);
+				uint32_t p50 = rtt_percentile(hist, 50);
+				if(p50 > 0)
+					snprintf(tmp2, sizeof(tmp2), "rtt:%5.1fms ", p50 / 1000.0f);
+			}
+			if(min_rate) {
+				int l = strlen(tmp2);
+				snprintf(&tmp2[l], sizeof(tmp2) - l, "rate:%u ", atomic_load(&max_rate) + 1);
+			}
+			if(prefix_rate) {
+				int l = strlen(tmp2);
+				snprintf(&tmp2[l], sizeof(tmp2) - l, "dfr:%u ", scan_limit_stats());
+			}
+			if(sweep) {
+				int l = strlen(tmp2);
+				snprintf(&tmp2[l], sizeof(tmp2) - l, "live:%u ", scan_sweep_stats());
+			}
+			if(banners && scan_tcp) {
+				scan_responder_stats(&tcp_sent, &tcp_shed);
+				if(max_sessions) {
+					fprintf(stderr, "snt:%5u rcv:%5u tcp:%5u shed:%4u %sp:%s%% \r",
+						cur_sent, cur_recv, tcp_sent, tcp_shed, tmp2, tmp);
+				} else {
+					fprintf(stderr, "snt:%5u rcv:%5u tcp:%5u %sp:%s%% \r", cur_sent, cur_recv, tcp_sent, tmp2, tmp);
+				}
 			} else {
-				fprintf(stderr, "snt:%5u rcv:%5u p:%s%% \r", cur_sent, cur_recv, tmp);
+				fprintf(stderr, "snt:%5u rcv:%5u %sp:%s%% \r", cur_sent, cur_recv, tmp2, tmp);
 			}
 		}
 		cur_status = atomic_load(&status_bits);
@@ -172,17 +346,45 @@ int scan_main(const char *interface, int quiet)
 		// FIXME: missing a way to abort the scan thread
 	}
 	rawsock_breakloop();
-	if(banners && ip_type == IP_TYPE_TCP)
+	// (results must not be produced anymore once output is finished)
+	pthread_join(tr, NULL);
+	if(banners && scan_tcp)
 		scan_responder_finish();
+	// (an incomplete scan would report everything it didn't get to)
+	if(diff_baseline && !cur_status)
+		scan_diff_removed(&output_removed);
+	else if(diff_baseline)
+		log_warning("Not reporting removed results since the scan didn't complete.");
+	scan_output_fini();
 	if(!quiet && !cur_status) {
 		unsigned int cur_recv = atomic_exchange(&pkts_recv, 0);
-		unsigned int tcp_sent = 0;
-		if(banners && ip_type == IP_TYPE_TCP) {
-			scan_responder_stats(&tcp_sent);
+		unsigned int tcp_sent = 0, tcp_shed;
+		if(banners && scan_tcp) {
+			scan_responder_stats(&tcp_sent, &tcp_shed);
 			fprintf(stderr, "rcv:%5u tcp:%5u\n", cur_recv, tcp_sent);
 		} else {
 			fprintf(stderr, "rcv:%5u\n", cur_recv);
 		}
+		if(retries)
+			fprintf(stderr, "Retransmitted %u unanswered probes.\n", scan_retry_stats());
+		if(min_rate)
+			fprintf(stderr, "Adaptive rate ended at %u packets/s.\n", atomic_load(&max_rate) + 1);
+		if(prefix_rate)
+			fprintf(stderr, "Deferred %u probes to stay below the per-prefix rate.\n", scan_limit_stats());
+		if(alias_len)
+			fprintf(stderr, "Skipped %u probes into aliased prefixes.\n", scan_alias_stats());
+		if(prune_len) {
+			unsigned int n, skipped = scan_prune_stats(&n);
+			fprintf(stderr, "Skipped %u probes into %u unroutable prefixes.\n", skipped, n);
+		}
+		if(sweep)
+			fprintf(stderr, "Port scanned %u hosts that answered the sweep.\n", scan_sweep_stats());
+		if(dedup_fp > 0)
+			fprintf(stderr, "Suppressed %u duplicate results.\n", scan_dedup_stats());
+		if(diff_baseline)
+			fprintf(stderr, "Suppressed %u results unchanged from the baseline.\n", scan_diff_stats());
+		if(measure_rtt)
+			rtt_print_histogram();
 	}
 
 	// Write output file footer
@@ -191,6 +393,20 @@ int scan_main(const char *interface, int quiet)
 	int r = 0;
 ret:
 	rawsock_close();
+	if(retries)
+		scan_retry_fini();
+	if(prefix_rate)
+		scan_limit_fini();
+	if(alias_len)
+		scan_alias_fini();
+	if(prune_len)
+		scan_prune_fini();
+	if(sweep)
+		scan_sweep_fini();
+	if(dedup_fp > 0)
+		scan_dedup_fini();
+	if(diff_baseline)
+		scan_diff_fini();
 	return r;
 err:
 	r = 1;
@@ -217,31 +433,40 @@ static bool calc_bps(char *dst, unsigned int dstsize, uint64_t m1, uint64_t m2)
 	return true;
 }
 
-void scan_print_summary(const struct ports *ports, int max_rate, int banners, uint8_t ip_type)
+static inline void update_minmax(unsigned int *min, unsigned int *max, unsigned int val)
+{
+	if(val < *min)
+		*min = val;
+	if(val > *max)
+		*max = val;
+}
+
+void scan_print_summary(const struct ports *tcp_ports, const struct ports *udp_ports, bool icmp, int max_rate, int banners, int measure_rtt, unsigned int tcp_mss)
 {
 	unsigned int payload_min = 9999, payload_max = 0;
-	if(ip_type == IP_TYPE_TCP) {
-		payload_min = payload_max = TCP_HEADER_SIZE;
-	} else if(ip_type == IP_TYPE_UDP && !banners) {
-		payload_min = payload_max = UDP_HEADER_SIZE;
-	} else if(ip_type == IP_TYPE_UDP) {
+	if(tcp_ports) {
+		update_minmax(&payload_min, &payload_max, TCP_HEADER_SIZE +
+			(tcp_mss ? TCP_OPTION_MSS_SIZE : 0) +
+			(measure_rtt ? TCP_OPTION_TIMESTAMP_SIZE : 0));
+	}
+	if(udp_ports && !banners) {
+		update_minmax(&payload_min, &payload_max, UDP_HEADER_SIZE);
+	} else if(udp_ports) {
 		// Need to know actual ports to know payload size
-		if(!validate_ports(ports))
+		if(!validate_ports(udp_ports))
 			return;
 		struct ports_iter it;
-		ports_iter_begin(ports, &it);
+		ports_iter_begin(udp_ports, &it);
 		while(ports_iter_next(&it) == 1) {
 			unsigned int len = 0;
 			banner_get_query(IP_TYPE_UDP, it.val, &len);
-			len += UDP_HEADER_SIZE;
-			if(len < payload_min)
-				payload_min = len;
-			if(len > payload_max)
-				payload_max = len;
+			update_minmax(&payload_min, &payload_max, UDP_HEADER_SIZE + len);
 		}
-	} else if(ip_type == IP_TYPE_ICMPV6) {
-		payload_min = payload_max = ICMP_HEADER_SIZE;
 	}
+	if(icmp)
+		update_minmax(&payload_min, &payload_max, ICMP_HEADER_SIZE + (measure_rtt ? ICMP_RTT_PAYLOAD : 0));
+	if(payload_max == 0)
+		return;
 	payload_min += FRAME_ETH_SIZE + FRAME_IP_SIZE;
 	payload_max += FRAME_ETH_SIZE + FRAME_IP_SIZE;
 
@@ -268,132 +493,299 @@ void scan_print_summary(const struct ports *ports, int max_rate, int banners, ui
 
 /****/
 
-static void *send_thread_tcp(void *unused)
-{
-	uint8_t _Alignas(uint32_t) packet[FRAME_ETH_SIZE + FRAME_IP_SIZE + TCP_HEADER_SIZE];
-	uint8_t dstaddr[16];
+struct probe_gen {
+	uint8_t addr[16]; // current target
 	struct ports_iter it;
+	int stage; // which probes of the target come next
+	bool done; // no more targets
+	bool swept; // (sweep) every target got its echo request
+	uint64_t last_echo; // (sweep) when the last echo request was sent
+};
 
-	(void) unused;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	set_thread_name("send");
+enum {
+	STAGE_ICMP = 0,
+	STAGE_TCP,
+	STAGE_UDP,
+	STAGE_NONE, // target is finished
+};
 
-	rawsock_eth_prepare(ETH_FRAME(packet), ETH_TYPE_IPV6);
-	rawsock_ip_prepare(IP_FRAME(packet), IP_TYPE_TCP);
-	if(target_gen_next(dstaddr) < 0)
-		goto err;
-	rawsock_ip_modify(IP_FRAME(packet), TCP_HEADER_SIZE, dstaddr);
-	tcp_prepare(TCP_HEADER(packet));
-	tcp_make_syn(TCP_HEADER(packet), tcp_first_seqnum(scan_randomness));
-	ports_iter_begin(&ports, &it);
+static int probe_gen_init(struct probe_gen *g)
+{
+	if(sweep) { // targets come from the sweep queue
+		g->stage = STAGE_NONE;
+		return 0;
+	}
+	if(target_gen_next(g->addr) < 0)
+		return -1;
+	g->stage = STAGE_ICMP;
+	return 0;
+}
+
+static inline void probe_gen_begin_ports(struct probe_gen *g)
+{
+	g->stage = STAGE_TCP;
+	ports_iter_begin(&tcp_ports, &g->it);
+}
+
+// next TCP or UDP probe of the current target
+static bool probe_gen_ports(struct probe_gen *g, uint32_t *probe)
+{
+	if(g->stage == STAGE_TCP) {
+		if(scan_tcp && ports_iter_next(&g->it) == 1) {
+			*probe = PROBE_ID(OUTPUT_PROTO_TCP, g->it.val);
+			return true;
+		}
+		g->stage = STAGE_UDP;
+		ports_iter_begin(&udp_ports, &g->it);
+	}
+	if(g->stage == STAGE_UDP) {
+		if(scan_udp && ports_iter_next(&g->it) == 1) {
+			*probe = PROBE_ID(OUTPUT_PROTO_UDP, g->it.val);
+			return true;
+		}
+		g->stage = STAGE_NONE;
+	}
+	return false;
+}
 
+// Ports of hosts that answered come first, then the next echo request.
+// Once all targets were swept late replies are still waited for.
+static int probe_gen_next_sweep(struct probe_gen *g, uint8_t *addr, uint32_t *probe)
+{
 	while(1) {
-		// Next port number (or target if ports exhausted)
-		if(ports_iter_next(&it) == 0) {
-			if(target_gen_next(dstaddr) < 0)
-				break; // no more targets
-			rawsock_ip_modify(IP_FRAME(packet), TCP_HEADER_SIZE, dstaddr);
-			ports_iter_begin(NULL, &it);
-			continue;
+		if(probe_gen_ports(g, probe)) {
+			memcpy(addr, g->addr, 16);
+			return 1;
 		}
+		if(!scan_sweep_next(g->addr))
+			break;
+		probe_gen_begin_ports(g);
+	}
 
-		tcp_modify(TCP_HEADER(packet), source_port==-1?source_port_rand():source_port, it.val);
-		tcp_checksum(IP_FRAME(packet), TCP_HEADER(packet), 0);
-		rawsock_send(packet, sizeof(packet));
+	if(!g->swept) {
+		if(target_gen_next(addr) == 0) {
+			*probe = PROBE_ID(OUTPUT_PROTO_ICMP, 0);
+			return 1;
+		}
+		g->swept = true;
+	}
+	// (outstanding echo requests may still be sent)
+	if((retries && scan_retry_pending()) || (prefix_rate && scan_limit_pending()) ||
+		monotonic_ms() - g->last_echo < SWEEP_WAIT)
+		return 0;
+	return -1;
+}
 
-		RATE_CONTROL();
+// Every target gets its ICMP probe first, then the TCP ports, then the UDP ports.
+// Returns 1 if there's a probe, 0 if there might be one later or -1 if done.
+static int probe_gen_next(struct probe_gen *g, uint8_t *addr, uint32_t *probe)
+{
+	if(sweep)
+		return probe_gen_next_sweep(g, addr, probe);
+	while(1) {
+		if(g->stage == STAGE_ICMP) {
+			probe_gen_begin_ports(g);
+			if(scan_icmp) {
+				*probe = PROBE_ID(OUTPUT_PROTO_ICMP, 0);
+				break;
+			}
+		}
+		if(probe_gen_ports(g, probe))
+			break;
+		// Next target
+		if(target_gen_next(g->addr) < 0)
+			return -1;
+		g->stage = STAGE_ICMP;
 	}
+	memcpy(addr, g->addr, 16);
+	return 1;
+}
 
-	atomic_fetch_or(&status_bits, SEND_FINISHED);
-	return NULL;
-err:
-	atomic_fetch_or(&status_bits, ERROR_SEND_THREAD);
-	return NULL;
+static inline bool skip_target(const uint8_t *addr)
+{
+	return (alias_len && scan_alias_pruned(addr)) ||
+		(prune_len && scan_prune_check(addr));
 }
 
-static void *send_thread_udp(void *unused)
+// Picks the next probe: deferred probes that are due, then retransmissions, then new ones.
+// Returns 1 if there's a probe (<first> if it's not a retransmission), 0 if nothing
+// is ready yet or -1 once everything has been sent.
+static int next_probe(struct probe_gen *g, uint8_t *addr, uint32_t *probe, bool *first)
 {
-	uint8_t _Alignas(uint32_t) packet[FRAME_ETH_SIZE + FRAME_IP_SIZE + UDP_HEADER_SIZE + BANNER_QUERY_MAX_LENGTH];
-	uint8_t dstaddr[16];
-	struct ports_iter it;
+	while(1) {
+		// (retransmitted like any other probe)
+		if(alias_len && scan_alias_next(addr, probe)) {
+			*first = true;
+			return 1;
+		}
 
-	(void) unused;
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	set_thread_name("send");
+		if(prefix_rate && scan_limit_next(addr, probe, first)) {
+			if(skip_target(addr))
+				continue;
+			return 1;
+		}
+
+		if(retries && scan_retry_next(addr, probe)) {
+			*first = false;
+		} else if(!g->done && !(prefix_rate && scan_limit_full())) {
+			int r = probe_gen_next(g, addr, probe);
+			if(r < 0) {
+				g->done = true;
+				continue;
+			} else if(r == 0) {
+				return 0;
+			}
+			*first = true;
+		} else {
+			if(!g->done || (retries && scan_retry_pending()) ||
+				(prefix_rate && scan_limit_pending()))
+				return 0;
+			return -1;
+		}
+
+		if(skip_target(addr))
+			continue;
+
+		// (if deferring fails the probe is just sent right away)
+		if(!prefix_rate || scan_limit_admit(addr, *probe, *first) != 0)
+			return 1;
+	}
+}
+
+#define TCP_PACKET_SIZE (FRAME_ETH_SIZE + FRAME_IP_SIZE + TCP_HEADER_SIZE + \
+	TCP_OPTION_MSS_SIZE + TCP_OPTION_TIMESTAMP_SIZE)
+#define UDP_PACKET_SIZE (FRAME_ETH_SIZE + FRAME_IP_SIZE + UDP_HEADER_SIZE + BANNER_QUERY_MAX_LENGTH)
+#define ICMP_PACKET_SIZE (FRAME_ETH_SIZE + FRAME_IP_SIZE + ICMP_HEADER_SIZE + ICMP_RTT_PAYLOAD)
 
+static void prepare_tcp(uint8_t *packet)
+{
+	const unsigned int ts_off = tcp_mss ? TCP_OPTION_MSS_SIZE : 0;
+	// the TCP timestamp option is echoed by the remote and gives us the RTT
+	const unsigned int optlen = ts_off + (measure_rtt ? TCP_OPTION_TIMESTAMP_SIZE : 0);
+
+	rawsock_eth_prepare(ETH_FRAME(packet), ETH_TYPE_IPV6);
+	rawsock_ip_prepare(IP_FRAME(packet), IP_TYPE_TCP);
+	tcp_prepare(TCP_HEADER(packet));
+	tcp_make_syn(TCP_HEADER(packet), tcp_first_seqnum(scan_randomness));
+	if(banners) // the window limits how much the remote sends before our first ACK
+		tcp_set_window(TCP_HEADER(packet), banner_max);
+	if(tcp_mss)
+		tcp_option_mss(TCP_HEADER(packet), 0, tcp_mss);
+	tcp_set_options(TCP_HEADER(packet), optlen);
+}
+
+static void send_tcp(uint8_t *packet, const uint8_t *dstaddr, int dstport)
+{
+	const unsigned int ts_off = tcp_mss ? TCP_OPTION_MSS_SIZE : 0;
+	const unsigned int optlen = ts_off + (measure_rtt ? TCP_OPTION_TIMESTAMP_SIZE : 0);
+
+	rawsock_ip_modify(IP_FRAME(packet), TCP_HEADER_SIZE + optlen, dstaddr);
+	tcp_modify(TCP_HEADER(packet), source_port==-1?source_port_rand():source_port, dstport);
+	if(measure_rtt)
+		tcp_option_timestamp(TCP_HEADER(packet), ts_off, (uint32_t) realtime_us(), 0);
+	tcp_checksum(IP_FRAME(packet), TCP_HEADER(packet), 0);
+	rawsock_send(packet, FRAME_ETH_SIZE + FRAME_IP_SIZE + TCP_HEADER_SIZE + optlen);
+}
+
+static void prepare_udp(uint8_t *packet)
+{
 	rawsock_eth_prepare(ETH_FRAME(packet), ETH_TYPE_IPV6);
 	rawsock_ip_prepare(IP_FRAME(packet), IP_TYPE_UDP);
-	if(target_gen_next(dstaddr) < 0)
-		goto err;
-	if(!banners) {
-		rawsock_ip_modify(IP_FRAME(packet), UDP_HEADER_SIZE, dstaddr);
-		udp_modify2(UDP_HEADER(packet), 0); // we send empty packets
-	}
-	ports_iter_begin(&ports, &it);
+}
 
-	while(1) {
-		// Next port number (or target if ports exhausted)
-		if(ports_iter_next(&it) == 0) {
-			if(target_gen_next(dstaddr) < 0)
-				break; // no more targets
-			if(!banners)
-				rawsock_ip_modify(IP_FRAME(packet), UDP_HEADER_SIZE, dstaddr);
-			ports_iter_begin(NULL, &it);
-			continue;
-		}
+static void send_udp(uint8_t *packet, const uint8_t *dstaddr, int dstport)
+{
+	udp_modify(UDP_HEADER(packet), source_port==-1?source_port_udp(dstaddr, dstport):source_port, dstport);
+	unsigned int dlen = 0;
+	if(banners) {
+		const char *payload = banner_get_query(IP_TYPE_UDP, dstport, &dlen);
+		if(payload && dlen > 0)
+			memcpy(UDP_DATA(packet), payload, dlen);
+	} // otherwise we send empty packets
+	rawsock_ip_modify(IP_FRAME(packet), UDP_HEADER_SIZE + dlen, dstaddr);
+	udp_modify2(UDP_HEADER(packet), dlen);
+
+	udp_checksum(IP_FRAME(packet), UDP_HEADER(packet), dlen);
+	rawsock_send(packet, FRAME_ETH_SIZE + FRAME_IP_SIZE + UDP_HEADER_SIZE + dlen);
+}
 
-		uint16_t dstport = it.val;
-		udp_modify(UDP_HEADER(packet), source_port==-1?source_port_rand():source_port, dstport);
-		unsigned int dlen = 0;
-		if(banners) {
-			const char *payload = banner_get_query(IP_TYPE_UDP, dstport, &dlen);
-			if(payload && dlen > 0)
-				memcpy(UDP_DATA(packet), payload, dlen);
-			rawsock_ip_modify(IP_FRAME(packet), UDP_HEADER_SIZE + dlen, dstaddr);
-			udp_modify2(UDP_HEADER(packet), dlen);
-		}
+static void prepare_icmp(uint8_t *packet)
+{
+	rawsock_eth_prepare(ETH_FRAME(packet), ETH_TYPE_IPV6);
+	rawsock_ip_prepare(IP_FRAME(packet), IP_TYPE_ICMPV6);
+	ICMP_HEADER(packet)->type = 128; // Echo Request
+	ICMP_HEADER(packet)->code = 0;
+	ICMP_HEADER(packet)->body32 = scan_randomness;
+}
 
-		udp_checksum(IP_FRAME(packet), UDP_HEADER(packet), dlen);
-		rawsock_send(packet, FRAME_ETH_SIZE + FRAME_IP_SIZE + UDP_HEADER_SIZE + dlen);
+static void send_icmp(uint8_t *packet, const uint8_t *dstaddr)
+{
+	const unsigned int dlen = measure_rtt ? ICMP_RTT_PAYLOAD : 0;
 
-		RATE_CONTROL();
+	rawsock_ip_modify(IP_FRAME(packet), ICMP_HEADER_SIZE + dlen, dstaddr);
+	if(measure_rtt) {
+		uint64_t now = realtime_us();
+		memcpy(ICMP_DATA(packet), &now, sizeof(now));
 	}
-
-	atomic_fetch_or(&status_bits, SEND_FINISHED);
-	return NULL;
-err:
-	atomic_fetch_or(&status_bits, ERROR_SEND_THREAD);
-	return NULL;
+	icmp_checksum(IP_FRAME(packet), ICMP_HEADER(packet), dlen);
+	rawsock_send(packet, FRAME_ETH_SIZE + FRAME_IP_SIZE + ICMP_HEADER_SIZE + dlen);
 }
 
-static void *send_thread_icmp(void *unused)
+static void *send_thread(void *unused)
 {
-	uint8_t _Alignas(uint32_t) packet[FRAME_ETH_SIZE + FRAME_IP_SIZE + ICMP_HEADER_SIZE];
+	// one prepared packet per protocol, only the variable parts change per probe
+	uint8_t _Alignas(uint32_t) tcp_packet[TCP_PACKET_SIZE];
+	uint8_t _Alignas(uint32_t) udp_packet[UDP_PACKET_SIZE];
+	uint8_t _Alignas(uint32_t) icmp_packet[ICMP_PACKET_SIZE];
+	struct probe_gen gen = {0};
 	uint8_t dstaddr[16];
+	uint32_t probe;
+	bool first;
 
 	(void) unused;
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	set_thread_name("send");
 
-	rawsock_eth_prepare(ETH_FRAME(packet), ETH_TYPE_IPV6);
-	rawsock_ip_prepare(IP_FRAME(packet), IP_TYPE_ICMPV6);
-	if(target_gen_next(dstaddr) < 0)
+	if(probe_gen_init(&gen) < 0)
 		goto err;
-	rawsock_ip_modify(IP_FRAME(packet), ICMP_HEADER_SIZE, dstaddr);
-	ICMP_HEADER(packet)->type = 128; // Echo Request
-	ICMP_HEADER(packet)->code = 0;
-	ICMP_HEADER(packet)->body32 = scan_randomness;
+	if(scan_tcp)
+		prepare_tcp(tcp_packet);
+	if(scan_udp)
+		prepare_udp(udp_packet);
+	if(scan_icmp)
+		prepare_icmp(icmp_packet);
 
 	while(1) {
-		icmp_checksum(IP_FRAME(packet), ICMP_HEADER(packet), 0);
-		rawsock_send(packet, sizeof(packet));
-
-		RATE_CONTROL();
+		// wait for banner sessions to drain if there are too many
+		if(banners && scan_tcp) {
+			while(scan_responder_throttle())
+				usleep(1000);
+		}
 
-		// Next target
-		if(target_gen_next(dstaddr) < 0)
+		int r = next_probe(&gen, dstaddr, &probe, &first);
+		if(r < 0)
 			break;
-		rawsock_ip_modify(IP_FRAME(packet), ICMP_HEADER_SIZE, dstaddr);
+		if(r == 0) {
+			usleep(1000);
+			continue;
+		}
+
+		switch(PROBE_PROTO(probe)) {
+			case OUTPUT_PROTO_TCP:
+				send_tcp(tcp_packet, dstaddr, PROBE_PORT(probe));
+				break;
+			case OUTPUT_PROTO_UDP:
+				send_udp(udp_packet, dstaddr, PROBE_PORT(probe));
+				break;
+			case OUTPUT_PROTO_ICMP:
+				send_icmp(icmp_packet, dstaddr);
+				gen.last_echo = monotonic_ms();
+				break;
+		}
+		if(first && retries && scan_retry_add(dstaddr, probe) < 0)
+			goto err;
+
+		RATE_CONTROL();
 	}
 
 	atomic_fetch_or(&status_bits, SEND_FINISHED);
@@ -437,16 +829,16 @@ static void recv_handler(uint64_t ts, int len, const uint8_t *packet)
 	if(v != ETH_TYPE_IPV6 || len < FRAME_ETH_SIZE + FRAME_IP_SIZE)
 		goto perr;
 	rawsock_ip_decode(IP_FRAME(packet), &v, NULL, NULL, &csrcaddr, NULL);
-	if(v != ip_type) // is this the ip type we expect?
-		goto perr;
 
-	// handle
-	if(ip_type == IP_TYPE_TCP)
+	// handle (ICMPv6 is always let through for errors)
+	if(v == IP_TYPE_TCP && scan_tcp)
 		recv_handler_tcp(ts, len, packet, csrcaddr);
-	else if(ip_type == IP_TYPE_UDP)
+	else if(v == IP_TYPE_UDP && scan_udp)
 		recv_handler_udp(ts, len, packet, csrcaddr);
-	else // IP_TYPE_ICMPV6
+	else if(v == IP_TYPE_ICMPV6)
 		recv_handler_icmp(ts, len, packet, csrcaddr);
+	else
+		goto perr;
 
 	return;
 	perr: ;
@@ -463,11 +855,26 @@ static void recv_handler_tcp(uint64_t ts, int len, const uint8_t *packet, const
 	// Output stuff
 	if(TCP_HEADER(packet)->f_ack && (TCP_HEADER(packet)->f_syn || TCP_HEADER(packet)->f_rst)) {
 		int v, v2;
+		uint32_t rtt = 0;
 		tcp_decode(TCP_HEADER(packet), &v, NULL);
 		rawsock_ip_decode(IP_FRAME(packet), NULL, NULL, &v2, NULL, NULL);
+		if(measure_rtt) {
+			unsigned int data_offset;
+			uint32_t tsval, tsecr;
+			tcp_decode_header(TCP_HEADER(packet), &data_offset);
+			if(len >= FRAME_ETH_SIZE + FRAME_IP_SIZE + data_offset &&
+				tcp_decode_timestamp(TCP_HEADER(packet), &tsval, &tsecr))
+				rtt = scan_rtt(ts, tsecr);
+			rtt_record(rtt);
+		}
+		if(retries)
+			scan_retry_answered(csrcaddr, PROBE_ID(OUTPUT_PROTO_TCP, v));
+		if(alias_len && TCP_HEADER(packet)->f_syn &&
+			check_alias(ts, csrcaddr, OUTPUT_PROTO_TCP, v))
+			return;
 		int st = TCP_HEADER(packet)->f_syn ? OUTPUT_STATUS_OPEN : OUTPUT_STATUS_CLOSED;
 		if(outdef.raw || show_closed || TCP_HEADER(packet)->f_syn)
-			outdef.output_status(outfile, ts, csrcaddr, OUTPUT_PROTO_TCP, v, v2, st);
+			scan_output_status(ts, csrcaddr, OUTPUT_PROTO_TCP, v, v2, rtt, st);
 	}
 	// Pass packet to responder
 	if(banners)
@@ -487,24 +894,28 @@ static void recv_handler_udp(uint64_t ts, int len, const uint8_t *packet, const
 
 	int v;
 	udp_decode(UDP_HEADER(packet), &v, NULL);
+	if(retries)
+		scan_retry_answered(csrcaddr, PROBE_ID(OUTPUT_PROTO_UDP, v));
+	if(alias_len && check_alias(ts, csrcaddr, OUTPUT_PROTO_UDP, v))
+		return;
 	if(!banners) {
 		// We got an answer, that's already noteworthy enough
 		int v2;
 		rawsock_ip_decode(IP_FRAME(packet), NULL, NULL, &v2, NULL, NULL);
-		outdef.output_status(outfile, ts, csrcaddr, OUTPUT_PROTO_UDP, v, v2, OUTPUT_STATUS_OPEN);
+		scan_output_status(ts, csrcaddr, OUTPUT_PROTO_UDP, v, v2, 0, OUTPUT_STATUS_OPEN);
 		return;
 	}
 
 	uint32_t plen = len - (FRAME_ETH_SIZE + FRAME_IP_SIZE + UDP_HEADER_SIZE);
 	if(plen == 0)
 		return;
-	else if(plen > BANNER_MAX_LENGTH)
-		plen = BANNER_MAX_LENGTH;
+	else if(plen > banner_max)
+		plen = banner_max;
 	char temp[BANNER_MAX_LENGTH];
 	memcpy(temp, UDP_DATA(packet), plen);
 	if(!outdef.raw)
 		banner_postprocess(IP_TYPE_UDP, v, temp, &plen);
-	outdef.output_banner(outfile, ts, csrcaddr, OUTPUT_PROTO_UDP, v, temp, plen);
+	scan_output_banner(ts, csrcaddr, OUTPUT_PROTO_UDP, v, 0, temp, plen);
 
 	return;
 	perr: ;
@@ -518,7 +929,11 @@ static void recv_handler_icmp(uint64_t ts, int len, const uint8_t *packet, const
 	const int minlen = FRAME_ETH_SIZE + FRAME_IP_SIZE + ICMP_HEADER_SIZE;
 	if(len < minlen)
 		goto perr;
-	else if(len != minlen)
+	if(ICMP_HEADER(packet)->type == 1) { // Destination Unreachable
+		recv_handler_icmp_error(ts, len, packet);
+		return;
+	}
+	if(!scan_icmp || len != minlen + (measure_rtt ? ICMP_RTT_PAYLOAD : 0))
 		return;
 
 	if(ICMP_HEADER(packet)->type != 129) // Echo Reply
@@ -526,9 +941,93 @@ static void recv_handler_icmp(uint64_t ts, int len, const uint8_t *packet, const
 	if(ICMP_HEADER(packet)->body32 != scan_randomness)
 		return;
 
+	if(retries)
+		scan_retry_answered(csrcaddr, PROBE_ID(OUTPUT_PROTO_ICMP, 0));
+	if(alias_len && check_alias(ts, csrcaddr, OUTPUT_PROTO_ICMP, 0))
+		return;
+	if(sweep && scan_sweep_add(csrcaddr) < 0)
+		atomic_fetch_or(&status_bits, ERROR_RECV_THREAD);
+
 	int v2;
+	uint32_t rtt = 0;
 	rawsock_ip_decode(IP_FRAME(packet), NULL, NULL, &v2, NULL, NULL);
-	outdef.output_status(outfile, ts, csrcaddr, OUTPUT_PROTO_ICMP, 0, v2, OUTPUT_STATUS_UP);
+	if(measure_rtt) {
+		uint64_t sent;
+		memcpy(&sent, ICMP_DATA(packet), sizeof(sent));
+		rtt = scan_rtt(ts, (uint32_t) sent);
+		rtt_record(rtt);
+	}
+	scan_output_status(ts, csrcaddr, OUTPUT_PROTO_ICMP, 0, v2, rtt, OUTPUT_STATUS_UP);
+
+	return;
+	perr: ;
+#ifndef NDEBUG
+	log_raw("%s: errored packet of length %d", __func__, len);
+#endif
+}
+
+static void recv_handler_icmp_error(uint64_t ts, int len, const uint8_t *packet)
+{
+	// the error quotes our probe: IPv6 header and at least 8 bytes of what follows
+	if(len < FRAME_ETH_SIZE + FRAME_IP_SIZE + ICMP_HEADER_SIZE + FRAME_IP_SIZE + 8)
+		goto perr;
+	if(ICMP_HEADER(packet)->type != 1) // Destination Unreachable
+		return;
+	const int code = ICMP_HEADER(packet)->code;
+	const uint8_t *quoted = ICMP_DATA(packet) - FRAME_ETH_SIZE; // so the usual macros work
+	const int qlen = len - (FRAME_ETH_SIZE + FRAME_IP_SIZE + ICMP_HEADER_SIZE);
+
+	int v, ttl, port, proto;
+	const uint8_t *qsrcaddr, *qdstaddr;
+	rawsock_ip_decode(IP_FRAME(quoted), &v, NULL, NULL, &qsrcaddr, &qdstaddr);
+	if(memcmp(qsrcaddr, source_addr, 16) != 0)
+		return;
+
+	// check that it was really one of ours
+	if(v == IP_TYPE_TCP && scan_tcp) {
+		if(qlen < FRAME_IP_SIZE + TCP_HEADER_SIZE)
+			return;
+		int sport;
+		uint32_t seqnum;
+		tcp_decode(TCP_HEADER(quoted), &sport, &port);
+		tcp_decode2(TCP_HEADER(quoted), &seqnum, NULL);
+		if(seqnum != tcp_first_seqnum(scan_randomness) ||
+			(source_port != -1 && sport != source_port))
+			return;
+		proto = OUTPUT_PROTO_TCP;
+	} else if(v == IP_TYPE_UDP && scan_udp) {
+		int sport;
+		udp_decode(UDP_HEADER(quoted), &sport, &port);
+		if(sport != (source_port != -1 ? source_port : source_port_udp(qdstaddr, port)))
+			return;
+		proto = OUTPUT_PROTO_UDP;
+	} else if(v == IP_TYPE_ICMPV6 && scan_icmp) {
+		if(ICMP_HEADER(quoted)->type != 128 || ICMP_HEADER(quoted)->body32 != scan_randomness)
+			return;
+		port = 0;
+		proto = OUTPUT_PROTO_ICMP;
+	} else {
+		return;
+	}
+
+	if(retries)
+		scan_retry_answered(qdstaddr, PROBE_ID(proto, port));
+
+	int st;
+	if(code == 4) { // port unreachable
+		st = OUTPUT_STATUS_CLOSED;
+	} else if(code == 1 || code == 5 || code == 6) { // admin. prohibited, policy or reject route
+		st = OUTPUT_STATUS_FILTERED;
+	} else {
+		st = OUTPUT_STATUS_UNREACHABLE;
+	}
+	// no route or reject route: nothing else in this prefix will be reachable
+	if(prune_len && (code == 0 || code == 6))
+		scan_prune_add(qdstaddr);
+
+	rawsock_ip_decode(IP_FRAME(packet), NULL, NULL, &ttl, NULL, NULL);
+	if(outdef.raw || show_closed)
+		scan_output_status(ts, qdstaddr, proto, port, ttl, 0, st);
 
 	return;
 	perr: ;
@@ -537,8 +1036,190 @@ static void recv_handler_icmp(uint64_t ts, int len, const uint8_t *packet, const
 #endif
 }
 
+// returns true if the response should be dropped
+static bool check_alias(uint64_t ts, const uint8_t *addr, int proto, int port)
+{
+	uint8_t prefix[16];
+	int r = scan_alias_response(addr, PROBE_ID(proto, port), prefix);
+	if(r == ALIAS_DETECTED) {
+#ifndef NDEBUG
+		char buf[IPV6_STRING_MAX];
+		ipv6_string(buf, prefix);
+		log_debug("aliased prefix: %s/%d", buf, alias_len);
+#endif
+		// (prefix length in place of the ttl)
+		scan_output_status(ts, prefix, proto, port, alias_len, 0, OUTPUT_STATUS_ALIASED);
+	}
+	return r != ALIAS_NONE;
+}
+
+static bool ports_contain(const struct ports *p, uint16_t port)
+{
+	for(int i = 0; i < PORTS_MAX_RANGES; i++) {
+		if(p->r[i].begin > p->r[i].end)
+			break;
+		if(port >= p->r[i].begin && port <= p->r[i].end)
+			return true;
+	}
+	return false;
+}
+
+static void output_removed(const uint8_t *addr, int proto, uint16_t port)
+{
+	// results for probes this scan didn't send can't have gone away
+	bool probed;
+	if(proto == OUTPUT_PROTO_TCP)
+		probed = scan_tcp && ports_contain(&tcp_ports, port);
+	else if(proto == OUTPUT_PROTO_UDP)
+		probed = scan_udp && ports_contain(&udp_ports, port);
+	else
+		probed = scan_icmp;
+	// nor can those for targets that were skipped (at least partially)
+	if((alias_len && scan_alias_contains(addr)) || (prune_len && scan_prune_contains(addr)))
+		probed = false;
+	else if(sweep && proto != OUTPUT_PROTO_ICMP && probed && !scan_sweep_contains(addr))
+		probed = false;
+	// (passes the diff check once, since it's negative)
+	if(probed)
+		scan_output_status(realtime_us(), addr, proto, port, 0, 0, OUTPUT_STATUS_CLOSED);
+}
+
 /****/
 
+#define RATE_DECREASE     0.7f
+#define RATE_STEPS        64 // additive increase is 1/n of the configured range
+#define RATE_MIN_REPLIES  50 // expected replies per interval to trust the reply ratio
+
+static struct {
+	unsigned int ceiling, step;
+	unsigned int drops, last_sent;
+	float baseline; // reply ratio while not congested
+	bool slow_start;
+	int hold;
+} arate;
+
+static void rate_init(void)
+{
+	arate.ceiling = atomic_load(&max_rate) + 1;
+	arate.step = (arate.ceiling - min_rate) / RATE_STEPS;
+	if(arate.step == 0)
+		arate.step = 1;
+	arate.drops = 0;
+	rawsock_stats(&arate.drops);
+	arate.last_sent = 0;
+	arate.baseline = 0;
+	arate.slow_start = true;
+	arate.hold = 0;
+	atomic_store(&max_rate, min_rate - 1);
+}
+
+// AIMD: increase by a fixed step (doubling until the first congestion) while
+// the limit is being reached, decrease multiplicatively if the capture drops
+// packets or the reply ratio collapses.
+static void rate_adjust(unsigned int sent, unsigned int recv)
+{
+	unsigned int drops = arate.drops, new_drops;
+	if(rawsock_stats(&drops) < 0)
+		drops = arate.drops;
+	new_drops = drops - arate.drops;
+	arate.drops = drops;
+
+	// replies lag behind, so average over the last two intervals
+	unsigned int avg_sent = (sent + arate.last_sent) / 2;
+	arate.last_sent = sent;
+	if(arate.hold > 0) {
+		arate.hold--;
+		return;
+	}
+
+	unsigned int rate = atomic_load(&max_rate) + 1;
+	float ratio = avg_sent > 0 ? (float)recv / avg_sent : 0;
+	bool congested = new_drops > 0;
+	if(arate.baseline * avg_sent >= RATE_MIN_REPLIES && ratio < arate.baseline / 2)
+		congested = true;
+
+	if(congested) {
+		rate = rate * RATE_DECREASE;
+		if(rate < min_rate)
+			rate = min_rate;
+		arate.slow_start = false;
+		arate.hold = 1; // replies to the old rate are still arriving
+		log_debug("rate: decreased to %u (%u drops, reply ratio %.4f vs %.4f)",
+			rate, new_drops, ratio, arate.baseline);
+	} else {
+		if(avg_sent > 0)
+			arate.baseline = arate.baseline == 0 ? ratio : arate.baseline * 0.875f + ratio * 0.125f;
+		// only speed up if the limit is actually what holds us back
+		if(sent + sent / 8 >= rate) {
+			if(arate.slow_start)
+				rate = rate > arate.ceiling / 2 ? arate.ceiling : rate * 2;
+			else
+				rate = rate + arate.step > arate.ceiling ? arate.ceiling : rate + arate.step;
+		}
+	}
+	atomic_store(&max_rate, rate - 1);
+}
+
+/****/
+
+static void rtt_record(uint32_t rtt)
+{
+	if(rtt == 0)
+		return;
+	int i = 0;
+	while(rtt >>= 1)
+		i++;
+	atomic_fetch_add(&rtt_hist[i], 1);
+}
+
+static void rtt_snapshot(unsigned int *hist)
+{
+	for(int i = 0; i < RTT_HIST_BUCKETS; i++)
+		hist[i] = atomic_load(&rtt_hist[i]);
+}
+
+static uint32_t rtt_percentile(const unsigned int *hist, int percent)
+{
+	uint64_t total = 0, sum = 0;
+	for(int i = 0; i < RTT_HIST_BUCKETS; i++)
+		total += hist[i];
+	if(total == 0)
+		return 0;
+	for(int i = 0; i < RTT_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if(sum * 100 >= total * percent)
+			return UINT32_C(1) << i; // lower bound of bucket
+	}
+	return 0;
+}
+
+static void rtt_print_histogram(void)
+{
+	unsigned int hist[RTT_HIST_BUCKETS], max = 0;
+	int first = -1, last = -1;
+	rtt_snapshot(hist);
+	for(int i = 0; i < RTT_HIST_BUCKETS; i++) {
+		if(hist[i] == 0)
+			continue;
+		if(first == -1)
+			first = i;
+		last = i;
+		if(hist[i] > max)
+			max = hist[i];
+	}
+	if(first == -1)
+		return;
+
+	fprintf(stderr, "RTT histogram (p50 >= %.1fms, p90 >= %.1fms):\n",
+		rtt_percentile(hist, 50) / 1000.0f, rtt_percentile(hist, 90) / 1000.0f);
+	for(int i = first; i <= last; i++) {
+		char bar[41] = {0};
+		memset(bar, '#', (uint64_t)hist[i] * 40 / max);
+		fprintf(stderr, "%9.3f - %9.3f ms: %8u %s\n",
+			(UINT32_C(1) << i) / 1000.0f, (UINT64_C(1) << (i+1)) / 1000.0f, hist[i], bar);
+	}
+}
+
 static inline int source_port_rand(void)
 {
 	int v;
@@ -547,3 +1228,16 @@ static inline int source_port_rand(void)
 		v = 16384;
 	return v;
 }
+
+// UDP has no sequence number, so the port itself tells our probes apart
+static inline int source_port_udp(const uint8_t *dstaddr, int dstport)
+{
+	uint64_t a, b;
+	memcpy(&a, dstaddr, 8);
+	memcpy(&b, &dstaddr[8], 8);
+	uint64_t h = (a ^ scan_randomness) * UINT64_C(0x9e3779b97f4a7c15);
+	h = (h ^ (h >> 29) ^ b) * UINT64_C(0xbf58476d1ce4e5b9);
+	h = (h ^ (h >> 32) ^ (uint64_t) dstport) * UINT64_C(0x94d049bb133111eb);
+	h ^= h >> 31;
+	return 16384 + (int) (h % (65536 - 16384));
+}
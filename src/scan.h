@@ -5,23 +5,51 @@
 #pragma once
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 struct outputdef;
 struct ports;
+struct rec_header;
+struct block_header;
 
 #define STATS_INTERVAL   1000 // ms
 #define FINISH_WAIT_TIME 5    // s
 #define BANNER_TIMEOUT   2500 // ms
+#define BANNER_TICK      10   // ms, how often expired sessions are checked
+#define BANNER_ACK_DELAY 20   // ms, longest an ACK is delayed
+#define BANNER_ACK_EVERY 2    // segments, at least this often ACKs are sent
+#define RTT_MAX          60000000 // us, anything longer is considered bogus
+#define SWEEP_WAIT       3000 // ms, how long late echo replies are waited for after the sweep
+#define OUTPUT_BATCH_SIZE (4 << 20) // bytes, output is written in chunks of up to this size
 
-void scan_set_general(const struct ports *ports, int max_rate, int show_closed, int banners);
-void scan_set_network(const uint8_t *source_addr, int source_port, uint8_t ip_type);
+void scan_set_general(int max_rate, int show_closed, int banners);
+void scan_set_network(const uint8_t *source_addr, int source_port);
+void scan_set_protocols(const struct ports *tcp_ports, const struct ports *udp_ports, bool icmp); // NULL = not scanned
 void scan_set_output(FILE *outfile, const struct outputdef *outdef);
+void scan_set_rtt(int measure_rtt);
+void scan_set_tcp_mss(unsigned int tcp_mss); // 0 = no MSS option
+void scan_set_banner_limits(unsigned int banner_max, unsigned int max_sessions);
+void scan_set_min_rate(unsigned int min_rate); // != 0 enables adaptive rate control up to max_rate
+void scan_set_retries(unsigned int retries, unsigned int interval_ms); // 0 = no retransmissions
+void scan_set_prefix_limit(unsigned int rate, int prefix_len); // 0 = unlimited
+void scan_set_alias_detection(int prefix_len); // 0 = disabled
+void scan_set_pruning(int prefix_len); // 0 = disabled
+void scan_set_sweep(int sweep); // only port scan hosts that answer ICMP
+void scan_set_dedup(double fp_rate); // 0 = disabled
+void scan_set_diff(FILE *baseline); // NULL = disabled
 int scan_main(const char *interface, int quiet);
-void scan_print_summary(const struct ports *ports, int max_rate, int banners, uint8_t ip_type);
+void scan_print_summary(const struct ports *tcp_ports, const struct ports *udp_ports, bool icmp, int max_rate, int banners, int measure_rtt, unsigned int tcp_mss);
 
 void scan_reader_set_general(int show_closed, int banners);
+void scan_reader_set_parallel(int threads, int unordered); // 0 threads = one per CPU
+void scan_reader_set_stats(int prefix_len, bool exact); // prefix_len < 0 = output records instead
 void scan_reader_set_output(FILE *outfile, const struct outputdef *outdef);
 int scan_reader_main(FILE *infile);
+int scan_filter_add(const char *expr); // "<key>=<value>", -1 if invalid
+
+int scan_merge_init(unsigned int memory_mb); // memory used for sorting before spilling to disk
+const struct outputdef *scan_merge_collector(void); // pass to scan_reader_set_output() for each input
+int scan_merge_finish(FILE *outfile, const struct outputdef *outdef);
 
 /*** INTERNAL ***/
 
@@ -32,8 +60,104 @@ int scan_reader_main(FILE *infile);
 #define ICMP_HEADER(buf) ( (struct icmp_header*) &(buf)[FRAME_ETH_SIZE + FRAME_IP_SIZE] )
 #define TCP_DATA(buf, data_offset) ( (uint8_t*) &(buf)[FRAME_ETH_SIZE + FRAME_IP_SIZE + data_offset] )
 #define UDP_DATA(buf) TCP_DATA(buf, UDP_HEADER_SIZE)
+#define ICMP_DATA(buf) TCP_DATA(buf, ICMP_HEADER_SIZE)
+
+#define ICMP_RTT_PAYLOAD 8 // send timestamp echoed back to us
+
+// a probe is identified by protocol (OUTPUT_PROTO_*) and port within its target
+#define PROBE_ID(proto, port) ( (uint32_t)(proto) << 16 | (port) )
+#define PROBE_PROTO(probe) ( (int)((probe) >> 16) )
+#define PROBE_PORT(probe) ( (int)((probe) & 0xffff) )
+
+// calculates RTT from capture timestamp and (truncated) send timestamp, 0 = invalid
+static inline uint32_t scan_rtt(uint64_t ts, uint32_t sent) {
+	uint32_t rtt = (uint32_t)ts - sent;
+	if(rtt > RTT_MAX)
+		return 0;
+	return rtt == 0 ? 1 : rtt;
+}
 
-int scan_responder_init(FILE *outfile, const struct outputdef *outdef, uint16_t source_port, uint32_t scan_randomness);
+int scan_responder_init(const struct outputdef *outdef, uint16_t source_port, uint32_t scan_randomness, unsigned int banner_max, unsigned int max_sessions);
 void scan_responder_process(uint64_t ts, int len, const uint8_t *rpacket);
-void scan_responder_stats(unsigned int *pkts_sent);
+void scan_responder_stats(unsigned int *pkts_sent, unsigned int *sessions_shed);
+bool scan_responder_throttle(void); // should the sender wait for sessions to drain?
 void scan_responder_finish();
+
+// results are handed to a writer thread, these never block on I/O
+int scan_output_init(FILE *outfile, const struct outputdef *outdef);
+void scan_output_fini(void); // writes everything that is still queued, producers must have stopped
+void scan_output_status(uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint8_t ttl, uint32_t rtt, int status);
+void scan_output_banner(uint64_t ts, const uint8_t *addr, int proto, uint16_t port, uint32_t rtt, const char *banner, uint32_t bannerlen);
+
+#define DEDUP_MIN_BITS 16
+#define DEDUP_MAX_BITS 31 // 256 MiB
+#define DEDUP_MAX_HASHES 24
+int scan_dedup_init(uint64_t entries, double fp_rate);
+void scan_dedup_fini(void);
+bool scan_dedup_seen(const uint8_t *addr, uint32_t key); // always false if disabled
+unsigned int scan_dedup_stats(void);
+
+int scan_diff_init(FILE *baseline, bool postprocess); // postprocess: compare banners as output_banner() sees them
+void scan_diff_fini(void);
+bool scan_diff_status(const uint8_t *addr, int proto, uint16_t port, int status); // always true if disabled
+bool scan_diff_banner(const uint8_t *addr, int proto, uint16_t port, const char *banner, uint32_t bannerlen); // (same)
+void scan_diff_removed(void (*cb)(const uint8_t *addr, int proto, uint16_t port)); // baseline results not seen again (if enabled)
+unsigned int scan_diff_stats(void);
+
+int scan_retry_init(unsigned int retries, unsigned int interval_ms, unsigned int max_rate); // max_rate 0 = unlimited
+void scan_retry_fini(void);
+int scan_retry_add(const uint8_t *addr, uint32_t probe); // after first sending a probe
+bool scan_retry_answered(const uint8_t *addr, uint32_t probe); // returns false if already answered
+int scan_retry_next(uint8_t *addr, uint32_t *probe); // returns 1 if a probe needs to be retransmitted
+bool scan_retry_pending(void);
+unsigned int scan_retry_stats(void);
+
+#define ALIAS_SUSPECT_HOSTS 8 // responding hosts in a prefix before it is checked for aliasing
+#define ALIAS_PROBES 16 // one per nibble value
+#define ALIAS_QUEUE_SIZE 256
+#define ALIAS_VERIFY_WAIT 3000 // ms, how long verification replies are waited for (plus retransmissions)
+#define ALIAS_VERIFY_ATTEMPTS 3 // before a prefix is considered not aliased
+enum {
+	ALIAS_NONE = 0,
+	ALIAS_SUPPRESS, // don't report this response
+	ALIAS_DETECTED, // prefix was just found to be aliased
+};
+int scan_alias_init(int prefix_len, unsigned int verify_wait_ms);
+void scan_alias_fini(void);
+// called for every positive response, <prefix> is set with ALIAS_DETECTED
+int scan_alias_response(const uint8_t *addr, uint32_t probe, uint8_t *prefix);
+bool scan_alias_pruned(const uint8_t *addr); // is this target in an aliased prefix? (counts it as skipped)
+bool scan_alias_contains(const uint8_t *addr); // same, without counting
+int scan_alias_next(uint8_t *addr, uint32_t *probe); // returns 1 if a verification probe needs to be sent
+unsigned int scan_alias_stats(void);
+
+int scan_prune_init(int prefix_len);
+void scan_prune_fini(void);
+void scan_prune_add(const uint8_t *addr); // prefix of addr is unroutable
+bool scan_prune_check(const uint8_t *addr); // should this target be skipped? (counts it as skipped)
+bool scan_prune_contains(const uint8_t *addr); // same, without counting
+unsigned int scan_prune_stats(unsigned int *nprefixes);
+
+bool scan_filter_record(const struct rec_header *h, const char *data);
+bool scan_filter_block(const struct block_header *h); // false if no record in it can match
+
+void scan_stats_init(int prefix_len, bool exact);
+void scan_stats_fini(void);
+int scan_stats_record(const struct rec_header *h); // may be called from any thread
+int scan_stats_print(FILE *f);
+
+int scan_sweep_init(void);
+void scan_sweep_fini(void);
+int scan_sweep_add(const uint8_t *addr); // host answered the sweep (again)
+int scan_sweep_next(uint8_t *addr); // returns 1 if a host is waiting to be port scanned
+bool scan_sweep_contains(const uint8_t *addr); // was this host queued for port scanning?
+unsigned int scan_sweep_stats(void);
+
+int scan_limit_init(unsigned int rate, int prefix_len);
+void scan_limit_fini(void);
+// returns 1 if the probe can be sent now, 0 if it was deferred (-1 on error)
+int scan_limit_admit(const uint8_t *addr, uint32_t probe, bool first);
+int scan_limit_next(uint8_t *addr, uint32_t *probe, bool *first); // returns 1 if a deferred probe is due
+bool scan_limit_full(void); // too many deferred probes, don't add new ones
+bool scan_limit_pending(void);
+unsigned int scan_limit_stats(void);
@@ -217,6 +217,18 @@ int target_gen_next(uint8_t *dst)
 	return -1;
 }
 
+uint64_t target_gen_count(void)
+{
+	if(mode_streaming)
+		return UINT64_MAX;
+
+	uint64_t total = 0;
+	bool total_overflowed = false;
+	for(int i = 0; i < targets_i; i++)
+		count_total(&targets[i], &total, &total_overflowed);
+	return total_overflowed ? UINT64_MAX : total;
+}
+
 void target_gen_print_summary(int max_rate, int nports)
 {
 	if(mode_streaming) {
@@ -26,6 +26,7 @@ void target_gen_fini(void);
 int target_gen_add(const struct targetspec *s);
 int target_gen_finish_add(void);
 void target_gen_print_summary(int max_rate, int nports);
+uint64_t target_gen_count(void); // UINT64_MAX if unknown or too large
 
 int target_gen_peek(uint8_t *dst);
 int target_gen_next(uint8_t *dst);
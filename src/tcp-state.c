@@ -2,13 +2,15 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // Copyright (C) 2016 sfan5 <sfan5@live.de>
 
-#define _POSIX_C_SOURCE 200112L // CLOCK_MONOTONIC
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 #include "tcp.h"
 #include "banner.h"
@@ -16,140 +18,335 @@
 
 enum {
 	TCP_BUFFER_LEN = BANNER_MAX_LENGTH,
-	TCP_STATES_PER_CHUNK = 256,
+	TCP_BUFFER_MIN_SHIFT = 7, // smallest buffer is 128 bytes
+	TCP_BUFFER_CLASSES = 6, // ... and largest is TCP_BUFFER_LEN
+	TCP_SLAB_SIZE = 64 * 1024, // must be power of two
+	TCP_SHARD_BITS = 6,
+	TCP_SHARDS = 1 << TCP_SHARD_BITS,
+	TCP_SHARD_INITIAL = 64, // initial number of states per shard
+	TCP_WHEEL_SLOTS = 4096, // one per ms, must be power of two
+	TCP_MAX_RANGES = 4, // out-of-order ranges tracked per session
 };
 
-#define TCP_PTR_CHUNK(ptr) ((struct tcp_states_chunk*) (ptr)->c)
-#define TCP_PTR_STATE(ptr) TCP_PTR_CHUNK(ptr)->s[(ptr)->i]
-#define TCP_PTR_STATE_BUF(ptr) (&TCP_PTR_CHUNK(ptr)->big_buffer[TCP_BUFFER_LEN * (ptr)->i])
+#define TCP_PTR_SHARD(ptr) ((struct tcp_shard*) (ptr)->c)
+#define TCP_PTR_STATE(ptr) TCP_PTR_SHARD(ptr)->s[(ptr)->i]
+
+static_assert((1 << (TCP_BUFFER_MIN_SHIFT + TCP_BUFFER_CLASSES - 1)) == TCP_BUFFER_LEN, "");
 
 struct tcp_state {
 	// remote endpoint
 	uint8_t srcaddr[16];
 	uint16_t srcport; // == 0 indicates free entry
+	uint32_t hash; // (lower bits of) hash of the above
 
 	// timestamps
-	uint32_t saved_timestamp;
-	uint64_t creation_time; // monotonic, in ms
+	uint64_t saved_timestamp; // in us
+	uint64_t expire_time; // monotonic, in ms
+	uint64_t ack_time; // monotonic, in ms, 0 = no delayed ACK pending
+	uint32_t rtt; // in us, 0 = unknown
 
 	// local state
 	uint32_t next_lseqnum; // seqnum of next packet we would be sending
 	unsigned have_fin : 1;
+	uint8_t step; // of multi-step conversation
+	// pending ACK
+	unsigned ack_have_ts : 1;
+	uint8_t ack_segments;
+	uint32_t ack_num, ack_tsval;
 
 	// remote sequence numbers
 	uint32_t first_rseqnum; // == <seqnum of syn-ack> + 1
-	uint32_t max_rseqnum; // highest seen of (seqnum + payload len)
-
-	// received data is stored in parent buffer, see TCP_PTR_STATE_BUF
+	// received data as offsets from first_rseqnum:
+	uint16_t contig; // [0, contig) is complete
+	uint8_t n_ranges;
+	struct { uint16_t start, end; } ranges[TCP_MAX_RANGES]; // sorted, past contig
+
+	// received data, allocated on demand and grown as needed
+	char *buf;
+	uint16_t buf_size;
+
+	// timing wheel links (index + 1), also used for the free list
+	uint32_t wheel_prev, wheel_next;
+	uint16_t wheel_slot;
+	unsigned in_wheel : 1;
 };
 
-struct tcp_states_chunk {
-	// Locked while any of the states inside this chunk may be read/written.
+/*
+ * The session table is split into shards by hash, each with its own lock
+ * so that the scan thread and tcp thread rarely contend.
+ * Inside a shard the states are found via an open addressing hash index
+ * (linear probing, backward-shift deletion). Free slots are kept in a list.
+ * Expiry is tracked with a timing wheel of 1ms slots, so that expired
+ * sessions can be found without looking at every other one. Delayed ACKs
+ * are scheduled on the same wheel.
+ */
+struct tcp_shard {
+	// Locked while any of the states inside this shard may be read/written.
 	// This happens on two threads:
 	// - scan thread: _create, _push and _add_seqnum
 	// - tcp thread: _next_expired, _destroy and the _get methods
 	pthread_mutex_t lock;
 
-	struct tcp_state s[TCP_STATES_PER_CHUNK];
-	struct tcp_states_chunk *next;
-
-	char big_buffer[TCP_BUFFER_LEN * TCP_STATES_PER_CHUNK];
+	struct tcp_state *s;
+	uint32_t capacity, used; // storage size, slots ever used
+	uint32_t count; // live entries
+	uint32_t free_head; // (index + 1) or 0
+
+	uint32_t *index; // entries are (index + 1) or 0
+	uint32_t index_mask;
+
+	uint32_t *wheel; // list heads (index + 1) or 0
+	uint64_t wheel_time; // time of next slot to be processed
+	uint32_t wheel_count;
+} __attribute__((aligned(64)));
+
+static struct tcp_shard shards[TCP_SHARDS];
+static uint64_t hash_seed;
+static uint32_t buffer_max;
+static unsigned int max_sessions; // 0 = unlimited
+static atomic_uint session_count;
+
+/*
+ * Receive buffers come from slabs of TCP_SLAB_SIZE, one size class each.
+ * Slabs are aligned to their size so the owning slab can be found from a
+ * block pointer. Slabs that become empty are returned to the OS, except
+ * for one per class that is kept around.
+ */
+struct tcp_slab {
+	struct tcp_slab *prev, *next; // list of slabs with free blocks
+	void *free; // free list of blocks
+	uint32_t used;
+	uint8_t cls;
 };
 
-static struct tcp_states_chunk *first;
-
-
-static int create_chunk(struct tcp_states_chunk **dest);
-static void internal_find_empty(tcp_state_ptr *out_p);
-static int internal_find(const uint8_t *srcaddr, uint16_t srcport, tcp_state_ptr *out_p);
-// !! caller is expected to hold chunk lock
-static void internal_push(tcp_state_ptr *p, void *data, uint32_t length, uint32_t seqnum);
+static struct {
+	pthread_mutex_t lock;
+	struct tcp_slab *partial;
+	uint32_t slabs, peak_slabs;
+} buffer_pool[TCP_BUFFER_CLASSES];
+
+
+static inline uint64_t hash_key(const uint8_t *srcaddr, uint16_t srcport);
+static inline struct tcp_shard *shard_for(uint64_t hash);
+static int shard_init(struct tcp_shard *sh);
+static int shard_grow(struct tcp_shard *sh);
+// !! caller is expected to hold shard lock
+static int internal_alloc(struct tcp_shard *sh, uint32_t *out_i);
+static int internal_find(struct tcp_shard *sh, uint32_t hash, const uint8_t *srcaddr, uint16_t srcport, uint32_t *out_i);
+static void index_insert(struct tcp_shard *sh, uint32_t i);
+static void index_remove(struct tcp_shard *sh, uint32_t i);
+static void wheel_insert(struct tcp_shard *sh, uint32_t i);
+static void wheel_remove(struct tcp_shard *sh, uint32_t i);
+static int wheel_pop(struct tcp_shard *sh, uint64_t now, uint32_t *out_i);
+static void internal_push(tcp_state_ptr *p, const char *data, uint32_t length, uint32_t seqnum);
+static void range_add(struct tcp_state *s, uint16_t start, uint16_t end);
 // !! end
+static char *buffer_alloc(int cls);
+static void buffer_free(char *ptr);
 
-int tcp_state_init(void)
+int tcp_state_init(unsigned int max_buffer, unsigned int max_count)
 {
-	return create_chunk(&first);
+	hash_seed = rand64();
+	max_sessions = max_count;
+	atomic_store(&session_count, 0);
+	buffer_max = max_buffer > TCP_BUFFER_LEN ? TCP_BUFFER_LEN : max_buffer;
+	for(int i = 0; i < TCP_BUFFER_CLASSES; i++) {
+		if(pthread_mutex_init(&buffer_pool[i].lock, NULL) < 0)
+			return -1;
+		buffer_pool[i].partial = NULL;
+		buffer_pool[i].slabs = buffer_pool[i].peak_slabs = 0;
+	}
+	for(int i = 0; i < TCP_SHARDS; i++) {
+		if(shard_init(&shards[i]) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 void tcp_state_fini(void)
 {
-	uint32_t mem = 0;
+	uint64_t mem = 0;
+
+	for(int i = 0; i < TCP_SHARDS; i++) {
+		struct tcp_shard *sh = &shards[i];
+		mem += sh->capacity * sizeof(struct tcp_state);
+		mem += (sh->index_mask + 1 + TCP_WHEEL_SLOTS) * sizeof(uint32_t);
+		for(uint32_t j = 0; j < sh->used; j++) {
+			if(sh->s[j].srcport != 0 && sh->s[j].buf)
+				buffer_free(sh->s[j].buf);
+		}
+		pthread_mutex_destroy(&sh->lock);
+		free(sh->s);
+		free(sh->index);
+		free(sh->wheel);
+		memset(sh, 0, sizeof(*sh));
+	}
 
-	struct tcp_states_chunk *cur = first;
-	first = NULL;
-	do {
-		mem += sizeof(*cur);
-		pthread_mutex_destroy(&cur->lock);
-		void *tmp = cur;
-		cur = cur->next;
-		free(tmp);
-	} while(cur);
+	uint64_t peak = 0;
+	for(int i = 0; i < TCP_BUFFER_CLASSES; i++) {
+		// all buffers are free now, so only cached slabs are left
+		struct tcp_slab *slab = buffer_pool[i].partial;
+		while(slab) {
+			struct tcp_slab *next = slab->next;
+			assert(slab->used == 0);
+			munmap(slab, TCP_SLAB_SIZE);
+			slab = next;
+		}
+		peak += buffer_pool[i].peak_slabs * (uint64_t)TCP_SLAB_SIZE;
+		pthread_mutex_destroy(&buffer_pool[i].lock);
+	}
 
-	log_debug("%" PRIu32 " KB used for tcp states", mem >> 10);
+	log_debug("%" PRIu64 " KB used for tcp states, %" PRIu64 " KB peak for buffers",
+		mem >> 10, peak >> 10);
 }
 
-void tcp_state_create(const uint8_t *srcaddr, uint16_t srcport, uint64_t ts, uint32_t next_lseqnum, uint32_t first_rseqnum)
+int tcp_state_create(const uint8_t *srcaddr, uint16_t srcport, uint64_t ts, uint32_t rtt, uint32_t next_lseqnum, uint32_t first_rseqnum, int timeout_ms)
 {
-	tcp_state_ptr p;
-	internal_find_empty(&p);
+	const uint64_t hash = hash_key(srcaddr, srcport);
+	struct tcp_shard *sh = shard_for(hash);
+	uint32_t i;
+
+	pthread_mutex_lock(&sh->lock);
+	if(internal_find(sh, hash, srcaddr, srcport, &i)) {
+		// duplicate SYN-ACK, keep the existing session
+		pthread_mutex_unlock(&sh->lock);
+		return 0;
+	}
+	if(max_sessions && atomic_fetch_add(&session_count, 1) >= max_sessions) {
+		atomic_fetch_sub(&session_count, 1);
+		pthread_mutex_unlock(&sh->lock);
+		return -1;
+	} else if(!max_sessions) {
+		atomic_fetch_add(&session_count, 1);
+	}
+	if(internal_alloc(sh, &i) < 0) {
+		log_debug("ran out of memory for TCP sessions");
+		atomic_fetch_sub(&session_count, 1);
+		pthread_mutex_unlock(&sh->lock);
+		return -1;
+	}
 
-	struct tcp_state *s = &TCP_PTR_STATE(&p);
+	struct tcp_state *s = &sh->s[i];
 	memcpy(s->srcaddr, srcaddr, 16);
 	s->srcport = srcport;
-	s->saved_timestamp = (uint32_t)ts; // <-- Y2106 problem
-	s->creation_time = monotonic_ms();
+	s->hash = hash;
+	s->saved_timestamp = ts;
+	s->expire_time = monotonic_ms() + timeout_ms;
+	s->ack_time = 0;
+	s->ack_segments = 0;
+	s->rtt = rtt;
 	s->next_lseqnum = next_lseqnum;
 	s->have_fin = 0;
+	s->step = 0;
 	s->first_rseqnum = first_rseqnum + 1;
-	s->max_rseqnum = s->first_rseqnum;
-#ifndef NDEBUG
-	memset(TCP_PTR_STATE_BUF(&p), 0, TCP_BUFFER_LEN);
-#endif
+	s->contig = 0;
+	s->n_ranges = 0;
+	s->buf = NULL;
+	s->buf_size = 0;
+	index_insert(sh, i);
+	wheel_insert(sh, i);
+
+	pthread_mutex_unlock(&sh->lock);
+	return 1;
+}
 
-	tcp_state_unlock(&p);
+unsigned int tcp_state_count(void)
+{
+	return atomic_load(&session_count);
 }
 
 int tcp_state_find(const uint8_t *srcaddr, uint16_t srcport, tcp_state_ptr *out_p)
 {
-	return internal_find(srcaddr, srcport, out_p) ? 1 : 0;
+	const uint64_t hash = hash_key(srcaddr, srcport);
+	struct tcp_shard *sh = shard_for(hash);
+	uint32_t i;
+
+	pthread_mutex_lock(&sh->lock);
+	if(!internal_find(sh, hash, srcaddr, srcport, &i)) {
+		pthread_mutex_unlock(&sh->lock);
+		return 0;
+	}
+	out_p->c = sh;
+	out_p->i = i;
+	// sh->lock remains locked, to be unlocked by tcp_state_unlock
+	return 1;
 }
 
-int tcp_state_next_expired(int timeout, tcp_state_ptr *out_p)
+int tcp_state_next_expired(tcp_state_ptr *out_p)
 {
-	struct tcp_states_chunk *cur = first;
-	uint16_t i;
-	const uint64_t lower = monotonic_ms() - timeout;
-
-	pthread_mutex_lock(&cur->lock);
-	do {
-		for(i = 0; i < TCP_STATES_PER_CHUNK; i++) {
-			if(cur->s[i].srcport == 0)
-				continue;
-			if(cur->s[i].creation_time <= lower)
-				goto found;
+	const uint64_t now = monotonic_ms();
+
+	// resume at the shard that last had something, only called from one thread
+	static int cursor;
+	for(int j = 0; j < TCP_SHARDS; j++, cursor = (cursor + 1) % TCP_SHARDS) {
+		struct tcp_shard *sh = &shards[cursor];
+		uint32_t i;
+		pthread_mutex_lock(&sh->lock);
+		if(wheel_pop(sh, now, &i)) {
+			out_p->c = sh;
+			out_p->i = i;
+			// sh->lock remains locked, to be unlocked by tcp_state_unlock
+			return sh->s[i].expire_time <= now ? TCP_STATE_EXPIRED : TCP_STATE_ACK_DUE;
 		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	return 0;
+}
 
-		struct tcp_states_chunk *next = cur->next;
-		if(!next) {
-			pthread_mutex_unlock(&cur->lock);
-			return 0;
-		}
+void tcp_state_set_timeout(tcp_state_ptr *p, int timeout_ms)
+{
+	struct tcp_shard *sh = TCP_PTR_SHARD(p);
+	wheel_remove(sh, p->i);
+	sh->s[p->i].expire_time = monotonic_ms() + timeout_ms;
+	wheel_insert(sh, p->i);
+}
 
-		pthread_mutex_lock(&next->lock);
-		pthread_mutex_unlock(&cur->lock);
-		cur = next;
-	} while(1);
+uint32_t tcp_state_push(tcp_state_ptr *p, const void *data, uint32_t length, uint32_t seqnum, uint32_t *acknum)
+{
+	internal_push(p, data, length, seqnum);
+	struct tcp_state *s = &TCP_PTR_STATE(p);
+	if(s->contig >= buffer_max) {
+		// we're not going to store more, so accept anything
+		uint32_t end = seqnum + length;
+		*acknum = (int32_t)(end - (s->first_rseqnum + s->contig)) > 0 ?
+			end : s->first_rseqnum + s->contig;
+	} else {
+		*acknum = s->first_rseqnum + s->contig;
+	}
+	return s->contig;
+}
 
-found:
-	out_p->c = cur;
-	out_p->i = i;
-	// cur->lock remains locked, to be unlocked by tcp_state_unlock
-	return 1;
+int tcp_state_delay_ack(tcp_state_ptr *p, uint32_t acknum, int have_ts, uint32_t tsval, int delay_ms)
+{
+	struct tcp_shard *sh = TCP_PTR_SHARD(p);
+	struct tcp_state *s = &sh->s[p->i];
+	s->ack_num = acknum;
+	s->ack_have_ts = have_ts;
+	s->ack_tsval = tsval;
+	if(s->ack_segments < UINT8_MAX)
+		s->ack_segments++;
+	if(!s->ack_time) {
+		wheel_remove(sh, p->i);
+		s->ack_time = monotonic_ms() + delay_ms;
+		wheel_insert(sh, p->i);
+	}
+	return s->ack_segments;
 }
 
-void tcp_state_push(tcp_state_ptr *p, void *data, uint32_t length, uint32_t seqnum)
+int tcp_state_take_ack(tcp_state_ptr *p, uint32_t *acknum, int *have_ts, uint32_t *tsval)
 {
-	internal_push(p, data, length, seqnum);
+	struct tcp_shard *sh = TCP_PTR_SHARD(p);
+	struct tcp_state *s = &sh->s[p->i];
+	if(!s->ack_time)
+		return 0;
+	*acknum = s->ack_num;
+	*have_ts = s->ack_have_ts;
+	*tsval = s->ack_tsval;
+	wheel_remove(sh, p->i);
+	s->ack_time = 0;
+	s->ack_segments = 0;
+	wheel_insert(sh, p->i);
+	return 1;
 }
 
 uint32_t tcp_state_add_seqnum(tcp_state_ptr *p, uint32_t add)
@@ -165,18 +362,31 @@ void tcp_state_set_fin(tcp_state_ptr *p)
 	TCP_PTR_STATE(p).have_fin = 1;
 }
 
+int tcp_state_get_step(tcp_state_ptr *p)
+{
+	return TCP_PTR_STATE(p).step;
+}
+
+void tcp_state_set_step(tcp_state_ptr *p, int step)
+{
+	TCP_PTR_STATE(p).step = step;
+}
+
 
-void *tcp_state_get_buffer(tcp_state_ptr *p, uint32_t *length)
+const void *tcp_state_get_buffer(tcp_state_ptr *p, uint32_t *length)
 {
 	struct tcp_state *s = &TCP_PTR_STATE(p);
-	*length = s->max_rseqnum - s->first_rseqnum;
-	return TCP_PTR_STATE_BUF(p);
+	if(s->n_ranges > 0)
+		log_debug("%d out-of-order ranges never became contiguous in state %p[%d]", s->n_ranges, p->c, (int)p->i);
+	*length = s->contig;
+	return s->buf;
 }
 
-void tcp_state_get_misc(tcp_state_ptr *p, uint64_t *timestamp, int *fin)
+void tcp_state_get_misc(tcp_state_ptr *p, uint64_t *timestamp, uint32_t *rtt, int *fin)
 {
 	struct tcp_state *s = &TCP_PTR_STATE(p);
 	*timestamp = s->saved_timestamp;
+	*rtt = s->rtt;
 	*fin = s->have_fin;
 }
 
@@ -189,118 +399,377 @@ const uint8_t *tcp_state_get_remote(tcp_state_ptr *p, uint16_t *port)
 
 void tcp_state_delete(tcp_state_ptr *p)
 {
-	TCP_PTR_STATE(p).srcport = 0; // invalidate the entry
+	struct tcp_shard *sh = TCP_PTR_SHARD(p);
+	index_remove(sh, p->i);
+	wheel_remove(sh, p->i);
+	if(sh->s[p->i].buf)
+		buffer_free(sh->s[p->i].buf);
+	sh->s[p->i].srcport = 0; // invalidate the entry
+	sh->s[p->i].wheel_next = sh->free_head;
+	sh->free_head = p->i + 1;
+	sh->count--;
+	atomic_fetch_sub(&session_count, 1);
 	tcp_state_unlock(p);
 }
 
 void tcp_state_unlock(tcp_state_ptr *p)
 {
-	assert(p->i <= TCP_STATES_PER_CHUNK);
-	pthread_mutex_unlock(&TCP_PTR_CHUNK(p)->lock);
+	assert(p->i < TCP_PTR_SHARD(p)->used);
+	pthread_mutex_unlock(&TCP_PTR_SHARD(p)->lock);
 	p->c = NULL;
 }
 
 
-static int create_chunk(struct tcp_states_chunk **dest)
+static inline uint64_t hash_key(const uint8_t *srcaddr, uint16_t srcport)
+{
+	uint64_t a, b;
+	memcpy(&a, &srcaddr[0], 8);
+	memcpy(&b, &srcaddr[8], 8);
+	// splitmix64-style finalizer over the mixed key
+	uint64_t h = hash_seed ^ a ^ (b * UINT64_C(0x9e3779b97f4a7c15)) ^ ((uint64_t)srcport << 48);
+	h = (h ^ (h >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	h = (h ^ (h >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return h ^ (h >> 31);
+}
+
+static inline struct tcp_shard *shard_for(uint64_t hash)
+{
+	// top bits select the shard, the index uses the bottom bits
+	return &shards[hash >> (64 - TCP_SHARD_BITS)];
+}
+
+static int shard_init(struct tcp_shard *sh)
 {
-	struct tcp_states_chunk *cur = calloc(1, sizeof(struct tcp_states_chunk));
-	if(!cur)
+	memset(sh, 0, sizeof(*sh));
+	if(pthread_mutex_init(&sh->lock, NULL) < 0)
 		return -1;
-	if(pthread_mutex_init(&cur->lock, NULL) < 0) {
-		free(cur);
+	sh->wheel = calloc(TCP_WHEEL_SLOTS, sizeof(uint32_t));
+	if(!sh->wheel)
 		return -1;
+	sh->wheel_time = monotonic_ms();
+	return shard_grow(sh);
+}
+
+static int shard_grow(struct tcp_shard *sh)
+{
+	uint32_t new_capacity = sh->capacity ? sh->capacity * 2 : TCP_SHARD_INITIAL;
+
+	// keep the index at most half full
+	uint32_t *index = calloc(new_capacity * 2, sizeof(uint32_t));
+	if(!index)
+		return -1;
+	void *tmp = realloc(sh->s, new_capacity * sizeof(struct tcp_state));
+	if(!tmp) {
+		free(index);
+		return -1;
+	}
+	sh->s = tmp;
+	sh->capacity = new_capacity;
+
+	free(sh->index);
+	sh->index = index;
+	sh->index_mask = new_capacity * 2 - 1;
+	for(uint32_t i = 0; i < sh->used; i++) {
+		if(sh->s[i].srcport != 0)
+			index_insert(sh, i);
 	}
-	*dest = cur;
 	return 0;
 }
 
-static void internal_find_empty(tcp_state_ptr *out_p)
+static int internal_alloc(struct tcp_shard *sh, uint32_t *out_i)
 {
-	struct tcp_states_chunk *cur = first;
-	uint16_t i;
+	if(sh->free_head) {
+		*out_i = sh->free_head - 1;
+		sh->free_head = sh->s[*out_i].wheel_next;
+	} else {
+		if(sh->used == sh->capacity && shard_grow(sh) < 0)
+			return -1;
+		*out_i = sh->used++;
+	}
+	sh->count++;
+	return 0;
+}
 
-	pthread_mutex_lock(&cur->lock);
-	do {
-		for(i = 0; i < TCP_STATES_PER_CHUNK; i++) {
-			if(cur->s[i].srcport == 0)
-				goto found;
+static int internal_find(struct tcp_shard *sh, uint32_t hash, const uint8_t *srcaddr, uint16_t srcport, uint32_t *out_i)
+{
+	for(uint32_t b = hash & sh->index_mask; sh->index[b] != 0; b = (b + 1) & sh->index_mask) {
+		const struct tcp_state *s = &sh->s[sh->index[b] - 1];
+		if(s->hash == hash && s->srcport == srcport && !memcmp(s->srcaddr, srcaddr, 16)) {
+			*out_i = sh->index[b] - 1;
+			return 1;
 		}
+	}
+	return 0;
+}
 
-		if(!cur->next) {
-			if(create_chunk(&cur->next) < 0) {
-				log_error("Ran out of memory for TCP sessions");
-				abort();
-			}
-		}
+static void index_insert(struct tcp_shard *sh, uint32_t i)
+{
+	uint32_t b = sh->s[i].hash & sh->index_mask;
+	while(sh->index[b] != 0)
+		b = (b + 1) & sh->index_mask;
+	sh->index[b] = i + 1;
+}
 
-		struct tcp_states_chunk *next = cur->next;
-		pthread_mutex_lock(&next->lock);
-		pthread_mutex_unlock(&cur->lock);
-		cur = next;
-	} while(1);
+static void index_remove(struct tcp_shard *sh, uint32_t i)
+{
+	const uint32_t mask = sh->index_mask;
+	uint32_t b = sh->s[i].hash & mask;
+	while(sh->index[b] != i + 1)
+		b = (b + 1) & mask;
+
+	// shift following entries back so that no probe sequence is interrupted
+	uint32_t next = b;
+	while(1) {
+		next = (next + 1) & mask;
+		if(sh->index[next] == 0)
+			break;
+		uint32_t home = sh->s[sh->index[next] - 1].hash & mask;
+		// can the entry at next be moved to b? (is home cyclically outside of (b, next]?)
+		if(((next - home) & mask) >= ((next - b) & mask)) {
+			sh->index[b] = sh->index[next];
+			b = next;
+		}
+	}
+	sh->index[b] = 0;
+}
 
-found: ;
-	out_p->c = cur;
-	out_p->i = i;
-	// cur->lock remains locked, to be unlocked by tcp_state_unlock
+static void wheel_insert(struct tcp_shard *sh, uint32_t i)
+{
+	struct tcp_state *s = &sh->s[i];
+	uint64_t t = s->expire_time;
+	if(s->ack_time && s->ack_time < t)
+		t = s->ack_time;
+	if(t < sh->wheel_time)
+		t = sh->wheel_time;
+	else if(t - sh->wheel_time >= TCP_WHEEL_SLOTS) // past horizon, revisited later
+		t = sh->wheel_time + TCP_WHEEL_SLOTS - 1;
+
+	s->wheel_slot = t & (TCP_WHEEL_SLOTS - 1);
+	s->wheel_prev = 0;
+	s->wheel_next = sh->wheel[s->wheel_slot];
+	if(s->wheel_next)
+		sh->s[s->wheel_next - 1].wheel_prev = i + 1;
+	sh->wheel[s->wheel_slot] = i + 1;
+	s->in_wheel = 1;
+	sh->wheel_count++;
 }
 
-static int internal_find(const uint8_t *srcaddr, uint16_t srcport, tcp_state_ptr *out_p)
+static void wheel_remove(struct tcp_shard *sh, uint32_t i)
 {
-	struct tcp_states_chunk *cur = first;
-	uint16_t i;
+	struct tcp_state *s = &sh->s[i];
+	if(!s->in_wheel)
+		return;
+	if(s->wheel_prev)
+		sh->s[s->wheel_prev - 1].wheel_next = s->wheel_next;
+	else
+		sh->wheel[s->wheel_slot] = s->wheel_next;
+	if(s->wheel_next)
+		sh->s[s->wheel_next - 1].wheel_prev = s->wheel_prev;
+	s->in_wheel = 0;
+	sh->wheel_count--;
+}
 
-	pthread_mutex_lock(&cur->lock);
-	do {
-		for(i = 0; i < TCP_STATES_PER_CHUNK; i++) {
-			if(cur->s[i].srcport == srcport && !memcmp(cur->s[i].srcaddr, srcaddr, 16))
-				goto found;
+static int wheel_pop(struct tcp_shard *sh, uint64_t now, uint32_t *out_i)
+{
+	if(sh->wheel_count == 0) {
+		sh->wheel_time = now + 1;
+		return 0;
+	}
+	for(; sh->wheel_time <= now; sh->wheel_time++) {
+		uint32_t next = sh->wheel[sh->wheel_time & (TCP_WHEEL_SLOTS - 1)];
+		while(next) {
+			uint32_t i = next - 1;
+			next = sh->s[i].wheel_next;
+			wheel_remove(sh, i);
+			const struct tcp_state *s = &sh->s[i];
+			if(s->expire_time <= now || (s->ack_time && s->ack_time <= now)) {
+				*out_i = i; // caller deletes or re-arms it
+				return 1;
+			}
+			wheel_insert(sh, i); // was past the horizon
 		}
+	}
+	return 0;
+}
 
-		struct tcp_states_chunk *next = cur->next;
-		if(!next) {
-			pthread_mutex_unlock(&cur->lock);
-			return 0;
-		}
+static void internal_push(tcp_state_ptr *p, const char *data, uint32_t length, uint32_t seqnum)
+{
+	struct tcp_state *s = &TCP_PTR_STATE(p);
+	// relative to the start, this correctly handles seqnum wraparound
+	int32_t rel = seqnum - s->first_rseqnum;
+	if(rel < 0) {
+		// retransmission overlapping the start
+		if((uint32_t) -rel >= length)
+			return;
+		data += -rel;
+		length -= -rel;
+		rel = 0;
+	}
 
-		pthread_mutex_lock(&next->lock);
-		pthread_mutex_unlock(&cur->lock);
-		cur = next;
-	} while(1);
+	uint32_t offset = rel;
+	if(offset >= buffer_max) {
+		log_debug("%u bytes are past buffer end in state %p[%d]", length, p->c, (int)p->i);
+		return;
+	} else if(offset + length > buffer_max) {
+		log_debug("%u bytes are partially past buffer end in state %p[%d]", length, p->c, (int)p->i);
+		length = buffer_max - offset;
+	}
+	if(length == 0)
+		return;
+	if(offset + length > s->buf_size) {
+		// grow to the next size class that fits
+		int cls = 0;
+		while((1U << (TCP_BUFFER_MIN_SHIFT + cls)) < offset + length)
+			cls++;
+		char *buffer = buffer_alloc(cls);
+		if(!buffer) {
+			log_debug("failed to grow buffer in state %p[%d]", p->c, (int)p->i);
+			return;
+		}
+		if(s->buf) {
+			memcpy(buffer, s->buf, s->buf_size);
+			buffer_free(s->buf);
+		}
+		s->buf = buffer;
+		s->buf_size = 1U << (TCP_BUFFER_MIN_SHIFT + cls);
+	}
+	memcpy(&s->buf[offset], data, length);
 
-found:
-	out_p->c = cur;
-	out_p->i = i;
-	// cur->lock remains locked, to be unlocked by tcp_state_unlock
-	return 1;
+	if(offset > s->contig)
+		log_debug("out-of-order segment (missing %u) in state %p[%d]", offset - s->contig, p->c, (int)p->i);
+	range_add(s, offset, offset + length);
 }
 
-static void internal_push(tcp_state_ptr *p, void *data, uint32_t length, uint32_t seqnum)
+static void range_add(struct tcp_state *s, uint16_t start, uint16_t end)
 {
-	struct tcp_state *s = &TCP_PTR_STATE(p);
-	if(seqnum < s->first_rseqnum) // pretend seqnum wraparound doesn't exist
+	if(start <= s->contig) {
+		if(end <= s->contig)
+			return;
+		s->contig = end;
+		// swallow ranges that are now reachable
+		int n = 0;
+		while(n < s->n_ranges && s->ranges[n].start <= s->contig) {
+			if(s->ranges[n].end > s->contig)
+				s->contig = s->ranges[n].end;
+			n++;
+		}
+		memmove(&s->ranges[0], &s->ranges[n], (s->n_ranges - n) * sizeof(s->ranges[0]));
+		s->n_ranges -= n;
 		return;
+	}
 
-	uint32_t offset = seqnum - s->first_rseqnum;
-	if(offset > TCP_BUFFER_LEN) {
-		log_debug("%u bytes are past buffer end in state %p[%d]", length, p->c, (int)p->i);
+	// find the first range that ends at or after start
+	int i = 0;
+	while(i < s->n_ranges && s->ranges[i].end < start)
+		i++;
+	// merge with all that overlap or touch
+	int j = i;
+	while(j < s->n_ranges && s->ranges[j].start <= end) {
+		if(s->ranges[j].start < start)
+			start = s->ranges[j].start;
+		if(s->ranges[j].end > end)
+			end = s->ranges[j].end;
+		j++;
+	}
+	if(i == j && s->n_ranges == TCP_MAX_RANGES) {
+		// no space, the data will have to be retransmitted
 		return;
-	} else if(offset + length > TCP_BUFFER_LEN) {
-		log_debug("%u bytes are partially past buffer end in state %p[%d]", length, p->c, (int)p->i);
-		length = TCP_BUFFER_LEN - offset;
 	}
-	char *buffer = TCP_PTR_STATE_BUF(p);
-	memcpy(&buffer[offset], data, length);
-
-	if(seqnum > s->max_rseqnum) {
-		uint32_t count = seqnum - s->max_rseqnum;
-		offset = s->max_rseqnum - s->first_rseqnum;
-		// seqnum discontinuity, fill the hole with zeros.
-		// the previous packet might still arrive and fill the hole,
-		// but if it doesn't we don't want uninitialized data lying around.
-		log_debug("discontinuity in seqnums (missing %u) in state %p[%d]", count, p->c, (int)p->i);
-		memset(&buffer[offset], 0, count);
+	// replace ranges [i, j) with the merged one
+	memmove(&s->ranges[i + 1], &s->ranges[j], (s->n_ranges - j) * sizeof(s->ranges[0]));
+	s->n_ranges = s->n_ranges - (j - i) + 1;
+	s->ranges[i].start = start;
+	s->ranges[i].end = end;
+}
+
+static struct tcp_slab *slab_create(int cls)
+{
+	// over-allocate so we can cut out an aligned region
+	char *p = mmap(NULL, TCP_SLAB_SIZE * 2, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED)
+		return NULL;
+	uintptr_t misalign = (uintptr_t)p & (TCP_SLAB_SIZE - 1);
+	char *start = misalign ? p + (TCP_SLAB_SIZE - misalign) : p;
+	if(start > p)
+		munmap(p, start - p);
+	if(start + TCP_SLAB_SIZE < p + TCP_SLAB_SIZE * 2)
+		munmap(start + TCP_SLAB_SIZE, (p + TCP_SLAB_SIZE * 2) - (start + TCP_SLAB_SIZE));
+
+	struct tcp_slab *slab = (struct tcp_slab*) start;
+	const uint32_t size = 1U << (TCP_BUFFER_MIN_SHIFT + cls);
+	slab->prev = slab->next = NULL;
+	slab->free = NULL;
+	slab->used = 0;
+	slab->cls = cls;
+	// first block is taken by the header
+	for(uint32_t off = TCP_SLAB_SIZE - size; off >= size; off -= size) {
+		void **block = (void**) &start[off];
+		*block = slab->free;
+		slab->free = block;
+	}
+	return slab;
+}
+
+static char *buffer_alloc(int cls)
+{
+	char *ret = NULL;
+
+	pthread_mutex_lock(&buffer_pool[cls].lock);
+	struct tcp_slab *slab = buffer_pool[cls].partial;
+	if(!slab) {
+		slab = slab_create(cls);
+		if(!slab)
+			goto out;
+		buffer_pool[cls].partial = slab;
+		buffer_pool[cls].slabs++;
+		if(buffer_pool[cls].slabs > buffer_pool[cls].peak_slabs)
+			buffer_pool[cls].peak_slabs = buffer_pool[cls].slabs;
+	}
+
+	ret = slab->free;
+	slab->free = *(void**) ret;
+	slab->used++;
+	if(!slab->free) {
+		// full, take it off the list
+		buffer_pool[cls].partial = slab->next;
+		if(slab->next)
+			slab->next->prev = NULL;
+		slab->next = NULL;
+	}
+out:
+	pthread_mutex_unlock(&buffer_pool[cls].lock);
+	return ret;
+}
+
+static void buffer_free(char *ptr)
+{
+	struct tcp_slab *slab = (struct tcp_slab*) ((uintptr_t)ptr & ~(uintptr_t)(TCP_SLAB_SIZE - 1));
+	const int cls = slab->cls;
+
+	pthread_mutex_lock(&buffer_pool[cls].lock);
+	if(!slab->free) {
+		// was full, put it back on the list
+		slab->prev = NULL;
+		slab->next = buffer_pool[cls].partial;
+		if(slab->next)
+			slab->next->prev = slab;
+		buffer_pool[cls].partial = slab;
+	}
+	*(void**) ptr = slab->free;
+	slab->free = ptr;
+	slab->used--;
+
+	if(slab->used == 0 && (slab->prev || slab->next)) {
+		// not the only slab left, give it back
+		if(slab->prev)
+			slab->prev->next = slab->next;
+		else
+			buffer_pool[cls].partial = slab->next;
+		if(slab->next)
+			slab->next->prev = slab->prev;
+		munmap(slab, TCP_SLAB_SIZE);
+		buffer_pool[cls].slabs--;
 	}
-	if(seqnum + length > s->max_rseqnum)
-		s->max_rseqnum = seqnum + length;
+	pthread_mutex_unlock(&buffer_pool[cls].lock);
 }
@@ -53,10 +53,44 @@ void tcp_make_ack(struct tcp_header *pkt, uint32_t seqnum, uint32_t acknum)
 	pkt->acknum = htobe32(acknum);
 }
 
+void tcp_set_options(struct tcp_header *pkt, unsigned int optlen)
+{
+	assert(optlen % 4 == 0 && optlen <= 40);
+	pkt->offset = (TCP_HEADER_SIZE + optlen) >> 2;
+}
+
+void tcp_set_window(struct tcp_header *pkt, uint16_t winsz)
+{
+	pkt->winsz = htobe16(winsz);
+}
+
+void tcp_option_mss(struct tcp_header *pkt, unsigned int off, uint16_t mss)
+{
+	uint8_t *opt = (uint8_t*) pkt + TCP_HEADER_SIZE + off;
+	opt[0] = 2; // Maximum Segment Size
+	opt[1] = 4;
+	mss = htobe16(mss);
+	memcpy(&opt[2], &mss, 2);
+}
+
+void tcp_option_timestamp(struct tcp_header *pkt, unsigned int off, uint32_t tsval, uint32_t tsecr)
+{
+	uint8_t *opt = (uint8_t*) pkt + TCP_HEADER_SIZE + off;
+	opt[0] = 1; // NOP
+	opt[1] = 1; // NOP
+	opt[2] = 8; // Timestamps
+	opt[3] = 10;
+	tsval = htobe32(tsval);
+	tsecr = htobe32(tsecr);
+	memcpy(&opt[4], &tsval, 4);
+	memcpy(&opt[8], &tsecr, 4);
+}
+
 void tcp_checksum(const struct frame_ip *ipf, struct tcp_header *pkt, uint16_t dlen)
 {
+	const unsigned int hdrlen = pkt->offset << 2;
 	_Alignas(uint16_t) struct pseudo_header ph = {
-		.len = htobe32(TCP_HEADER_SIZE + dlen),
+		.len = htobe32(hdrlen + dlen),
 		.zero = {0},
 		.ipproto = 0x06, // IPPROTO_TCP
 	};
@@ -69,7 +103,7 @@ void tcp_checksum(const struct frame_ip *ipf, struct tcp_header *pkt, uint16_t d
 	csum = chksum(csum, ipf->dest, 16); // ph->dest
 	csum = chksum(csum, &ph.len, 8); // rest of ph
 	pkt->csum = 0;
-	pkt->csum = chksum_final(csum, pkt, TCP_HEADER_SIZE + dlen); // packet contents + data
+	pkt->csum = chksum_final(csum, pkt, hdrlen + dlen); // packet contents + data
 }
 
 void tcp_decode_header(const struct tcp_header *pkt, unsigned int *data_offset)
@@ -96,6 +130,35 @@ void tcp_decode2(const struct tcp_header *pkt, uint32_t *seqnum, uint32_t *acknu
 		*acknum = be32toh(pkt->acknum);
 }
 
+int tcp_decode_timestamp(const struct tcp_header *pkt, uint32_t *tsval, uint32_t *tsecr)
+{
+	const uint8_t *opt = (const uint8_t*) pkt + TCP_HEADER_SIZE;
+	unsigned int i = 0, optlen;
+	tcp_decode_header(pkt, &optlen);
+	optlen -= TCP_HEADER_SIZE;
+
+	while(i < optlen) {
+		if(opt[i] == 0) // End of Option List
+			break;
+		if(opt[i] == 1) { // NOP
+			i++;
+			continue;
+		}
+		if(i + 1 >= optlen || opt[i+1] < 2 || i + opt[i+1] > optlen)
+			break; // malformed
+		if(opt[i] == 8 && opt[i+1] == 10) {
+			uint32_t tmp;
+			memcpy(&tmp, &opt[i+2], 4);
+			*tsval = be32toh(tmp);
+			memcpy(&tmp, &opt[i+6], 4);
+			*tsecr = be32toh(tmp);
+			return 1;
+		}
+		i += opt[i+1];
+	}
+	return 0;
+}
+
 static inline void reset_flags(struct tcp_header *pkt)
 {
 	pkt->f_fin = 0;
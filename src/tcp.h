@@ -6,6 +6,8 @@
 #include <stdint.h>
 
 #define TCP_HEADER_SIZE 20
+#define TCP_OPTION_MSS_SIZE 4
+#define TCP_OPTION_TIMESTAMP_SIZE 12 // incl. padding
 
 struct tcp_header {
 	uint16_t srcport; // Source port
@@ -29,7 +31,7 @@ struct tcp_header {
 } __attribute__((packed));
 typedef struct {
 	void *c;
-	uint16_t i;
+	uint32_t i;
 } tcp_state_ptr;
 struct frame_ip;
 
@@ -38,11 +40,18 @@ void tcp_modify(struct tcp_header *pkt, int srcport, int dstport);
 void tcp_make_syn(struct tcp_header *pkt, uint32_t seqnum);
 void tcp_make_rst(struct tcp_header *pkt, uint32_t seqnum);
 void tcp_make_ack(struct tcp_header *pkt, uint32_t seqnum, uint32_t acknum);
-void tcp_checksum(const struct frame_ip *ipf, struct tcp_header *pkt, uint16_t dlen);
+void tcp_set_options(struct tcp_header *pkt, unsigned int optlen); // sets data offset, options follow the header
+void tcp_set_window(struct tcp_header *pkt, uint16_t winsz);
+// these write options at offset <off> after the header, use tcp_set_options() for the total
+void tcp_option_mss(struct tcp_header *pkt, unsigned int off, uint16_t mss);
+void tcp_option_timestamp(struct tcp_header *pkt, unsigned int off, uint32_t tsval, uint32_t tsecr);
+void tcp_checksum(const struct frame_ip *ipf, struct tcp_header *pkt, uint16_t dlen); // dlen excludes options
 
 void tcp_decode_header(const struct tcp_header *pkt, unsigned int *data_offset);
 void tcp_decode(const struct tcp_header *pkt, int *srcport, int *dstport);
 void tcp_decode2(const struct tcp_header *pkt, uint32_t *seqnum, uint32_t *acknum);
+// caller needs to ensure that the entire header incl. options is readable
+int tcp_decode_timestamp(const struct tcp_header *pkt, uint32_t *tsval, uint32_t *tsecr);
 
 static inline uint32_t tcp_first_seqnum(uint32_t rnd) {
 	rnd &= ~(1 << 15); // make room to avoid overflow
@@ -50,21 +59,38 @@ static inline uint32_t tcp_first_seqnum(uint32_t rnd) {
 }
 
 
-int tcp_state_init(void);
-void tcp_state_create(const uint8_t *srcaddr, uint16_t srcport,
-	uint64_t ts, uint32_t next_lseqnum, uint32_t first_rseqnum);
+int tcp_state_init(unsigned int max_buffer, unsigned int max_count); // max_count 0 = unlimited
+// returns 1 if created, 0 if it already exists, -1 if the table is full
+int tcp_state_create(const uint8_t *srcaddr, uint16_t srcport,
+	uint64_t ts, uint32_t rtt, uint32_t next_lseqnum, uint32_t first_rseqnum,
+	int timeout_ms);
+unsigned int tcp_state_count(void);
 void tcp_state_fini(void);
 
 // both will leave state locked for caller to unlock (or delete)
 int tcp_state_find(const uint8_t *srcaddr, uint16_t srcport, tcp_state_ptr *out_p);
-int tcp_state_next_expired(int timeout_ms, tcp_state_ptr *out_p);
+enum {
+	TCP_STATE_EXPIRED = 1, // delete it or set a new timeout
+	TCP_STATE_ACK_DUE, // call tcp_state_take_ack
+};
+// returns one of the above, state is taken off the expiry list
+int tcp_state_next_expired(tcp_state_ptr *out_p);
 
-void tcp_state_push(tcp_state_ptr *p, void *data, uint32_t length, uint32_t seqnum);
+// returns length of data received so far without gaps, acknum is set
+// to the seqnum up to which we have received everything
+uint32_t tcp_state_push(tcp_state_ptr *p, const void *data, uint32_t length, uint32_t seqnum, uint32_t *acknum);
+// schedules an ACK to be sent later (keeps the earlier deadline if one is pending),
+// returns number of segments that this ACK would cover
+int tcp_state_delay_ack(tcp_state_ptr *p, uint32_t acknum, int have_ts, uint32_t tsval, int delay_ms);
+int tcp_state_take_ack(tcp_state_ptr *p, uint32_t *acknum, int *have_ts, uint32_t *tsval);
 uint32_t tcp_state_add_seqnum(tcp_state_ptr *p, uint32_t add);
 void tcp_state_set_fin(tcp_state_ptr *p);
+int tcp_state_get_step(tcp_state_ptr *p);
+void tcp_state_set_step(tcp_state_ptr *p, int step);
+void tcp_state_set_timeout(tcp_state_ptr *p, int timeout_ms); // from now
 
-void *tcp_state_get_buffer(tcp_state_ptr *p, uint32_t *length); // writable!
-void tcp_state_get_misc(tcp_state_ptr *p, uint64_t *timestamp, int *fin);
+const void *tcp_state_get_buffer(tcp_state_ptr *p, uint32_t *length); // only contiguous data
+void tcp_state_get_misc(tcp_state_ptr *p, uint64_t *timestamp, uint32_t *rtt, int *fin);
 const uint8_t *tcp_state_get_remote(tcp_state_ptr *p, uint16_t *port);
 
 void tcp_state_delete(tcp_state_ptr *p);
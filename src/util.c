@@ -347,7 +347,7 @@ uint64_t rand64(void)
 	return ret;
 }
 
-static uint64_t monotonic_us(void)
+uint64_t monotonic_us(void)
 {
 	struct timespec t;
 #ifdef CLOCK_MONOTONIC_RAW
@@ -365,6 +365,14 @@ uint64_t monotonic_ms(void)
 	return monotonic_us() / 1000;
 }
 
+uint64_t realtime_us(void)
+{
+	struct timespec t;
+	if (clock_gettime(CLOCK_REALTIME, &t) != 0)
+		return 0;
+	return t.tv_sec * UINT64_C(1000000) + t.tv_nsec / 1000;
+}
+
 // UDP/TCP checksumming
 #if __has_builtin(__builtin_assume_aligned)
 #define assume_aligned(p, n) __builtin_assume_aligned(p, n)
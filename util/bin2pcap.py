@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 # SPDX-License-Identifier: CC0-1.0
+import io
 import sys
 import struct
 from typing import BinaryIO
@@ -12,14 +13,31 @@ RECORD_ALIGN = 8
 #	uint16_t version;
 # }
 # struct rec_header {
-#	uint64_t timestamp;
+#	uint64_t timestamp; // in us (version 1: in seconds)
 #	uint32_t size; // incl. header
 #	uint16_t port;
 #	uint8_t ttl; // ignored for banner records
 #	uint8_t proto_status; // (proto << 4) | status; status is ignored for banner records
 #	uint8_t addr[16];
+#	// version 2+:
+#	uint32_t rtt; // in us
+#	uint8_t prefix_len; // status aliased only
+#	uint8_t reserved[3];
 #	// banner data follows here
 # }
+# version 3+: records are grouped into blocks, each preceded by:
+# struct block_header {
+#	uint32_t size; // of the records following
+#	uint32_t count; // 0 = end of blocks
+#	uint8_t min_addr[16], max_addr[16];
+#	uint64_t min_timestamp, max_timestamp;
+#	uint16_t min_port, max_port;
+#	uint32_t kinds;
+#	uint32_t flags; // 1 = delta coded, 2 = compressed
+#	uint32_t raw_size; // if compressed
+# }
+BLOCK_FLAG_DELTA = 1
+BLOCK_FLAG_LZ = 2
 
 def skip_align(f: BinaryIO, read: int):
 	have = read % RECORD_ALIGN
@@ -50,10 +68,10 @@ def make_tcp(sport: int, datalen: int) -> bytes:
 def make_udp(sport: int, datalen: int) -> bytes:
 	return struct.pack("!HHHH", sport, 60001, 8 + datalen, 0xffff)
 
-def convert(fi: BinaryIO, fo: BinaryIO):
-	fmt = "<QLHBB16s"
+def convert(fi: BinaryIO, fo: BinaryIO, version: int):
+	fmt = "<QLHBB16s" if version == 1 else "<QLHBB16sLL"
 	hlen = struct.calcsize(fmt)
-	assert hlen == 32
+	assert hlen == (32 if version == 1 else 40)
 	n = 0
 	buf = bytearray(10240)
 	while True:
@@ -77,26 +95,79 @@ def convert(fi: BinaryIO, fo: BinaryIO):
 		fakehdr += data[5] # source addr
 		fakehdr += b"\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01" # dest addr
 
-		timestamp = data[0] if data[0] < 0xffffffff else 0xffffffff
+		sec, usec = (data[0], 0) if version == 1 else divmod(data[0], 1000000)
+		sec = min(sec, 0xffffffff)
 		total = len(fakehdr) + len(fakepkt) + len(my_buf)
-		pcaphdr = struct.pack("<LLLL", timestamp, 0, total, total)
+		pcaphdr = struct.pack("<LLLL", sec, usec, total, total)
 
 		fo.write(pcaphdr + fakehdr + fakepkt)
 		fo.write(my_buf)
 		n += 1
 	return n
 
+def lz_decompress(data: bytes, outlen: int) -> bytearray:
+	out = bytearray()
+	i = 0
+	def length(n):
+		nonlocal i
+		if n == 15:
+			while True:
+				b = data[i]; i += 1
+				n += b
+				if b != 255: break
+		return n
+	while len(out) < outlen:
+		token = data[i]; i += 1
+		n = length(token >> 4)
+		out += data[i:i+n]; i += n
+		if len(out) >= outlen: break
+		offset = data[i] | (data[i+1] << 8); i += 2
+		n = length(token & 15) + 4
+		for _ in range(n):
+			out.append(out[-offset])
+	assert len(out) == outlen
+	return out
+
+def delta_decode(buf: bytearray):
+	prev_addr, prev_ts = bytes(16), 0
+	pos = 0
+	while pos + 40 <= len(buf):
+		ts, size = struct.unpack_from("<QL", buf, pos)
+		prev_ts = (ts + prev_ts) & 0xffffffffffffffff
+		prev_addr = bytes(a ^ b for a, b in zip(buf[pos+16:pos+32], prev_addr))
+		struct.pack_into("<Q", buf, pos, prev_ts)
+		buf[pos+16:pos+32] = prev_addr
+		pos += (size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1)
+
+def convert_blocks(fi: BinaryIO, fo: BinaryIO) -> int:
+	fmt = "<LL16s16sQQHHLLL"
+	assert struct.calcsize(fmt) == 72
+	n = 0
+	while True:
+		data = readpacked(fi, fmt)
+		if not data or data[1] == 0: break
+		assert data[9] & ~(BLOCK_FLAG_DELTA | BLOCK_FLAG_LZ) == 0
+		block = fi.read(data[0])
+		if len(block) < data[0]: break # truncated
+		if data[9] & BLOCK_FLAG_LZ:
+			block = lz_decompress(block, data[10])
+		if data[9] & BLOCK_FLAG_DELTA:
+			block = bytearray(block)
+			delta_decode(block)
+		n += convert(io.BytesIO(block), fo, 2)
+	return n
+
 def main(filename_in, filename_out):
 	with open(filename_in, "rb") as fi:
 		hmagic, hver = readpacked(fi, "<LH", True)
 		assert hmagic == FILE_MAGIC
-		assert hver == 1
+		assert hver in (1, 2, 3)
 
 		with open(filename_out, "wb") as fo:
 			# https://www.tcpdump.org/manpages/pcap-savefile.5.html
 			fo.write(struct.pack("<LHHLLLL", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 229))
 
-			n = convert(fi, fo)
+			n = convert_blocks(fi, fo) if hver >= 3 else convert(fi, fo, hver)
 
 	print("Copied %d packets" % n)
 
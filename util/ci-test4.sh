@@ -70,4 +70,167 @@ check_out "Warning:.*are link-local "
 try --icmp ff02::2
 check_out "Warning:.*are multicast "
 
+## Binary scans
+
+# the dump interface gets no responses, so start from a hand-written
+# version 2 scan and let fi6s write it in the current format
+python3 - v2.bin update.bin <<'EOF'
+import random, struct, sys
+def begin(name):
+	global out
+	out = open(name, "wb")
+	out.write(struct.pack("<IHxx", 0x4e414373, 2))
+def rec(ts, net, host, proto, status, port, data=b""):
+	addr = bytes.fromhex("20010db8") + struct.pack(">HHQ", net, 0, host)
+	r = struct.pack("<QIHBB16sII", ts * 1000000, 40 + len(data), port, 64,
+		(proto << 4) | status, addr, 1234, 0) + data
+	out.write(r + bytes(-len(r) % 8))
+rnd = random.Random(1)
+begin(sys.argv[1])
+# several blocks with distinct address, port and time ranges
+for i in range(30000):
+	rec(1000 + i // 100, 1, i + 1, 0, 0, 80)
+for i in range(30000):
+	rec(2000 + i // 100, 2, i + 1, 0, 1, 443)
+for i in range(3000):
+	# banners with literal runs and repeats longer than 15+255 bytes
+	junk = bytes(rnd.randrange(32, 127) for _ in range(rnd.randrange(1, 600)))
+	rec(3000 + i // 100, 3, i + 1, 0, 0, 9999)
+	rec(3000 + i // 100, 3, i + 1, 0, 0, 9999, junk + b"fi6s" * rnd.randrange(0, 200) + junk[:300])
+for i in range(30000):
+	rec(4000 + i // 100, 4, i + 1, 2, 2, 0)
+# results that are newer, older or new compared to the above
+begin(sys.argv[2])
+for i in range(100):
+	rec(5000, 1, i + 1, 0, 1, 80)
+	rec(500, 1, i + 101, 0, 1, 80)
+rec(5000, 3, 1, 0, 0, 9999, b"new banner")
+rec(1, 3, 2, 0, 0, 9999, b"old banner")
+rec(5000, 5, 1, 0, 0, 22)
+out.close()
+EOF
+
+read_scan () {
+	((ntest+=1))
+	echo
+	echo "-> fi6s --readscan $*"
+	./fi6s --readscan "$@" 2>&1 >out.txt | tee log.txt
+}
+
+check_log () {
+	if ! grep -iq "$1" log.txt; then
+		echo "#$ntest: FAILED!"
+		exit 1
+	fi
+	echo "#$ntest: Passed"
+}
+
+check_same () {
+	if ! cmp "$1" "$2"; then
+		echo "#$ntest: FAILED!"
+		exit 1
+	fi
+	echo "#$ntest: Passed"
+}
+
+read_scan v2.bin -b --show-closed
+check_out "^tcp closed 443 2001:db8:2::1 2000$"
+cp out.txt ref.txt
+
+read_scan v2.bin -b --output-format binary -o scan.bin
+read_scan scan.bin -b --show-closed
+check_same out.txt ref.txt
+
+# (not a regular file)
+read_scan - -b --show-closed <scan.bin
+check_same out.txt ref.txt
+
+# interrupted before the index was written
+size=$(wc -c <scan.bin)
+index=$(od -An -tu8 -j $((size - 16)) -N8 scan.bin)
+head -c $index scan.bin >trunc.bin
+read_scan trunc.bin -b --show-closed
+check_log "has no index"
+check_same out.txt ref.txt
+
+# ... and in the middle of a block
+head -c $((index - 1000)) scan.bin >trunc.bin
+read_scan trunc.bin -b --show-closed
+check_log "last block was ignored"
+grep -v '^#' out.txt >part.txt
+grep -v '^#' ref.txt | head -n $(wc -l <part.txt) >out.txt
+check_same out.txt part.txt
+
+# compressed blocks
+read_scan v2.bin -b --output-format binary --compress -o packed.bin
+((ntest+=1))
+[ $(wc -c <packed.bin) -lt $((size / 2)) ] || { echo "#$ntest: FAILED!"; exit 1; }
+echo "#$ntest: Passed"
+read_scan packed.bin -b --show-closed
+check_same out.txt ref.txt
+read_scan - -b --show-closed <packed.bin
+check_same out.txt ref.txt
+
+# filters, records have to match what the unfiltered output has
+filter_test () {
+	local pattern=$1 file=$2
+	shift 2
+	read_scan $file -b --show-closed "$@"
+	grep -v '^#' out.txt >part.txt || :
+	grep -v '^#' ref.txt | grep -E "$pattern" >out.txt || :
+	check_same out.txt part.txt
+}
+
+filter_test '^[a-z]+ [a-z]+ 443 ' scan.bin --filter port=443
+filter_test ' 2001:db8:1::[0-3]?[0-9a-f]?[0-9a-f] ' scan.bin --filter net=2001:db8:1::/118
+filter_test '^[a-z]+ [a-z]+ [0-9]+ [0-9a-f:]+ 200[0-9]( |$)' packed.bin --filter time=2000-2009
+filter_test '^banner .*fi6sfi6s' packed.bin --filter banner=fi6sfi6s
+# (nothing in any block matches both)
+filter_test '^$' scan.bin --filter net=2001:db8:4::/48 --filter port=80
+
+# statistics
+cat >part.txt <<'EOF'
+# fi6s stats
+records 96000
+hosts 63000
+status tcp open 33000
+status tcp closed 30000
+banners tcp 3000
+status icmp up 30000
+service ? 3000
+port tcp 80 30000
+port tcp 9999 3000
+prefix 2001:db8:1::/48 30000
+prefix 2001:db8:4::/48 30000
+prefix 2001:db8:3::/48 3000
+EOF
+read_scan packed.bin --stats --stats-exact
+check_same out.txt part.txt
+
+read_scan - --stats --stats-prefix 32 <scan.bin
+check_out "^hosts ~6[0-5][0-9][0-9][0-9]$"
+check_out "^prefix 2001:db8::/32 63000$"
+
+# merging keeps the newest status and banner of each address, proto and port
+((ntest+=1))
+echo
+echo "-> fi6s --merge -b --merge-memory 1 -o merged.bin packed.bin update.bin"
+./fi6s --merge -b --merge-memory 1 -o merged.bin packed.bin update.bin 2>&1 | tee log.txt
+check_log "^Merged 96203 records using [2-9] run(s), dropped 202 duplicates"
+read_scan merged.bin -b --show-closed
+check_out "^tcp closed 80 2001:db8:1::64 5000$"
+check_out "^tcp open 80 2001:db8:1::c8 1001$"
+check_out "^banner tcp 9999 2001:db8:3::1 5000 .*new banner$"
+check_out "^tcp open 22 2001:db8:5::1 5000$"
+((ntest+=1))
+if grep -q "^tcp open 80 2001:db8:1::64 \|^tcp closed 80 2001:db8:1::c8 \|old banner" out.txt ||
+	[ $(grep -c "^banner tcp 9999 2001:db8:3::1 " out.txt) -ne 1 ] ||
+	[ $(grep -vc '^#' out.txt) -ne 96001 ]; then
+	echo "#$ntest: FAILED!"
+	exit 1
+fi
+echo "#$ntest: Passed"
+
+rm -f v2.bin update.bin scan.bin packed.bin merged.bin trunc.bin ref.txt part.txt log.txt
+
 exit 0